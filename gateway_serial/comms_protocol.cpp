@@ -11,15 +11,82 @@
 
 #include "comms_protocol.h"
 
-int currMsg = -1;
-int count = 0;
 unsigned long prevMilR;
 unsigned long prevMil;
 int msgCount = 0;
 
-cppQueue  relay_q(sizeof(char)*MAX_JSON_PAYLOAD_SIZE, MAX_R_QUEUE_SIZE, IMPLEMENTATION);
 cppQueue  msg_q(sizeof(Msg), MAX_QUEUE_SIZE, IMPLEMENTATION);
-aes256_context ctxt;
+KeyCacheEntry keyCache[KEY_CACHE_SIZE];
+unsigned long keyUseCount = 0;
+InFlight inFlight[MAX_IN_FLIGHT];
+byte nodeSlot[256];
+NodeState nodeState[N_NODES];
+#if LINK_STATS_ENABLED
+LinkStats linkStats[N_NODES];
+unsigned long prevMilLink = 0;
+unsigned int linkCursor = 0;
+#endif
+byte scanSlots = 0;
+byte registeredNodes = 0;
+bool scanActive = false;
+byte scanMsgID = 0;
+byte scanReplies = 0;
+unsigned long scanStart = 0;
+unsigned long scanWindow = 0;
+byte netProfile = 0;
+#if ADR_ENABLED
+AdrNode adrNodes[N_NODES];
+byte adrTarget = 0;
+unsigned long prevMilADR = 0;
+unsigned long adrLastJoin = 0;
+#endif
+int curSpreadingFactor = spreadingFactor;
+long curSignalBandwidth = signalBandwidth;
+int curCodingRateDenominator = codingRateDenominator;
+long airtimeBudget = (long)AIRTIME_BUCKET_SIZE * 1000;
+RxWindow rxWindows[RX_WINDOW_NODES];
+RecentFrame recentFrames[MULTIHOP_RECENT];
+byte recentNext = 0;
+unsigned long prevMilTx = 0;
+unsigned long tdmaStart = 0;
+unsigned long tdmaLastBeacon = 0;
+byte tdmaBeaconID = 0;
+volatile bool cadDone = false;
+volatile bool cadBusy = false;
+unsigned long prevMilDC = 0;
+byte relayBuf[RELAY_BUFFER_SIZE];
+int relayHead = 0;
+int relayUsed = 0;
+unsigned int relayDropped = 0;
+byte dlFrame[MAX_FRAME_SIZE];
+int dlFrameLen = 0;
+char dlLine[MAX_LINE_SIZE];
+int dlLineLen = 0;
+RxPacket rxRing[RX_RING_SIZE];
+volatile byte rxHead = 0;
+volatile byte rxTail = 0;
+volatile unsigned int rxDropped = 0;
+#if TRACE_ENABLED
+wsn::TraceRing<TRACE_RING_SIZE> traceRing;
+#endif
+
+#if defined(__AVR__)
+// Tables of the gateway and the core, see GATEWAY_RAM_RESERVE. The send queue is allocated on the heap
+static_assert(sizeof(keyCache) + sizeof(inFlight) + sizeof(nodeSlot) + sizeof(nodeState) + sizeof(rxWindows)
+              + sizeof(recentFrames) + sizeof(relayBuf) + sizeof(dlFrame) + sizeof(dlLine) + sizeof(rxRing)
+              + MAX_QUEUE_SIZE * sizeof(Msg) + sizeof(Serial) + sizeof(LoRa)
+  #if LINK_STATS_ENABLED
+              + sizeof(linkStats)
+  #endif
+  #if ADR_ENABLED
+              + sizeof(adrNodes)
+  #endif
+  #if TRACE_ENABLED
+              + sizeof(traceRing)
+  #endif
+              + GATEWAY_RAM_RESERVE <= RAMEND - RAMSTART + 1,
+              "nodeRegistry has more nodes than the RAM of this board holds, see GATEWAY_RAM_RESERVE");
+#endif
 
 
 /**
@@ -33,60 +100,202 @@ void LoRa_rxMode() {
 }
 
 /**
- * @brief Sets the LoRa radio to transmit mode
+ * @brief Sets the LoRa radio to transmit mode. With LBT_ENABLED, first runs a channel activity detection
+ *        with the transmit settings and reports whether the channel is free. The CAD takes over the DIO0
+ *        interrupt, so the receive callback is registered again once it is done
  * 
- * @return void
+ * @param toNode whether the frame goes to a node, with inverted IQ, instead of to a relay, which listens
+ *        like a gateway
+ * @return true if the frame can be sent, false if another transmission was detected
  */
-void LoRa_txMode() {
+bool LoRa_txMode(bool toNode) {
   LoRa.idle();                          // set standby mode
-  LoRa.enableInvertIQ();                // active invert I and Q signals
+  if (toNode)
+    LoRa.enableInvertIQ();              // active invert I and Q signals
+  else
+    LoRa.disableInvertIQ();
+  #if LBT_ENABLED
+    cadDone = false;
+    LoRa.onCadDone(onCadDone);
+    LoRa.channelActivityDetection();
+    unsigned long start = millis();
+    while (!cadDone && (millis() - start) < CAD_TIMEOUT)
+      delay(1);
+    LoRa.onReceive(onReceive);          // CAD done and RX done share DIO0: hand the interrupt back to reception
+    LoRa.idle();
+    if (cadDone && cadBusy)
+      return false;
+  #endif
+  return true;
+}
+
+/**
+ * @brief Called from the DIO0 interrupt when a channel activity detection ends
+ * 
+ * @param detected whether LoRa activity was detected
+ * @return void
+ */
+void onCadDone(boolean detected) {
+  cadBusy = detected;
+  cadDone = true;
 }
 
 /**
- * @brief Sets the radio to transmit mode, sends a message string using the LoRa radio
- *        and sets the radio back to receive mode
+ * @brief Sends a message string using the LoRa radio and sets the radio back to receive mode. Nodes that
+ *        are on another modem profile than the network, while a profile change is under way, are reached
+ *        on theirs. With MULTIHOP_ENABLED, relays and the nodes last heard through one are reached with a
+ *        relay frame
  * 
  * @param message message to send
  * @param nodeID ID of the destination node
- * @return void
+ * @return true if the message was sent, false if the channel was busy
  */
-void LoRa_sendMessage(byte *message, byte nodeID) {
-  LoRa_txMode();
-  LoRa.beginPacket();
-  LoRa.write(netID);
-  LoRa.write(nodeID);
-  LoRa.write(message, MAX_ENC_PAYLOAD_SIZE);
-  LoRa.endPacket(false);
+bool LoRa_sendMessage(byte *message, byte nodeID) {
+  TRACE(TRACE_TX);
+  #if ADR_ENABLED
+    byte profile = adrNodeProfile(nodeID);
+    if (profile != netProfile)
+      setModemProfile(profile);
+  #endif
+  bool clear = LoRa_sendFrame(MULTIHOP_ENABLED ? routeRelay(nodeID) : 0, wsn::RELAY_DOWN, nodeID, message, MAX_ENC_PAYLOAD_SIZE);
+  #if ADR_ENABLED
+    if (profile != netProfile)
+      setModemProfile(netProfile);
+  #endif
   LoRa_rxMode();
+  return clear;
+}
+
+/**
+ * @brief Sets the radio to transmit mode and sends a frame, to a node or, as a relay frame, to a relay. The
+ *        radio is left in transmit mode
+ * 
+ * @param relayID relay the frame is for, 0 to send it to the node itself
+ * @param hops Hops field of the relay header, RELAY_DOWN and possibly RELAY_PRUNE
+ * @param nodeID ID of the destination node
+ * @param message ciphertext of the frame
+ * @param len length of the ciphertext in bytes
+ * @return true if the frame was sent, false if the channel was busy
+ */
+bool LoRa_sendFrame(byte relayID, byte hops, byte nodeID, const byte *message, byte len) {
+  bool clear = LoRa_txMode(relayID == 0);
+  if (clear) {
+    LoRa.beginPacket();
+    LoRa.write(netID);
+    if (relayID != 0) {
+      LoRa.write(WSN_RELAY_FRAME);
+      LoRa.write(hops);
+      LoRa.write(relayID);
+    }
+    LoRa.write(nodeID);
+    LoRa.write(message, len);
+    LoRa.endPacket(false);
+    airtimeBudget -= timeOnAir(len + 2 + (relayID != 0 ? wsn::Relay::size : 0));
+    prevMilTx = millis();
+  }
+  return clear;
+}
+
+/**
+ * @brief Builds the index from node IDs to registry entries and counts the registered nodes. Entries with
+ *        an invalid or repeated ID are ignored. The highest registered ID sets the number of slots of a
+ *        network scan
+ * 
+ * @return void
+ */
+void initNodeRegistry() {
+  memset(nodeSlot, 0, sizeof(nodeSlot));
+  scanSlots = 0;
+  registeredNodes = 0;
+  for (unsigned int i=0; i<N_NODES; i++) {
+    byte nodeID = pgm_read_byte(&nodeRegistry[i].nodeID);
+    if (nodeID != 0 && nodeID != BROADCAST_ID && nodeSlot[nodeID] == 0) {
+      nodeSlot[nodeID] = i + 1;
+      registeredNodes ++;
+      if (nodeID > scanSlots)
+        scanSlots = nodeID;
+    }
+  }
+  memset(nodeState, 0, sizeof(nodeState));
+  #if LINK_STATS_ENABLED
+    memset(linkStats, 0, sizeof(linkStats));
+  #endif
+}
+
+/**
+ * @brief Looks up a node in the registry
+ * 
+ * @param nodeID ID of the node
+ * @return NodeState* runtime state of the node, or NULL if the node is not registered
+ */
+NodeState *findNode(byte nodeID) {
+  byte slot = nodeSlot[nodeID];
+  return slot ? &nodeState[slot - 1] : NULL;
 }
 
 /**
- * @brief Encrypts a message (character array) using the AES256 algorythm with the corresponding node key
- *        The encryption is made by encrypting blocks of 16 bytes and joining them together
+ * @brief Returns the expanded key schedule of a node, expanding its key only if it is not in the cache
+ *        already. When the cache is full the least recently used schedule is replaced
  * 
- * @param msg message array to be decrypted
+ * @param nodeID ID of the node, BROADCAST_ID for the broadcast key
+ * @return aes256_context* the key schedule, valid until the next call, or NULL if the node is not
+ *         registered
+ */
+aes256_context *getKeySchedule(byte nodeID) {
+  if (nodeID != BROADCAST_ID && nodeSlot[nodeID] == 0)
+    return NULL;
+
+  int lru = 0;
+  keyUseCount ++;
+  for (int i=0; i<KEY_CACHE_SIZE; i++) {
+    if (keyCache[i].used && keyCache[i].nodeID == nodeID) {
+      keyCache[i].lastUse = keyUseCount;
+      return &keyCache[i].ctxt;
+    }
+    if (!keyCache[i].used || (keyCache[lru].used && keyCache[i].lastUse < keyCache[lru].lastUse))
+      lru = i;
+  }
+
+  // Keys are read from flash only to expand them
+  uint8_t key[KEY_SIZE];
+  if (nodeID == BROADCAST_ID)
+    memcpy_P(key, broadcastKey, KEY_SIZE);
+  else
+    memcpy_P(key, nodeRegistry[nodeSlot[nodeID] - 1].key, KEY_SIZE);
+  aes256_init(&keyCache[lru].ctxt, key);
+  keyCache[lru].nodeID = nodeID;
+  keyCache[lru].lastUse = keyUseCount;
+  keyCache[lru].used = true;
+  return &keyCache[lru].ctxt;
+}
+
+/**
+ * @brief Encrypts a block packed by the message codec using the AES256 algorythm with the corresponding
+ *        node key
+ * 
+ * @param ctxt expanded key schedule of the node key
+ * @param msg plaintext block
  * @return byte* a byte array containing the encrypted message
  */
-byte *encrypt(char msg[MAX_PAYLOAD_SIZE]) {
-  String enc = "";
-  const char * p = msg;
+byte *encrypt(aes256_context *ctxt, const byte msg[BLOCK_SIZE]) {
   static byte plain [BLOCK_SIZE];
-  memset (plain, 0, BLOCK_SIZE);  // ensure trailing zeros
-  memcpy (plain, p, mymin (strlen (p), BLOCK_SIZE));
-  aes256_encrypt_ecb(&ctxt, plain);
+  memcpy (plain, msg, BLOCK_SIZE);
+  aes256_encrypt_ecb(ctxt, plain);
   return plain;
 }
 
 /**
  * @brief Decrypts a message string using the AES256 algorythm with the corresponding node key
  * 
+ * @param ctxt expanded key schedule of the node key
  * @param msg message string to be decrypted
  * @return char* an array of characters containing the decrypted message
  */
-char  *decryptMsg(char msg[MAX_PAYLOAD_SIZE+1]) {
+char  *decryptMsg(aes256_context *ctxt, char msg[MAX_PAYLOAD_SIZE+1]) {
+  TRACE(TRACE_DECRYPT);
   static char data[MAX_PAYLOAD_SIZE+1];
   memcpy(data, msg, MAX_PAYLOAD_SIZE+1);
-  aes256_decrypt_ecb(&ctxt, (uint8_t *)data);
+  aes256_decrypt_ecb(ctxt, (uint8_t *)data);
   return (char *)data;
 }
 
@@ -104,27 +313,103 @@ int mymin(int a, int b){
 }
 
 /**
- * @brief Send an acknowledge message confirming the reception of an uplink transmission
+ * @brief Records the reception of an uplink message in the state of its node. Retransmissions of a
+ *        message already received are flagged and counted in the state
+ * 
+ * @param nodeID ID of the node that sent the message, must be registered
+ * @param msgID ID of the received message
+ * @param duplicate set to whether the message was already received
+ * @return byte bitmap of the 7 msgIDs before msgID received from the same node (bit k for msgID-k-1)
+ */
+byte recordUplink(byte nodeID, byte msgID, bool *duplicate) {
+  uint16_t now = (uint16_t)(millis() / 1000);
+  NodeState *n = findNode(nodeID);
+
+  *duplicate = false;
+  if (!(n->flags & NODE_HEARD)) {
+    n->dups = 0;
+    n->flags |= NODE_HEARD;
+  } else if ((uint16_t)(now - n->lastSeen) <= DUPLICATE_WINDOW / 1000) {
+    n->lastSeen = now;
+    return slideHistory(n, msgID, duplicate);
+  }
+  n->lastMsgID = msgID;
+  n->mask = 0;
+  n->lastSeen = now;
+  return 0;
+}
+
+/**
+ * @brief Adds a msgID to the history of a node heard recently
+ * 
+ * @param h state of the node
+ * @param msgID ID of the received message
+ * @param duplicate set to whether the message was already received
+ * @return byte bitmap of the 7 msgIDs before msgID received from the same node (bit k for msgID-k-1)
+ */
+byte slideHistory(NodeState *h, byte msgID, bool *duplicate) {
+  byte d = (byte)(msgID - h->lastMsgID);
+  if (d > 0 && d < 128) {
+    // Newer message, slide the window forward
+    if (d > 7)
+      h->mask = 0;
+    else
+      h->mask = ((h->mask << d) | (1 << (d - 1))) & 0x7F;
+    h->lastMsgID = msgID;
+    return h->mask;
+  }
+
+  // Older message or retransmission of the last one
+  byte back = (byte)(h->lastMsgID - msgID);
+  if (back == 0 || (back <= 7 && (h->mask & (1 << (back - 1))))) {
+    *duplicate = true;
+    if (h->dups < 255)
+      h->dups ++;
+  }
+  if (back > 0 && back <= 7)
+    h->mask |= 1 << (back - 1);
+  if (back > 7)
+    return 0;
+  return (h->mask >> back) & 0x7F;
+}
+
+/**
+ * @brief Returns and clears the number of retransmissions from a node that were not relayed
+ * 
+ * @param nodeID ID of the node
+ * @return byte retransmissions since the last call for the node
+ */
+byte takeDuplicates(byte nodeID) {
+  NodeState *n = findNode(nodeID);
+  if (n == NULL)
+    return 0;
+  byte dups = n->dups;
+  n->dups = 0;
+  return dups;
+}
+
+/**
+ * @brief Send an acknowledge message confirming the reception of an uplink transmission. Besides the
+ *        acknowledged msgID, the message carries a bitmap of the previous msgIDs already received, so
+ *        nodes with several messages in flight can recover from lost acks
  * 
  * @param msgID ID of the message being acknowledged
  * @param nodeID ID of the destination node
+ * @param mask bitmap of the 7 msgIDs before msgID received from the node (bit k for msgID-k-1)
  * @return void
  */
-void sendAck(byte msgID, byte nodeID) {
-  String enc;
-  char payload[MAX_PAYLOAD_SIZE];
-  byte l = MAX_PAYLOAD_SIZE;
+void sendAck(byte msgID, byte nodeID, byte mask) {
+  TRACE(TRACE_ACK);
+  byte payload[BLOCK_SIZE];
   Msg msg;
 
-  sprintf(payload, "%c%c%c%c%c%c", (char)nodeID, (char)msgID, (char)l, 'a', (char)48, (char)48);
-
-  aes256_init(&ctxt, keys[(int)nodeID]);
+  // The top bit marks the field as a bitmap
+  wsn::Message m = {nodeID, msgID, 0, wsn::MSG_ACK, (byte)(0x80 | mask), 0, 0};
+  wsn::pack(payload, m);
 
-  byte *plain = encrypt(payload);
+  byte *plain = encrypt(getKeySchedule(nodeID), payload);
   memcpy(msg.msg, plain, MAX_PAYLOAD_SIZE);
   msg.msg[MAX_PAYLOAD_SIZE] = '\0';
-
-  aes256_done(&ctxt);
   
   msg.msgID = msgID;
   msg.flag = 'a';
@@ -133,46 +418,48 @@ void sendAck(byte msgID, byte nodeID) {
 }
 
 /**
- * @brief Send a status request message asking for a specific node to respond with a status update
+ * @brief Send a status request message asking for a specific node to respond with a status update. A
+ *        request to BROADCAST_ID starts a network scan: it carries the number of response slots in field
+ *        A and their length, in SCAN_SLOT_UNIT ms, in field B. Only one scan runs at a time
  * 
  * @param nodeID ID of the destination node
  * @return void
  */
 void sendStatusRequest(byte nodeID) {
   Msg msg;
-  String enc;
-
-  char payload[MAX_PAYLOAD_SIZE];
+  byte payload[BLOCK_SIZE];
   msgCount ++;
   if (msgCount == 0)
     msgCount ++;
   msg.msgID = (byte) msgCount;
   msg.flag = 's';
   msg.nodeID = nodeID;
-  byte l = (byte) MAX_PAYLOAD_SIZE;
-
-  sprintf(payload, "%c%c%c%c%c%c", (char)nodeID, (char)msg.msgID, (char)l, 's', (char)48, (char)48);
-
-  if (nodeID == BROADCAST_ID)
-    aes256_init(&ctxt, keys[0]);
-  else
-    aes256_init(&ctxt, keys[(int)nodeID]);
 
-  byte *plain = encrypt(payload);
-  memcpy(msg.msg, plain, MAX_PAYLOAD_SIZE);
-  msg.msg[MAX_PAYLOAD_SIZE] = '\0';
+  bool scan = nodeID == BROADCAST_ID;
+  wsn::Message m = {nodeID, msg.msgID, 0, wsn::MSG_STATUS, (byte)(scan ? scanSlots : 0), (byte)(scan ? scanSlotLength() : 0), 0};
+  wsn::pack(payload, m);
 
-  aes256_done(&ctxt);
+  // Requests to unregistered nodes fail at once
+  aes256_context *ctxt = getKeySchedule(nodeID);
+  if (ctxt != NULL) {
+    byte *plain = encrypt(ctxt, payload);
+    memcpy(msg.msg, plain, MAX_PAYLOAD_SIZE);
+    msg.msg[MAX_PAYLOAD_SIZE] = '\0';
+  }
 
-  if (!msg_q.push(&msg)){
-    char msgText[MAX_JSON_PAYLOAD_SIZE];
-    sprintf(msgText, "{\"t\":\"%lu\",\"msgID\":\"%d\",\"f\":\"%c\",\"nID\":\"%d\",\"status\":\"%d\"}", millis(), msg.msgID, 'd', msg.nodeID, 0);
-    relay_q.push(&msgText);
+  if (ctxt == NULL || (scan && (scanActive || isNodeInFlight(BROADCAST_ID))) || requestQueueFull() || !msg_q.push(&msg)){
+    Payload p;
+    p.msgID = msg.msgID;
+    p.flag = 'd';
+    p.nodeID = msg.nodeID;
+    p.sensorID = 0; // Using sensorID as status
+    relayPayload(p);
   }
 }
 
 /**
- * @brief Send a control message to set a value for a node's actuator
+ * @brief Send a control message to set a value for a node's actuator. A command that cannot be queued is
+ *        reported to the server as failed, like a status request
  * 
  * @param nodeID ID of the destination node
  * @param actID ID of the actuator to control
@@ -181,8 +468,7 @@ void sendStatusRequest(byte nodeID) {
  */
 void sendActuatorControl(byte nodeID, byte actID, byte actVal) {
   Msg msg;
-  String enc;
-  char payload[MAX_PAYLOAD_SIZE];
+  byte payload[BLOCK_SIZE];
   msgCount ++;
   if (msgCount == 0)
     msgCount ++;
@@ -191,136 +477,630 @@ void sendActuatorControl(byte nodeID, byte actID, byte actVal) {
   msg.actVal = actVal;
   msg.flag = 'c';
   msg.nodeID = nodeID;
-  byte l = (byte)MAX_PAYLOAD_SIZE;
 
-  sprintf(payload, "%c%c%c%c%c%c", (char)nodeID, (char)msg.msgID, (char)l, 'c', (char)actID, (char)actVal);
+  wsn::Message m = {nodeID, msg.msgID, 0, wsn::MSG_CONTROL, actID, actVal, 0};
+  wsn::pack(payload, m);
 
-  aes256_init(&ctxt, keys[(int)nodeID]);
+  // Commands to unregistered nodes fail at once
+  aes256_context *ctxt = getKeySchedule(nodeID);
+  if (ctxt != NULL) {
+    byte *plain = encrypt(ctxt, payload);
+    memcpy(msg.msg, plain, MAX_PAYLOAD_SIZE);
+    msg.msg[MAX_PAYLOAD_SIZE] = '\0';
+  }
 
-  byte *plain = encrypt(payload);
-  memcpy(msg.msg, plain, MAX_PAYLOAD_SIZE);
-  msg.msg[MAX_PAYLOAD_SIZE] = '\0';
+  if (ctxt == NULL || requestQueueFull() || !msg_q.push(&msg)){
+    Payload p;
+    p.msgID = msg.msgID;
+    p.flag = 'd';
+    p.nodeID = msg.nodeID;
+    p.sensorID = 0; // Using sensorID as status
+    relayPayload(p);
+  }
+}
 
-  aes256_done(&ctxt);
+/**
+ * @brief Whether the send queue has no room for another request. The last ACK_RESERVE slots are left
+ *        to acks
+ * 
+ * @return true if status requests and actuator commands cannot be queued
+ */
+bool requestQueueFull() {
+  return msg_q.getCount() >= MAX_QUEUE_SIZE - ACK_RESERVE;
+}
 
-  // Add msg to msg queue
-  msg_q.push(&msg);
+/**
+ * @brief Looks up the in-flight entry of a message
+ * 
+ * @param nodeID ID of the node the message was sent to
+ * @param msgID ID of the message
+ * @return int index of the entry in the in-flight table or -1 if there is none
+ */
+int findInFlight(byte nodeID, byte msgID) {
+  for (int i=0; i<MAX_IN_FLIGHT; i++)
+    if (inFlight[i].used && inFlight[i].msg.nodeID == nodeID && inFlight[i].msg.msgID == msgID)
+      return i;
+  return -1;
+}
+
+/**
+ * @brief Checks whether a node already has a message waiting for a response
+ * 
+ * @param nodeID ID of the node
+ * @return true if the node has an entry in the in-flight table
+ */
+bool isNodeInFlight(byte nodeID) {
+  for (int i=0; i<MAX_IN_FLIGHT; i++)
+    if (inFlight[i].used && inFlight[i].msg.nodeID == nodeID)
+      return true;
+  return false;
 }
 
 /**
- * @brief Get a message from the send queue and send it. Implements retransmission 
- *        in case an acknowledge message is not received. Aware of a failed transmission.
+ * @brief Marks a node as low-power and opens its receive window after one of its frames. A node that is
+ *        not tracked yet takes a free entry or the one whose window opened longest ago
+ * 
+ * @param nodeID ID of the node, must be registered
+ * @param currentMillis time the frame was received, in millisenconds since boot
+ * @return void
+ */
+void openRxWindow(byte nodeID, unsigned long currentMillis) {
+  findNode(nodeID)->flags |= NODE_LOW_POWER;
+  int old = 0;
+  for (int i=0; i<RX_WINDOW_NODES; i++) {
+    if (rxWindows[i].used && rxWindows[i].nodeID == nodeID) {
+      rxWindows[i].opened = currentMillis;
+      return;
+    }
+    if (!rxWindows[i].used || (rxWindows[old].used && (long)(rxWindows[old].opened - rxWindows[i].opened) > 0))
+      old = i;
+  }
+  rxWindows[old].nodeID = nodeID;
+  rxWindows[old].opened = currentMillis;
+  rxWindows[old].used = true;
+}
+
+/**
+ * @brief Checks whether a downlink sent now reaches the node. Low-power nodes only listen in the
+ *        receive window after their frames, other nodes and broadcasts are always reachable. Nodes not
+ *        heard yet are taken as always listening
+ * 
+ * @param nodeID ID of the destination node
+ * @param currentMillis current time in millisenconds since boot
+ * @return true if the downlink can be sent now
+ */
+bool nodeListening(byte nodeID, unsigned long currentMillis) {
+  NodeState *n = findNode(nodeID);
+  if (n == NULL || !(n->flags & NODE_LOW_POWER))
+    return true;
+  for (int i=0; i<RX_WINDOW_NODES; i++)
+    if (rxWindows[i].used && rxWindows[i].nodeID == nodeID)
+      return (currentMillis - rxWindows[i].opened) < RX_WINDOW - RX_WINDOW_GUARD;
+  return false;
+}
+
+/**
+ * @brief Get a message from the send queue and send it. Status requests and actuator commands are moved
+ *        to the in-flight table, one per node, where each one has its own retransmission counter and timer,
+ *        so a node that does not answer does not hold back the messages for the other nodes. Acknowledge
+ *        messages and prunes for relays are sent first and are not retransmitted. Aware of a failed
+ *        transmission.
  * 
  * @param currentMillis current time in millisenconds since boot
  * @return void
  */
 void getMsgFromQueueAndSend(unsigned long currentMillis) {
-  if (!msg_q.isEmpty()) {
-
-    // START print msg queue
-    /*Msg test;
-    for(int i=0; i<msg_q.getCount(); i++){
-      msg_q.peekIdx(&test, i);
-      Serial.print(test.msgID);
-      Serial.print(", ");
+  Msg msg;
+  bool ready = false;
+
+  // Wait until the duty cycle budget covers a frame and, with TDMA_ENABLED, the next beacon as well
+  refillAirtime(currentMillis);
+  if (airtimeBudget < (long)timeOnAir(MAX_ENC_PAYLOAD_SIZE + 2) * (TDMA_ENABLED ? 2 : 1))
+    return;
+
+  // Go once through the queue, keeping the order of the messages left in it
+  int n = msg_q.getCount();
+  for (int i=0; i<n; i++) {
+    Msg q;
+    msg_q.pop(&q);
+    if (q.flag == 'a' || q.flag == 'p') {
+      if (!ready) {
+        msg = q;
+        ready = true;
+        continue;
+      }
+    } else if (!isNodeInFlight(q.nodeID)) {
+      int j;
+      for (j=0; j<MAX_IN_FLIGHT; j++)
+        if (!inFlight[j].used)
+          break;
+      if (j < MAX_IN_FLIGHT) {
+        inFlight[j].msg = q;
+        inFlight[j].count = 0;
+        inFlight[j].used = true;
+        continue;
+      }
     }
-    Serial.println(msg_q.getCount());*/
-    // END print msg queue
+    msg_q.push(&q);
+  }
 
-    
-    Msg msg;
-    msg_q.peek(&msg);
+  // Without an ack to send, send the in-flight message that is due the longest. With TDMA only in the
+  // beacon slot, the slots after it are the nodes'
+  int due = -1;
+  for (int i=0; i<MAX_IN_FLIGHT && !ready && tdmaDownlinkOpen(currentMillis); i++) {
+    if (!inFlight[i].used || !nodeListening(inFlight[i].msg.nodeID, currentMillis))
+      continue;
+    if (inFlight[i].count > 0 && (currentMillis - inFlight[i].sentMil) <= inFlight[i].wait)
+      continue;
+    if (inFlight[i].count >= MAX_N_RETRY) {
+      Payload p;
+      p.msgID = inFlight[i].msg.msgID;
+      p.flag = 'f';
+      p.nodeID = inFlight[i].msg.nodeID;
+      relayPayload(p);
+      #if ADR_ENABLED
+        // The node may have switched and its ack been lost, the network moves on either way
+        if (inFlight[i].msg.flag == 'c' && inFlight[i].msg.actID == MODEM_PROFILE_ACT_ID)
+          adrCommandDone(inFlight[i].msg.nodeID, inFlight[i].msg.actVal);
+      #endif
+      inFlight[i].used = false;
+    } else if (due == -1 || inFlight[i].count == 0 || (inFlight[due].count > 0 && (long)(inFlight[due].sentMil + inFlight[due].wait - inFlight[i].sentMil - inFlight[i].wait) > 0)) {
+      due = i;
+    }
+  }
+  if (due != -1) {
+    msg = inFlight[due].msg;
+    ready = true;
+  }
 
-    if (currMsg == msg.msgID)
-      count ++;
-    else
-      count = 0;
+  if (ready) {
+    bool sent;
+    if (msg.flag == 'p') {
+      // Prunes carry no frame, actID holds the relay
+      sent = LoRa_sendFrame(msg.actID, wsn::RELAY_DOWN | wsn::RELAY_PRUNE, msg.nodeID, NULL, 0);
+      LoRa_rxMode();
+    } else {
+      sent = LoRa_sendMessage(msg.msg, msg.nodeID);
+    }
+    if (!sent) {
+      // Channel busy: put an ack or prune back in the queue and try again after a short random delay
+      if (due == -1)
+        msg_q.push(&msg);
+      prevMil = currentMillis - SEND_INTERVAL + random(LBT_BACKOFF);
+      return;
+    }
+    if (due != -1 && msg.nodeID == BROADCAST_ID && msg.flag == 's') {
+      // Every node answers a scan in its own slot, a retransmission would only make them answer again
+      inFlight[due].used = false;
+      startScan(msg.msgID, currentMillis);
+    } else if (due != -1) {
+      inFlight[due].count ++;
+      inFlight[due].sentMil = currentMillis;
+      inFlight[due].wait = retryWait(inFlight[due].count) + routeDelay(msg.nodeID);
+    }
 
-    currMsg = msg.msgID;
-    if (count < MAX_N_RETRY) {
+    // Without per-packet link information the server is not told about acks, the summaries count them.
+    // Prunes are between the gateway and the relays
+    if (msg.flag != 'p' && (RELAY_PER_PACKET_LINK || msg.flag != 'a')) {
       Payload p;
       p.msgID = msg.msgID;
       p.flag = 'd';
       p.nodeID = msg.nodeID;
       p.sensorID = 1; // Using sensorID as status
-      constructJsonAndAddToQueue(p);
-      
-      LoRa_sendMessage(msg.msg, msg.nodeID);
-
-      if(msg.flag == 'a')
-        msg_q.drop();
-      prevMil = currentMillis;
-    } else {
-      if (msg.flag == 's' || msg.flag == 'c') {
-        Payload p;
-        p.msgID = msg.msgID;
-        p.flag = 'f';
-        p.nodeID = msg.nodeID;
-        constructJsonAndAddToQueue(p);
-      }
-      msg_q.drop();
+      relayPayload(p);
     }
-  } else {
+
     prevMil = currentMillis;
   }
 }
 
 /**
- * @brief Get a message from the relay queue and send it to the server via serial communication. 
+ * @brief Get a message from the relay queue and send it to the server via serial communication. Once the
+ *        queue is empty, reports how many messages were dropped because it was full
  * 
  * @param currentMillis current time in millisenconds since boot
  * @return void
  */
  void relayMsgFromQueueToServer(unsigned long currentMillis) {
-  if (!relay_q.isEmpty()) {
-    
-    char msg[MAX_JSON_PAYLOAD_SIZE];
-    relay_q.pop(&msg);
-    int i;
-    for(i=0; i<MAX_JSON_PAYLOAD_SIZE; i++)
-      if (msg[i] == '\0')
-        break;
-    
-
-    Serial.write("rm");
-    Serial.write(msg, i);
-    Serial.write("\n");
+  char msg[MAX_JSON_PAYLOAD_SIZE];
+  int i = relayPop(msg);
+  if (i > 0) {
+    TRACE(TRACE_SERIAL);
+    #if SERIAL_PROTOCOL == SERIAL_BINARY
+      Serial.write(msg, i);
+      Serial.write((byte)0);
+    #else
+      Serial.write("rm");
+      Serial.write(msg, i);
+      Serial.write("\n");
+    #endif
+  } else if (relayDropped > 0) {
+    sprintf_P(msg, PSTR("Relay queue full, %u msgs dropped"), relayDropped);
+    relayText(msg);
+    relayDropped = 0;
   }
   prevMilR = currentMillis;
 }
 
 /**
- * @brief Builds a json string containg the message information and adds the string to the relay queue
+ * @brief Adds a message to the relay ring, after its length byte. A message that does not fit is
+ *        dropped and counted in relayDropped
+ * 
+ * @param msg message bytes
+ * @param len length of the message in bytes, at most MAX_JSON_PAYLOAD_SIZE
+ * @return true if the message was queued
+ */
+bool relayPush(const char *msg, int len) {
+  if (len + 1 > relayFree()) {
+    relayDropped ++;
+    return false;
+  }
+  int pos = (relayHead + relayUsed) % RELAY_BUFFER_SIZE;
+  relayBuf[pos] = (byte)len;
+  for (int i=0; i<len; i++)
+    relayBuf[(pos + 1 + i) % RELAY_BUFFER_SIZE] = msg[i];
+  relayUsed += len + 1;
+  return true;
+}
+
+/**
+ * @brief Takes the oldest message out of the relay ring
+ * 
+ * @param msg buffer of MAX_JSON_PAYLOAD_SIZE bytes that receives the message
+ * @return int length of the message in bytes, 0 if the ring is empty
+ */
+int relayPop(char *msg) {
+  if (relayUsed == 0)
+    return 0;
+  int len = relayBuf[relayHead];
+  for (int i=0; i<len; i++)
+    msg[i] = relayBuf[(relayHead + 1 + i) % RELAY_BUFFER_SIZE];
+  relayHead = (relayHead + len + 1) % RELAY_BUFFER_SIZE;
+  relayUsed -= len + 1;
+  return len;
+}
+
+/**
+ * @brief Free space in the relay ring
+ * 
+ * @return int number of free bytes, including the one taken by the length of the next message
+ */
+int relayFree() {
+  return RELAY_BUFFER_SIZE - relayUsed;
+}
+
+/**
+ * @brief Builds a json string containg the message information and adds the string to the relay queue.
+ *        Sensor, status and ack records carry RSSI, SNR and VBAT only with RELAY_PER_PACKET_LINK
  * 
  * @param p payload structure containing the message information along with RSSI, SNR and battery voltage
  * @return void
  */
  void constructJsonAndAddToQueue(Payload p) {
+  TRACE(TRACE_RECORD);
   char msg[MAX_JSON_PAYLOAD_SIZE];
+  int n;
 
   switch (p.flag) {
     case 'u':
-      sprintf(msg, "{\"t\":\"%lu\",\"msgID\":\"%d\",\"f\":\"%c\",\"nID\":\"%d\",\"sID\":\"%d\",\"sVal\":\"%d\",\"RSSI\":\"%d\",\"SNR\":\"%d.%02d\",\"VBAT\":\"%d.%01d\"}", millis(), p.msgID, p.flag, p.nodeID, (p.sensorID - 1), (p.sensorVal - 1), p.RSSI, (int)p.SNR, (int)(p.SNR * 100) % 100, (int)p.VBAT, (int)(p.VBAT * 10) % 10);
+      n = sprintf_P(msg, PSTR("{\"t\":\"%lu\",\"msgID\":\"%d\",\"f\":\"%c\",\"nID\":\"%d\",\"sID\":\"%d\",\"sVal\":\"%d\",\"dup\":\"%d\""), millis() - (unsigned long)p.milis, p.msgID, p.flag, p.nodeID, p.sensorID, p.sensorVal, p.dups);
       break;
     case 's':
-      sprintf(msg, "{\"t\":\"%lu\",\"msgID\":\"%d\",\"f\":\"%c\",\"nID\":\"%d\",\"state\":\"%d\",\"RSSI\":\"%d\",\"SNR\":\"%d.%02d\",\"VBAT\":\"%d.%01d\"}", millis(), p.msgID, p.flag, p.nodeID, 1, p.RSSI, (int)p.SNR, (int)(p.SNR * 100) % 100, (int)p.VBAT, (int)(p.VBAT * 10) % 10);
+      n = sprintf_P(msg, PSTR("{\"t\":\"%lu\",\"msgID\":\"%d\",\"f\":\"%c\",\"nID\":\"%d\",\"state\":\"%d\""), millis(), p.msgID, p.flag, p.nodeID, 1);
       break;
     case 'a':
-      sprintf(msg, "{\"t\":\"%lu\",\"msgID\":\"%d\",\"f\":\"%c\",\"nID\":\"%d\",\"actID\":\"%d\",\"actVal\":\"%d\",\"RSSI\":\"%d\",\"SNR\":\"%d.%02d\",\"VBAT\":\"%d.%01d\"}", millis(), p.msgID, p.flag, p.nodeID, (p.sensorID - 1), (p.sensorVal - 1), p.RSSI, (int)p.SNR, (int)(p.SNR * 100) % 100, (int)p.VBAT, (int)(p.VBAT * 10) % 10);
+      n = sprintf_P(msg, PSTR("{\"t\":\"%lu\",\"msgID\":\"%d\",\"f\":\"%c\",\"nID\":\"%d\",\"actID\":\"%d\",\"actVal\":\"%d\""), millis(), p.msgID, p.flag, p.nodeID, p.sensorID, p.sensorVal);
       break;
     case 'f':
-      sprintf(msg, "{\"t\":\"%lu\",\"msgID\":\"%d\",\"f\":\"%c\",\"nID\":\"%d\",\"state\":\"%d\",\"RSSI\":\"0\",\"SNR\":\"0\",\"VBAT\":\"0\"}", millis(), p.msgID, 's', p.nodeID, 0);
+      // An RSSI of 0 tells the server the request failed
+      n = sprintf_P(msg, PSTR("{\"t\":\"%lu\",\"msgID\":\"%d\",\"f\":\"%c\",\"nID\":\"%d\",\"state\":\"%d\",\"RSSI\":\"0\",\"SNR\":\"0\",\"VBAT\":\"0\""), millis(), p.msgID, 's', p.nodeID, 0);
+      break;
+    case 'd':
+      n = sprintf_P(msg, PSTR("{\"t\":\"%lu\",\"msgID\":\"%d\",\"f\":\"%c\",\"nID\":\"%d\",\"status\":\"%d\""), millis(), p.msgID, p.flag, p.nodeID, p.sensorID);
+      break;
+    default:
+      return;
+  }
+  #if RELAY_PER_PACKET_LINK
+    if (p.flag == 'u' || p.flag == 's' || p.flag == 'a') {
+      n += sprintf_P(msg + n, PSTR(",\"RSSI\":\"%d\",\"SNR\":\""), p.RSSI);
+      n += formatFixed(msg + n, (long)(p.SNR * 100), 100);
+      n += sprintf_P(msg + n, PSTR("\",\"VBAT\":\"%d.%01d\""), p.vbat / 10, p.vbat % 10);
+    }
+  #endif
+  msg[n++] = '}';
+  relayPush(msg, n);
+}
+
+/**
+ * @brief Writes a fixed point number as a decimal string
+ * 
+ * @param buf buffer that receives the string
+ * @param v value in units of 1/scale
+ * @param scale power of ten, the number of decimals written
+ * @return int number of characters written
+ */
+int formatFixed(char *buf, long v, int scale) {
+  const char *sign = v < 0 ? "-" : "";
+  if (v < 0)
+    v = -v;
+  int n = sprintf_P(buf, PSTR("%s%ld."), sign, v / scale);
+  // One decimal per power of ten of scale, leading zeros included
+  for (long d=scale/10; d>0; d/=10)
+    buf[n++] = '0' + (v / d) % 10;
+  buf[n] = '\0';
+  return n;
+}
+
+/**
+ * @brief Adds a message for the server to the relay queue in the format selected by SERIAL_PROTOCOL
+ * 
+ * @param p payload structure containing the message information along with RSSI, SNR and battery voltage
+ * @return void
+ */
+void relayPayload(Payload p) {
+  #if SERIAL_PROTOCOL == SERIAL_BINARY
+    constructFrameAndAddToQueue(p);
+  #else
+    constructJsonAndAddToQueue(p);
+  #endif
+}
+
+/**
+ * @brief Computes the CRC-16/CCITT-FALSE checksum of a byte array
+ * 
+ * @param data bytes to check
+ * @param len number of bytes
+ * @return unsigned int the 16 bit checksum
+ */
+unsigned int crc16(const byte *data, int len) {
+  unsigned int crc = 0xFFFF;
+  for (int i=0; i<len; i++) {
+    crc ^= (unsigned int)data[i] << 8;
+    for (int j=0; j<8; j++)
+      crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+  }
+  return crc & 0xFFFF;
+}
+
+/**
+ * @brief Encodes a byte array with Consistent Overhead Byte Stuffing, so that the result has no zero
+ *        bytes and a zero can delimit the frames on the serial link
+ * 
+ * @param in bytes to encode
+ * @param len number of bytes, at most 253
+ * @param out encoded bytes, len+1 bytes long
+ * @return int number of encoded bytes
+ */
+int cobsEncode(const byte *in, int len, byte *out) {
+  int code = 1;
+  int codeIdx = 0;
+  int o = 1;
+  for (int i=0; i<len; i++) {
+    if (in[i] == 0) {
+      out[codeIdx] = code;
+      codeIdx = o++;
+      code = 1;
+    } else {
+      out[o++] = in[i];
+      code ++;
+    }
+  }
+  out[codeIdx] = code;
+  return o;
+}
+
+/**
+ * @brief Decodes a frame encoded with Consistent Overhead Byte Stuffing
+ * 
+ * @param in encoded bytes, without the zero delimiter
+ * @param len number of encoded bytes, at most 254
+ * @param out decoded bytes, len-1 bytes long
+ * @return int number of decoded bytes or -1 if the frame is malformed
+ */
+int cobsDecode(const byte *in, int len, byte *out) {
+  int i = 0;
+  int o = 0;
+  while (i < len) {
+    int code = in[i++];
+    if (code == 0 || i + code - 1 > len)
+      return -1;
+    for (int j=1; j<code; j++)
+      out[o++] = in[i++];
+    if (code < 0xFF && i < len)
+      out[o++] = 0;
+  }
+  return o;
+}
+
+/**
+ * @brief Builds a fixed layout binary record containg the message information, frames it and adds it
+ *        to the relay queue. Record layout, multi-byte fields little endian:
+ *        flag, t (4 bytes), msgID, nodeID, field A, field B, RSSI (2 bytes, signed),
+ *        SNR (2 bytes, signed, hundredths of dB), VBAT (tenths of V), retransmissions not relayed
+ *        (uplinks only), followed by the CRC16 of the record. Without RELAY_PER_PACKET_LINK, sensor,
+ *        status and ack records are SHORT_RECORD_SIZE bytes long: RSSI, SNR and VBAT are left out
+ * 
+ * @param p payload structure containing the message information along with RSSI, SNR and battery voltage
+ * @return void
+ */
+void constructFrameAndAddToQueue(Payload p) {
+  TRACE(TRACE_RECORD);
+  byte record[RECORD_SIZE + 2];
+  char msg[MAX_JSON_PAYLOAD_SIZE];
+  unsigned long t = millis();
+  int snr = 0;
+  int rssi = 0;
+  byte vbat = 0;
+  byte a = 0;
+  byte b = 0;
+  byte dups = 0;
+
+  switch (p.flag) {
+    case 'u':
+      t -= (unsigned long)p.milis;
+      dups = p.dups;
+      a = p.sensorID;
+      b = p.sensorVal;
+      break;
+    case 'a':
+      a = p.sensorID;
+      b = p.sensorVal;
+      break;
+    case 's':
+      a = 1;
       break;
     case 'd':
-      sprintf(msg, "{\"t\":\"%lu\",\"msgID\":\"%d\",\"f\":\"%c\",\"nID\":\"%d\",\"status\":\"%d\"}", millis(), p.msgID, p.flag, p.nodeID, p.sensorID);
+      a = p.sensorID;
+      break;
+  }
+  if (p.flag == 'u' || p.flag == 'a' || p.flag == 's') {
+    rssi = p.RSSI;
+    snr = (int)(p.SNR * 100);
+    vbat = p.vbat;
+  }
+
+  record[0] = p.flag;
+  for (int i=0; i<4; i++)
+    record[1+i] = (byte)(t >> (8*i));
+  record[5] = p.msgID;
+  record[6] = p.nodeID;
+  record[7] = a;
+  record[8] = b;
+  record[9] = (byte)rssi;
+  record[10] = (byte)(rssi >> 8);
+  record[11] = (byte)snr;
+  record[12] = (byte)(snr >> 8);
+  record[13] = vbat;
+  record[14] = dups;
+  int len = RECORD_SIZE;
+  #if !RELAY_PER_PACKET_LINK
+    if (p.flag == 'u' || p.flag == 'a' || p.flag == 's') {
+      record[9] = dups;
+      len = SHORT_RECORD_SIZE;
+    }
+  #endif
+  unsigned int crc = crc16(record, len);
+  record[len] = (byte)crc;
+  record[len+1] = (byte)(crc >> 8);
+
+  int n = cobsEncode(record, len + 2, (byte *)msg);
+  relayPush(msg, n);
+}
+
+/**
+ * @brief Sends a text message to the server right away, as a plain line or as a text record ('t'
+ *        followed by the characters) depending on SERIAL_PROTOCOL
+ * 
+ * @param text null terminated text to send
+ * @return void
+ */
+void relayText(const char *text) {
+  #if SERIAL_PROTOCOL == SERIAL_BINARY
+    byte record[MAX_FRAME_SIZE];
+    byte frame[MAX_FRAME_SIZE + 1];
+    int len = mymin(strlen(text), MAX_FRAME_SIZE - 4);
+    record[0] = 't';
+    memcpy(record + 1, text, len);
+    unsigned int crc = crc16(record, len + 1);
+    record[len+1] = (byte)crc;
+    record[len+2] = (byte)(crc >> 8);
+    int n = cobsEncode(record, len + 3, frame);
+    Serial.write(frame, n);
+    Serial.write((byte)0);
+  #else
+    Serial.write(text);
+    Serial.write("\n");
+  #endif
+}
+
+/**
+ * @brief Reads the bytes available on the serial port without blocking and relays every complete
+ *        downlink frame received from the server. Frames that are too long or fail the CRC are dropped
+ * 
+ * @return void
+ */
+void receiveDownlinkFrames() {
+  while (Serial.available() > 0) {
+    byte c = Serial.read();
+    if (c != 0) {
+      if (dlFrameLen < MAX_FRAME_SIZE)
+        dlFrame[dlFrameLen] = c;
+      dlFrameLen ++;
+      continue;
+    }
+    if (dlFrameLen > 0 && dlFrameLen <= MAX_FRAME_SIZE) {
+      byte frame[MAX_FRAME_SIZE];
+      int len = cobsDecode(dlFrame, dlFrameLen, frame);
+      if (len > 2 && crc16(frame, len - 2) == (frame[len-2] | ((unsigned int)frame[len-1] << 8)))
+        relayDownlinkFrame(frame, len - 2);
+    }
+    dlFrameLen = 0;
+  }
+}
+
+/**
+ * @brief Reads the bytes available on the serial port without blocking and relays every complete
+ *        downlink line received from the server. Lines longer than MAX_LINE_SIZE are dropped
+ * 
+ * @return void
+ */
+void receiveDownlinkLines() {
+  while (Serial.available() > 0) {
+    char c = Serial.read();
+    if (c != '\n' && c != '\r') {
+      if (dlLineLen < MAX_LINE_SIZE)
+        dlLine[dlLineLen] = c;
+      dlLineLen ++;
+      continue;
+    }
+    if (dlLineLen > 0 && dlLineLen < MAX_LINE_SIZE) {
+      dlLine[dlLineLen] = '\0';
+      relayDownlinkMsg(dlLine);
+    }
+    dlLineLen = 0;
+  }
+}
+
+/**
+ * @brief Relays a binary downlink message received from the server to the corresponding node. Record
+ *        layouts: 's', nodeID | 'c', nodeID, actID, actVal | 'p', codingRateDenominator,
+ *        signalBandwidth (4 bytes, little endian), spreadingFactor | 'x', dumps the latency trace
+ * 
+ * @param frame decoded record, without the CRC
+ * @param len length of the record in bytes
+ */
+void relayDownlinkFrame(byte *frame, int len) {
+  #if TRACE_ENABLED
+    if (frame[0] == 'x' && len == 1) {
+      traceDump();
+      return;
+    }
+  #endif
+  TRACE(TRACE_DL_PARSE);
+  switch (frame[0]) {
+    case 's':
+      if (len == 2)
+        sendStatusRequest(frame[1]);
+      break;
+    case 'c':
+      if (len == 4)
+        sendActuatorControl(frame[1], frame[2], frame[3]);
+      break;
+    case 'p':
+      if (len == 7) {
+        long sb = 0;
+        for (int i=0; i<4; i++)
+          sb |= (long)frame[2+i] << (8*i);
+        setModem(frame[6], sb, frame[1]);
+      }
       break;
   }
-  relay_q.push(&msg);
 }
 
 /**
  * @brief Relays the downlink messages received from the server to the corresponding node. Formats the message 
- *        into a compact form
+ *        into a compact form. The 'x' message dumps the latency trace
  * 
  * @param dlMsg character array containing the downlink message to be relayed
  */
@@ -328,6 +1108,14 @@ void relayDownlinkMsg(char *dlMsg) {
   char flag = dlMsg[0];
   int nodeID;
 
+  #if TRACE_ENABLED
+    if (flag == 'x') {
+      traceDump();
+      return;
+    }
+  #endif
+  TRACE(TRACE_DL_PARSE);
+
   switch (flag) {
     case 's':
       sscanf(dlMsg, "%*c,%d", &nodeID);
@@ -340,76 +1128,889 @@ void relayDownlinkMsg(char *dlMsg) {
       int actID;
       int actVal;
       sscanf(dlMsg, "%*c,%d,%d,%d", &nodeID, &actID, &actVal);
-      sendActuatorControl((byte)nodeID, (byte)(actID + 1), (byte)(actVal + 1));
+      sendActuatorControl((byte)nodeID, (byte)actID, (byte)actVal);
       break;
     case 'p':
       int sf;
       long sb;
       int crd;
       sscanf(dlMsg, "%*c,%d,%ld,%d", &crd, &sb, &sf);
-      LoRa.setSignalBandwidth(sb);
-      LoRa.setCodingRate4(crd);
-      LoRa.setSpreadingFactor(sf);
+      setModem(sf, sb, crd);
       break;
   }
 }
 
+#if TRACE_ENABLED
+/**
+ * @brief Sends the measurements of the latency trace to the server as text messages, one "trace <stage>
+ *        <microseconds>" line each, oldest first, followed by "trace end", and empties the trace
+ * 
+ * @return void
+ */
+void traceDump() {
+  char line[MAX_LINE_SIZE];
+  for (byte i=0; i<traceRing.count; i++) {
+    const wsn::TraceEntry &e = traceRing.at(i);
+    sprintf_P(line, PSTR("trace %d %lu"), e.stage, (unsigned long)e.duration);
+    relayText(line);
+  }
+  relayText("trace end");
+  traceRing.clear();
+}
+#endif
+
 /**
- * @brief Called every time a new message is received. Filters unwanted messages, decrypts the payload,
- *        gets the relevant fields from the payload and sends back an acknowledge message if necessary.
- *        Finally, calls constructJsonAndAddToQueue to build a json message destined for the server.
+ * @brief Called from the DIO0 interrupt every time a frame is received. Copies the frame, RSSI and SNR
+ *        into the receive ring for the loop to handle, so that frames keep being received while the loop
+ *        is busy. Frames that find the ring full are dropped and counted in rxDropped
  * 
  * @param packetSize size of the incoming message in bytes
  */
 void onReceive(int packetSize) {
-  byte rNetID = LoRa.read();
-  byte rnID = LoRa.read();
-  char buffer1[MAX_ENC_PAYLOAD_SIZE];
-  String message = "";
+  TRACE(TRACE_RX_READ);
+  byte next = (rxHead + 1) % RX_RING_SIZE;
+  if (next == rxTail) {
+    rxDropped ++;
+    return;
+  }
+  RxPacket *pkt = &rxRing[rxHead];
   int i=0;
-  while (LoRa.available()) {
-    buffer1[i] = (char)LoRa.read();
+  while (LoRa.available() && i<MAX_RX_FRAME_SIZE) {
+    pkt->data[i] = LoRa.read();
     i++;
   }
+  pkt->len = i;
+  pkt->rssi = LoRa.packetRssi();
+  pkt->snr = LoRa.packetSnr();
+  rxHead = next;
+}
+
+/**
+ * @brief Handles every frame waiting in the receive ring, oldest first
+ * 
+ * @return void
+ */
+void receivePackets() {
+  while (rxTail != rxHead) {
+    handlePacket(&rxRing[rxTail]);
+    rxTail = (rxTail + 1) % RX_RING_SIZE;
+  }
+}
 
-  if (rNetID = netID) {
-    byte len;
+/**
+ * @brief Handles a received frame. Filters unwanted messages, frames of other networks or from nodes not in
+ *        the registry, decrypts the payload, gets the relevant
+ *        fields from the payload and sends back an acknowledge message if necessary.
+ *        Batch frames are handed to unpackBatch. With MULTIHOP_ENABLED, the frame a relay frame carries
+ *        is handled like one received from its node, see routeFrame.
+ *        Finally, calls relayPayload to build a message destined for the server.
+ * 
+ * @param pkt frame taken from the receive ring
+ */
+void handlePacket(RxPacket *pkt) {
+  TRACE(TRACE_HANDLE);
+  if (pkt->len < 2)
+    return;
+  byte rNetID = pkt->data[0];
+  byte rnID = pkt->data[1];
+  byte *frame = pkt->data + 2;
+  char buffer1[MAX_BATCH_PAYLOAD_SIZE+1];
+  int i = pkt->len - 2;
+
+  #if MULTIHOP_ENABLED
+    byte relayID = 0;
+    byte hops = 0;
+    // Relay frames from registered relays going up, downlinks between relays are not for the gateway
+    if (rNetID == netID && rnID == WSN_RELAY_FRAME) {
+      if (i < wsn::Relay::size || (wsn::Relay::Hops::get(frame) & wsn::RELAY_DOWN))
+        return;
+      hops = wsn::Relay::Hops::get(frame) & wsn::RELAY_HOPS;
+      relayID = wsn::Relay::RelayID::get(frame);
+      rnID = wsn::Relay::NodeID::get(frame);
+      if (findNode(relayID) == NULL)
+        return;
+      frame += wsn::Relay::size;
+      i -= wsn::Relay::size;
+    }
+  #endif
+  i = mymin(i, MAX_BATCH_PAYLOAD_SIZE+1);
+
+  // Frames of other networks and unregistered nodes are dropped before any decryption
+  aes256_context *ctxt = NULL;
+  if (rNetID == netID && i >= BLOCK_SIZE && rnID != BROADCAST_ID)
+    ctxt = getKeySchedule(rnID);
+  if (ctxt != NULL) {
     Payload p;
 
-    aes256_init(&ctxt, keys[(int)rnID]);
-    strcpy(buffer1, decryptMsg(buffer1));
-    aes256_done(&ctxt);
-
-    buffer1[8] = '\0';
-
-    //Serial.println(buffer1);
-    char a,b;
-    //Serial.println(buffer1);
-    if(sscanf(buffer1, "%c%c%c%c%c%c%c%c", &p.nodeID, &p.msgID, &len, &p.flag, &p.sensorID, &p.sensorVal, &a, &b) == 8){
-      p.VBAT = (int)(a-1) + (int)(b-1) * 0.1;
-      //Serial.println(p.VBAT);
-      Msg msg;
-      p.RSSI = LoRa.packetRssi();
-      p.SNR = LoRa.packetSnr();
-      if (p.flag == 'u') {
-        sendAck(p.msgID, p.nodeID);
-        //p.sensorVal = buffer1[14];
+    memcpy(buffer1, frame, i);
+    byte *plain = (byte *)decryptMsg(ctxt, buffer1);
+    // The node ID inside the ciphertext must match the one in the clear
+    if (wsn::Header::NodeID::get(plain) != rnID)
+      return;
+    #if MULTIHOP_ENABLED
+      if (!routeFrame(rnID, plain, relayID, hops))
+        return;
+    #endif
+    if (wsn::Header::Type::get(plain) == wsn::MSG_BATCH) {
+      unpackBatch(ctxt, plain, buffer1, i, pkt->rssi, pkt->snr);
+      return;
+    }
+
+    wsn::Message m;
+    wsn::unpack(plain, &m);
+    p.nodeID = m.nodeID;
+    p.msgID = m.msgID;
+    p.flag = m.type;
+    p.sensorID = m.a;
+    p.sensorVal = m.b;
+    p.vbat = m.vbat;
+    p.RSSI = pkt->rssi;
+    p.SNR = pkt->snr;
+    p.milis = 0;
+    p.dups = 0;
+    #if ADR_ENABLED
+      adrRecord(p.nodeID, p.RSSI, p.SNR);
+    #endif
+    #if LINK_STATS_ENABLED
+      linkRecord(p.nodeID, p.RSSI, p.SNR, p.vbat);
+    #endif
+    if (m.flags & LEN_RX_WINDOW)
+      openRxWindow(p.nodeID, millis());
+    if (p.flag == 'u') {
+      // A retransmission is acked again, as the node missed the ack, but relayed only once
+      bool duplicate;
+      sendAck(p.msgID, p.nodeID, recordUplink(p.nodeID, p.msgID, &duplicate));
+      #if LINK_STATS_ENABLED
+        linkRecordUplink(p.nodeID, p.msgID, 1, duplicate);
+      #endif
+      if (duplicate)
+        return;
+      p.dups = takeDuplicates(p.nodeID);
+      //p.sensorVal = buffer1[14];
+    }
+    if (p.flag == 's') {
+      //sendAck(p.msgID, p.nodeID);
+      recordScanReply(p.nodeID, p.msgID);
+      int i = findInFlight(p.nodeID, p.msgID);
+      if (i == -1)
+        i = findInFlight(BROADCAST_ID, p.msgID);
+      if (i != -1)
+        inFlight[i].used = false;
+    } else if (p.flag == 'a') {
+      int i = findInFlight(p.nodeID, p.msgID);
+      if (i != -1) {
+        p.sensorID = inFlight[i].msg.actID;
+        p.sensorVal = inFlight[i].msg.actVal;
+        inFlight[i].used = false;
+        #if ADR_ENABLED
+          if (p.sensorID == MODEM_PROFILE_ACT_ID)
+            adrCommandDone(p.nodeID, p.sensorVal);
+        #endif
       }
-      if (p.flag == 's') {
-        //sendAck(p.msgID, p.nodeID);
-        msg_q.peek(&msg);
-        if (p.msgID == msg.msgID) {
-          msg_q.drop();
-        }
-      } else if (p.flag == 'a') {
-        msg_q.peek(&msg);
-        if (p.msgID == msg.msgID) {
-          p.sensorID = msg.actID;
-          p.sensorVal = msg.actVal;
-          msg_q.drop();
-        }
+    }
+    relayPayload(p);
+  }
+}
+
+/**
+ * @brief Keeps the route of a frame from a node and tells relayed copies of a frame received recently
+ *        apart: the copy is dropped and the relay it came from told to stop forwarding the node. A relay
+ *        that sent its own frame is marked as one, the gateway then reaches it with relay frames
+ * 
+ * @param nodeID ID of the node, must be registered
+ * @param plain decrypted first block of the frame
+ * @param relayID relay that sent the frame, 0 if it came from the node itself
+ * @param hops relays the frame went through
+ * @return true if the frame has to be handled, false for a copy
+ */
+bool routeFrame(byte nodeID, const byte *plain, byte relayID, byte hops) {
+  unsigned long currentMillis = millis();
+  byte msgID = wsn::Header::MsgID::get(plain);
+  byte type = wsn::Header::Type::get(plain);
+  for (int i=0; i<MULTIHOP_RECENT; i++) {
+    RecentFrame *f = &recentFrames[i];
+    if (f->used && f->nodeID == nodeID && f->msgID == msgID && f->type == type && (currentMillis - f->t) < MULTIHOP_DUP_WINDOW) {
+      if (hops > 0)
+        sendPrune(relayID, nodeID);
+      return false;
+    }
+  }
+  RecentFrame *f = &recentFrames[recentNext];
+  f->nodeID = nodeID;
+  f->msgID = msgID;
+  f->type = type;
+  f->t = currentMillis;
+  f->used = true;
+  recentNext = (recentNext + 1) % MULTIHOP_RECENT;
+
+  NodeState *n = findNode(nodeID);
+  if (relayID == nodeID)
+    n->flags |= NODE_RELAY;
+  n->via = hops > 0 ? relayID : 0;
+  n->hops = hops;
+  return true;
+}
+
+/**
+ * @brief Relay to send a downlink for a node to: the relay the node was last heard through, the node
+ *        itself if it is a relay, or 0 to send it straight to the node
+ * 
+ * @param nodeID ID of the destination node
+ * @return byte ID of the relay, or 0
+ */
+byte routeRelay(byte nodeID) {
+  NodeState *n = findNode(nodeID);
+  if (n == NULL)
+    return 0;
+  if (n->via != 0)
+    return n->via;
+  return (n->flags & NODE_RELAY) ? nodeID : 0;
+}
+
+/**
+ * @brief Extra time the answer to a downlink takes through the relays on the route to the node: both
+ *        frames on air once more and MULTIHOP_HOP_MARGIN per relay
+ * 
+ * @param nodeID ID of the destination node
+ * @return unsigned long delay in ms, 0 for nodes heard directly
+ */
+unsigned long routeDelay(byte nodeID) {
+  NodeState *n = findNode(nodeID);
+  if (n == NULL || n->hops == 0)
+    return 0;
+  return n->hops * (2 * timeOnAir(MAX_ENC_PAYLOAD_SIZE + 2 + wsn::Relay::size) / 1000 + MULTIHOP_HOP_MARGIN);
+}
+
+/**
+ * @brief Queues a prune, telling a relay to stop forwarding the frames of a node, when the queue has
+ *        room for it. Prunes are sent like acks
+ * 
+ * @param relayID ID of the relay
+ * @param nodeID ID of the node
+ * @return void
+ */
+void sendPrune(byte relayID, byte nodeID) {
+  if (requestQueueFull())
+    return;
+  Msg msg;
+  msg.msgID = 0;
+  msg.flag = 'p';
+  msg.nodeID = nodeID;
+  msg.actID = relayID;
+  msg_q.push(&msg);
+}
+
+/**
+ * @brief Unpacks a batch frame sent by a node in batching mode into one sensor message per reading,
+ *        acknowledges the frame and queues the readings in the relay ring for loop() to send to the server.
+ *        Readings that do not fit are counted in relayDropped. See wsn::Batch for the layout
+ * 
+ * @param ctxt expanded key schedule of the sending node
+ * @param first decrypted first block of the frame
+ * @param frame encrypted frame as received
+ * @param frameLen length of the received frame in bytes
+ * @param rssi RSSI of the frame in dBm
+ * @param snr SNR of the frame in dB
+ * @return void
+ */
+void unpackBatch(aes256_context *ctxt, byte *first, char *frame, int frameLen, int rssi, float snr) {
+  byte plain[MAX_BATCH_PAYLOAD_SIZE];
+  memcpy(plain, first, BLOCK_SIZE);
+
+  wsn::Message m;
+  byte l;
+  byte n;
+  if (!wsn::unpackBatch(plain, &m, &l, &n, mymin(frameLen, MAX_BATCH_PAYLOAD_SIZE)))
+    return;
+  for (int k=BLOCK_SIZE; k<l; k+=BLOCK_SIZE)
+    memcpy(plain + k, decryptMsg(ctxt, frame + k), BLOCK_SIZE);
+
+  Payload p;
+  p.nodeID = m.nodeID;
+  p.flag = 'u';
+  p.vbat = m.vbat;
+  p.RSSI = rssi;
+  p.SNR = snr;
+  #if ADR_ENABLED
+    adrRecord(p.nodeID, p.RSSI, p.SNR);
+  #endif
+  #if LINK_STATS_ENABLED
+    linkRecord(p.nodeID, p.RSSI, p.SNR, p.vbat);
+  #endif
+  if (m.flags & LEN_RX_WINDOW)
+    openRxWindow(p.nodeID, millis());
+  bool duplicate;
+  sendAck(m.msgID, p.nodeID, recordUplink(p.nodeID, m.msgID, &duplicate));
+  #if LINK_STATS_ENABLED
+    linkRecordUplink(p.nodeID, m.msgID, n, duplicate);
+  #endif
+  if (duplicate)
+    return;
+  p.dups = takeDuplicates(p.nodeID);
+
+  for (int j=0; j<n; j++) {
+    wsn::Reading r;
+    wsn::unpackReading(plain, j, &r);
+    p.msgID = (byte)(m.msgID + j);
+    p.sensorID = r.sensorID;
+    p.sensorVal = r.sensorVal;
+    p.milis = r.age * 100.0;
+    relayPayload(p);
+    p.dups = 0;
+  }
+}
+
+/**
+ * @brief Applies modem settings to the radio and keeps them for the time on air calculation
+ * 
+ * @param sf spreading factor
+ * @param bw signal bandwidth in Hz
+ * @param crd coding rate denominator
+ * @return void
+ */
+void setModem(int sf, long bw, int crd) {
+  LoRa.setSignalBandwidth(bw);
+  LoRa.setCodingRate4(crd);
+  LoRa.setSpreadingFactor(sf);
+  curSpreadingFactor = sf;
+  curSignalBandwidth = bw;
+  curCodingRateDenominator = crd;
+}
+
+/**
+ * @brief Computes how long a frame occupies the channel with the current modem settings, following the
+ *        Semtech SX1276 datasheet: explicit header, CRC on, low data rate optimization above 16 ms symbols
+ * 
+ * @param len length of the frame in bytes
+ * @return unsigned long time on air in microseconds
+ */
+unsigned long timeOnAir(byte len) {
+  float tSym = (float)(1L << curSpreadingFactor) * 1E6 / curSignalBandwidth;
+  int de = tSym > 16000 ? 1 : 0;
+  long num = 8L * len - 4 * curSpreadingFactor + 28 + 16;
+  long den = 4 * (curSpreadingFactor - 2 * de);
+  long nPayload = num > 0 ? (num + den - 1) / den * curCodingRateDenominator : 0;
+  return (unsigned long)((PREAMBLE_LENGTH + 4.25 + 8 + nPayload) * tSym);
+}
+
+/**
+ * @brief Time to wait for the answer to a downlink before sending it again: the downlink and the answer,
+ *        frames of the same size, on air plus ACK_MARGIN. With BACKOFF_EXPONENTIAL a random backoff is
+ *        added, so that retries to nodes that were missed together are spread out
+ * 
+ * @param count attempts made so far, 1 after the first transmission
+ * @return unsigned long wait in ms
+ */
+unsigned long retryWait(byte count) {
+  unsigned long wait = 2 * timeOnAir(MAX_ENC_PAYLOAD_SIZE + 2) / 1000 + ACK_MARGIN;
+  #if BACKOFF_MODE == BACKOFF_EXPONENTIAL
+    unsigned long window = BACKOFF_CAP;
+    if (count <= 8 && ((unsigned long)BACKOFF_BASE << (count - 1)) < BACKOFF_CAP)
+      window = (unsigned long)BACKOFF_BASE << (count - 1);
+    wait += random(window + 1);
+  #endif
+  return wait;
+}
+
+/**
+ * @brief Adds the airtime earned since the last call to the duty cycle budget, DUTY_CYCLE_PERMILLE us
+ *        per ms, up to AIRTIME_BUCKET_SIZE
+ * 
+ * @param currentMillis current time in millisenconds since boot
+ * @return void
+ */
+void refillAirtime(unsigned long currentMillis) {
+  airtimeBudget += (long)(currentMillis - prevMilDC) * DUTY_CYCLE_PERMILLE;
+  if (airtimeBudget > (long)AIRTIME_BUCKET_SIZE * 1000)
+    airtimeBudget = (long)AIRTIME_BUCKET_SIZE * 1000;
+  prevMilDC = currentMillis;
+}
+
+/**
+ * @brief Returns the airtime the duty cycle still allows right now
+ * 
+ * @return long remaining budget in ms
+ */
+long remainingAirtime() {
+  refillAirtime(millis());
+  return airtimeBudget / 1000;
+}
+
+/**
+ * @brief Applies a modem profile to the radio
+ * 
+ * @param profile index in modemProfiles
+ * @return void
+ */
+void setModemProfile(byte profile) {
+  setModem(modemProfiles[profile].spreadingFactor, modemProfiles[profile].signalBandwidth,
+           modemProfiles[profile].codingRateDenominator);
+}
+
+#if ADR_ENABLED
+/**
+ * @brief Adds the RSSI and SNR of a received frame to the link history of its node. The first frame of a
+ *        node restarts the ADR_SETTLE wait. The frame was heard on the network profile, so that is the
+ *        node's profile now, even if it missed a profile change or found the network again after a reboot
+ * 
+ * @param nodeID ID of the sending node
+ * @param rssi RSSI of the frame in dBm
+ * @param snr SNR of the frame in dB
+ * @return void
+ */
+void adrRecord(byte nodeID, int rssi, float snr) {
+  AdrNode *n = &adrNodes[nodeSlot[nodeID] - 1];
+  if (n->count == 0)
+    adrLastJoin = millis();
+  n->profile = netProfile;
+  float snr125 = snr + 10 * log10(modemProfiles[netProfile].signalBandwidth / 125E3);
+  n->snr[n->next] = (signed char)constrain(snr125 * 4, -128, 127);
+  n->rssi[n->next] = (byte)constrain(-rssi, 0, 255);
+  n->next = (n->next + 1) % ADR_HISTORY;
+  if (n->count < ADR_HISTORY)
+    n->count ++;
+}
+
+/**
+ * @brief Returns the modem profile a node is using, as far as the gateway knows
+ * 
+ * @param nodeID ID of the node
+ * @return byte index in modemProfiles, the network profile for unknown nodes and broadcasts
+ */
+byte adrNodeProfile(byte nodeID) {
+  if (nodeSlot[nodeID] == 0 || adrNodes[nodeSlot[nodeID] - 1].count == 0)
+    return netProfile;
+  return adrNodes[nodeSlot[nodeID] - 1].profile;
+}
+
+/**
+ * @brief Picks the fastest profile that leaves ADR_MARGIN dB above the SNR it needs, given the average SNR
+ *        in the node's history
+ * 
+ * @param n link history of the node
+ * @return int index in adrProfiles
+ */
+int adrRequiredProfile(AdrNode *n) {
+  float avg = 0;
+  for (int i=0; i<n->count; i++)
+    avg += n->snr[i];
+  avg = avg / n->count / 4;
+
+  for (int k=0; k<ADR_N_PROFILES; k++)
+    if (avg - ADR_MARGIN >= adrRequiredSnr[k])
+      return k;
+  return ADR_N_PROFILES - 1;
+}
+
+/**
+ * @brief Checks whether a profile change command is still waiting in the send queue or in flight
+ * 
+ * @return true if a node has not answered a profile change yet
+ */
+bool adrCommandPending() {
+  for (int i=0; i<MAX_IN_FLIGHT; i++)
+    if (inFlight[i].used && inFlight[i].msg.flag == 'c' && inFlight[i].msg.actID == MODEM_PROFILE_ACT_ID)
+      return true;
+  for (int i=0; i<msg_q.getCount(); i++) {
+    Msg msg;
+    msg_q.peekIdx(&msg, i);
+    if (msg.flag == 'c' && msg.actID == MODEM_PROFILE_ACT_ID)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Records that a node moved to a modem profile, so downlinks to it use that profile
+ * 
+ * @param nodeID ID of the node
+ * @param profile index in modemProfiles
+ * @return void
+ */
+void adrCommandDone(byte nodeID, byte profile) {
+  if (nodeSlot[nodeID] != 0)
+    adrNodes[nodeSlot[nodeID] - 1].profile = profile;
+}
+
+/**
+ * @brief Runs the ADR engine. Every ADR_INTERVAL, once no new node has shown up for ADR_SETTLE, it takes
+ *        the slowest of the profiles the heard nodes need, since the radio only receives one spreading
+ *        factor and bandwidth at a time. When that differs from the network profile, every heard node is
+ *        sent a profile change (actuator MODEM_PROFILE_ACT_ID) as room in the send queue allows, and the
+ *        receiver follows once all of them have answered or given up
+ * 
+ * @param currentMillis current time in millisenconds since boot
+ * @return void
+ */
+void adrUpdate(unsigned long currentMillis) {
+  if (adrTarget != netProfile) {
+    bool done = true;
+    for (unsigned int i=0; i<N_NODES; i++) {
+      if (adrNodes[i].count == 0 || adrNodes[i].commanded)
+        continue;
+      done = false;
+      if (!requestQueueFull()) {
+        sendActuatorControl(pgm_read_byte(&nodeRegistry[i].nodeID), MODEM_PROFILE_ACT_ID, adrTarget);
+        adrNodes[i].commanded = true;
       }
-      constructJsonAndAddToQueue(p);
     }
+    if (done && !adrCommandPending()) {
+      netProfile = adrTarget;
+      setModemProfile(netProfile);
+      LoRa_rxMode();
+      prevMilADR = currentMillis;
+    }
+    return;
+  }
+
+  if ((currentMillis - prevMilADR) < ADR_INTERVAL || (currentMillis - adrLastJoin) < ADR_SETTLE)
+    return;
+  prevMilADR = currentMillis;
+
+  int target = -1;
+  for (unsigned int i=0; i<N_NODES; i++) {
+    if (adrNodes[i].count >= ADR_MIN_SAMPLES) {
+      int k = adrRequiredProfile(&adrNodes[i]);
+      if (k > target)
+        target = k;
+    }
+  }
+  if (target == -1 || adrProfiles[target] == netProfile)
+    return;
+
+  adrTarget = adrProfiles[target];
+  for (unsigned int i=0; i<N_NODES; i++)
+    adrNodes[i].commanded = false;
+}
+#endif
+
+#if LINK_STATS_ENABLED
+/**
+ * @brief Adds a received frame to the link aggregates of its node
+ * 
+ * @param nodeID ID of the node, must be registered
+ * @param rssi RSSI of the frame in dBm
+ * @param snr SNR of the frame in dB
+ * @param vbat battery voltage sent in the frame, in tenths of a volt
+ * @return void
+ */
+void linkRecord(byte nodeID, int rssi, float snr, byte vbat) {
+  LinkStats *s = &linkStats[nodeSlot[nodeID] - 1];
+  // The radio reports SNR in quarter dB from -32 to 31.75 dB
+  signed char snrQ = (signed char)constrain((int)(snr * 4), -128, 127);
+  int16_t r = rssi * 16;
+  int16_t q = snrQ * 4;
+
+  if (!(s->flags & LINK_AVG_VALID)) {
+    s->rssiAvg = r;
+    s->snrAvg = q;
+    s->flags |= LINK_AVG_VALID;
+  } else {
+    s->rssiAvg += (r - s->rssiAvg) >> LINK_EWMA_SHIFT;
+    s->snrAvg += (q - s->snrAvg) >> LINK_EWMA_SHIFT;
+  }
+  if (s->frames == 0 || rssi < s->rssiMin)
+    s->rssiMin = rssi;
+  if (s->frames == 0 || rssi > s->rssiMax)
+    s->rssiMax = rssi;
+  if (s->frames == 0 || snrQ < s->snrMin)
+    s->snrMin = snrQ;
+  if (s->frames == 0 || snrQ > s->snrMax)
+    s->snrMax = snrQ;
+  if (s->frames < 0xFFFF)
+    s->frames ++;
+  s->vbat = vbat;
+}
+
+/**
+ * @brief Counts an uplink in the link aggregates of its node. Skipped msgIDs are counted as lost, and
+ *        taken back if they arrive late
+ * 
+ * @param nodeID ID of the node, must be registered
+ * @param msgID msgID of the uplink, of its first reading for a batch
+ * @param count number of readings in the uplink
+ * @param duplicate whether the uplink was already received
+ * @return void
+ */
+void linkRecordUplink(byte nodeID, byte msgID, byte count, bool duplicate) {
+  LinkStats *s = &linkStats[nodeSlot[nodeID] - 1];
+  if (duplicate) {
+    if (s->dups < 0xFFFF)
+      s->dups ++;
+    return;
+  }
+  if (s->uplinks < 0xFFFF - count)
+    s->uplinks += count;
+
+  byte gap = (byte)(msgID - s->nextMsgID);
+  if ((s->flags & LINK_SEQ_VALID) && gap >= 256 - LINK_MAX_GAP) {
+    // Older than the last uplink: one of the msgIDs counted as lost
+    if (s->lost > 0)
+      s->lost --;
+    return;
+  }
+  if ((s->flags & LINK_SEQ_VALID) && gap < LINK_MAX_GAP && s->lost < 0xFFFF - gap)
+    s->lost += gap;
+  s->nextMsgID = (byte)(msgID + count);
+  s->flags |= LINK_SEQ_VALID;
+}
+
+/**
+ * @brief Sends the link summaries. The registry is walked one node every LINK_STATS_INTERVAL/N_NODES ms,
+ *        sending the summary of the node if it was heard since its previous one, so the summaries are
+ *        spread over the interval instead of blocking the serial port in a burst. A step waits for the
+ *        relay queue to be empty, so summaries never crowd out the messages of the nodes
+ * 
+ * @param currentMillis current time in millisenconds since boot
+ * @return void
+ */
+void linkUpdate(unsigned long currentMillis) {
+  if ((currentMillis - prevMilLink) < LINK_STATS_INTERVAL / N_NODES || relayUsed > 0)
+    return;
+  prevMilLink = currentMillis;
+
+  LinkStats *s = &linkStats[linkCursor];
+  if (s->frames > 0) {
+    relayLinkSummary(pgm_read_byte(&nodeRegistry[linkCursor].nodeID), s);
+    s->frames = 0;
+    s->uplinks = 0;
+    s->dups = 0;
+    s->lost = 0;
+  }
+  linkCursor = (linkCursor + 1) % N_NODES;
+}
+
+/**
+ * @brief Adds the link summary of a node to the relay queue, in the format selected by SERIAL_PROTOCOL.
+ *        PER is the share of the uplink msgIDs never received, in percent. Binary record layout,
+ *        multi-byte fields little endian: 'l', nodeID, frames (2 bytes), retransmissions (2 bytes), lost
+ *        (2 bytes), PER, RSSI average (tenths of dBm), minimum and maximum (dBm), SNR average, minimum
+ *        and maximum (hundredths of dB), all 2 bytes signed, VBAT (tenths of V), followed by the CRC16
+ * 
+ * @param nodeID ID of the node
+ * @param s link aggregates of the node
+ * @return void
+ */
+void relayLinkSummary(byte nodeID, LinkStats *s) {
+  char msg[MAX_JSON_PAYLOAD_SIZE];
+  unsigned long total = (unsigned long)s->uplinks + s->lost;
+  byte per = total ? (byte)((unsigned long)s->lost * 100 / total) : 0;
+  int rssiAvg = (long)s->rssiAvg * 10 / 16;
+  int snrAvg = (long)s->snrAvg * 100 / 16;
+
+  #if SERIAL_PROTOCOL == SERIAL_BINARY
+    int v[] = {rssiAvg, s->rssiMin, s->rssiMax, snrAvg, s->snrMin * 25, s->snrMax * 25};
+    byte record[LINK_RECORD_SIZE + 2];
+    record[0] = 'l';
+    record[1] = nodeID;
+    record[2] = (byte)s->frames;
+    record[3] = (byte)(s->frames >> 8);
+    record[4] = (byte)s->dups;
+    record[5] = (byte)(s->dups >> 8);
+    record[6] = (byte)s->lost;
+    record[7] = (byte)(s->lost >> 8);
+    record[8] = per;
+    for (int i=0; i<6; i++) {
+      record[9+2*i] = (byte)v[i];
+      record[10+2*i] = (byte)(v[i] >> 8);
+    }
+    record[21] = s->vbat;
+    unsigned int crc = crc16(record, LINK_RECORD_SIZE);
+    record[LINK_RECORD_SIZE] = (byte)crc;
+    record[LINK_RECORD_SIZE+1] = (byte)(crc >> 8);
+    relayPush(msg, cobsEncode(record, LINK_RECORD_SIZE + 2, (byte *)msg));
+  #else
+    int n = sprintf_P(msg, PSTR("{\"f\":\"l\",\"nID\":\"%d\",\"n\":\"%u\",\"dup\":\"%u\",\"lost\":\"%u\",\"PER\":\"%d\",\"RSSI\":\""), nodeID, s->frames, s->dups, s->lost, per);
+    n += formatFixed(msg + n, rssiAvg, 10);
+    n += sprintf_P(msg + n, PSTR(",%d,%d\",\"SNR\":\""), s->rssiMin, s->rssiMax);
+    n += formatFixed(msg + n, snrAvg, 100);
+    msg[n++] = ',';
+    n += formatFixed(msg + n, s->snrMin * 25, 100);
+    msg[n++] = ',';
+    n += formatFixed(msg + n, s->snrMax * 25, 100);
+    n += sprintf_P(msg + n, PSTR("\",\"VBAT\":\"%d.%01d\"}"), s->vbat / 10, s->vbat % 10);
+    relayPush(msg, n);
+  #endif
+}
+#endif
+
+/**
+ * @brief Length of a response slot of a network scan: a status frame on air with the current modem
+ *        settings plus SCAN_SLOT_GUARD, rounded up to SCAN_SLOT_UNIT
+ * 
+ * @return byte slot length in SCAN_SLOT_UNIT ms
+ */
+byte scanSlotLength() {
+  unsigned long ms = timeOnAir(MAX_ENC_PAYLOAD_SIZE + 2) / 1000 + SCAN_SLOT_GUARD;
+  return (byte)mymin((ms + SCAN_SLOT_UNIT - 1) / SCAN_SLOT_UNIT, 255);
+}
+
+/**
+ * @brief Starts counting the answers to a network scan once its request has been sent. The window closes
+ *        after the request, the last slot and SCAN_MARGIN
+ * 
+ * @param msgID ID of the broadcast status request
+ * @param currentMillis time the request was sent, in millisenconds since boot
+ * @return void
+ */
+void startScan(byte msgID, unsigned long currentMillis) {
+  for (unsigned int i=0; i<N_NODES; i++)
+    nodeState[i].flags &= ~NODE_SCANNED;
+  scanActive = true;
+  scanMsgID = msgID;
+  scanReplies = 0;
+  scanStart = currentMillis;
+  scanWindow = timeOnAir(MAX_ENC_PAYLOAD_SIZE + 2) / 1000 + (unsigned long)scanSlots * scanSlotLength() * SCAN_SLOT_UNIT + SCAN_MARGIN;
+  // Nodes synced to the beacons answer in their TDMA slot, before the next superframe
+  if (TDMA_ENABLED && tdmaSuperframe() + SCAN_MARGIN > scanWindow)
+    scanWindow = tdmaSuperframe() + SCAN_MARGIN;
+}
+
+/**
+ * @brief Counts a status message towards the running network scan if it answers it, once per node
+ * 
+ * @param nodeID ID of the node, must be registered
+ * @param msgID ID of the status message
+ * @return void
+ */
+void recordScanReply(byte nodeID, byte msgID) {
+  NodeState *n = findNode(nodeID);
+  if (!scanActive || msgID != scanMsgID || (n->flags & NODE_SCANNED))
+    return;
+  n->flags |= NODE_SCANNED;
+  scanReplies ++;
+}
+
+/**
+ * @brief Ends the running network scan once its window has closed and reports it to the server
+ * 
+ * @param currentMillis current time in millisenconds since boot
+ * @return void
+ */
+void scanUpdate(unsigned long currentMillis) {
+  if (scanActive && (currentMillis - scanStart) >= scanWindow) {
+    scanActive = false;
+    relayScanReport();
   }
 }
+
+/**
+ * @brief Adds the report of the last network scan to the relay queue, in the format selected by
+ *        SERIAL_PROTOCOL: the msgID of the request, the number of nodes that answered, the number of
+ *        registered nodes and the length of the window in ms. Binary record layout: 'n', msgID, answered,
+ *        registered, window (4 bytes, little endian), followed by the CRC16
+ * 
+ * @return void
+ */
+void relayScanReport() {
+  char msg[MAX_JSON_PAYLOAD_SIZE];
+  #if SERIAL_PROTOCOL == SERIAL_BINARY
+    byte record[SCAN_RECORD_SIZE + 2];
+    record[0] = 'n';
+    record[1] = scanMsgID;
+    record[2] = scanReplies;
+    record[3] = registeredNodes;
+    for (int i=0; i<4; i++)
+      record[4+i] = (byte)(scanWindow >> (8*i));
+    unsigned int crc = crc16(record, SCAN_RECORD_SIZE);
+    record[SCAN_RECORD_SIZE] = (byte)crc;
+    record[SCAN_RECORD_SIZE+1] = (byte)(crc >> 8);
+    relayPush(msg, cobsEncode(record, SCAN_RECORD_SIZE + 2, (byte *)msg));
+  #else
+    int n = sprintf_P(msg, PSTR("{\"f\":\"n\",\"msgID\":\"%d\",\"n\":\"%d\",\"of\":\"%d\",\"ms\":\"%lu\"}"), scanMsgID, scanReplies, registeredNodes, scanWindow);
+    relayPush(msg, n);
+  #endif
+}
+
+/**
+ * @brief Number of uplink slots of a TDMA superframe: TDMA_SLOTS or, if it is 0, the highest registered
+ *        node ID
+ * 
+ * @return byte number of slots
+ */
+byte tdmaSlotCount() {
+  return TDMA_SLOTS ? TDMA_SLOTS : scanSlots;
+}
+
+/**
+ * @brief Length of a TDMA slot: a frame of TDMA_FRAME_SIZE bytes and an ack on air with the current modem
+ *        settings plus TDMA_SLOT_GUARD, rounded up to SCAN_SLOT_UNIT
+ * 
+ * @return byte slot length in SCAN_SLOT_UNIT ms
+ */
+byte tdmaSlotLength() {
+  unsigned long ms = (timeOnAir(TDMA_FRAME_SIZE) + timeOnAir(MAX_ENC_PAYLOAD_SIZE + 2)) / 1000 + TDMA_SLOT_GUARD;
+  return (byte)mymin((ms + SCAN_SLOT_UNIT - 1) / SCAN_SLOT_UNIT, 255);
+}
+
+/**
+ * @brief Length of a TDMA superframe: the beacon slot and the uplink slots
+ * 
+ * @return unsigned long superframe length in ms
+ */
+unsigned long tdmaSuperframe() {
+  return (tdmaSlotCount() + 1UL) * tdmaSlotLength() * SCAN_SLOT_UNIT;
+}
+
+/**
+ * @brief Checks whether a request sent now ends within the beacon slot of the superframe. Always true
+ *        without TDMA_ENABLED
+ * 
+ * @param currentMillis current time in millisenconds since boot
+ * @return true if requests can be sent now
+ */
+bool tdmaDownlinkOpen(unsigned long currentMillis) {
+  #if TDMA_ENABLED
+    unsigned long phase = (currentMillis - tdmaStart) % tdmaSuperframe();
+    return phase + timeOnAir(MAX_ENC_PAYLOAD_SIZE + 2) / 1000 < (unsigned long)tdmaSlotLength() * SCAN_SLOT_UNIT;
+  #else
+    return true;
+  #endif
+}
+
+/**
+ * @brief Starts a new superframe once the current one has ended, with a beacon if TDMA_BEACON_INTERVAL has
+ *        passed since the last one. Superframes without a beacon follow on from the last one, a beacon waits
+ *        TDMA_SLOT_GUARD after the last frame the gateway sent
+ * 
+ * @param currentMillis current time in millisenconds since boot
+ * @return void
+ */
+void tdmaUpdate(unsigned long currentMillis) {
+  unsigned long len = tdmaSuperframe();
+  if ((currentMillis - tdmaStart) < len)
+    return;
+  bool beacon = tdmaBeaconID == 0 || (currentMillis - tdmaLastBeacon) >= TDMA_BEACON_INTERVAL;
+  // The nodes must be listening again after the last frame sent, the superframe starts with the beacon anyway
+  if (beacon && (currentMillis - prevMilTx) < TDMA_SLOT_GUARD)
+    return;
+  tdmaStart += (currentMillis - tdmaStart) / len * len;
+  if (beacon)
+    sendBeacon();
+}
+
+/**
+ * @brief Broadcasts the beacon of the superframe, which starts again when the beacon is sent so that the
+ *        nodes see the time it carries. Skipped, until the next superframe, without the airtime for it or
+ *        with the channel busy
+ * 
+ * @return void
+ */
+void sendBeacon() {
+  refillAirtime(millis());
+  if (airtimeBudget < (long)timeOnAir(MAX_ENC_PAYLOAD_SIZE + 2))
+    return;
+  byte payload[BLOCK_SIZE];
+  byte frame[MAX_ENC_PAYLOAD_SIZE];
+  tdmaBeaconID ++;
+  if (tdmaBeaconID == 0)
+    tdmaBeaconID ++;
+
+  tdmaStart = millis();
+  wsn::Superframe s = {tdmaSlotCount(), tdmaSlotLength(), (uint32_t)tdmaStart};
+  wsn::packBeacon(payload, tdmaBeaconID, s);
+  memcpy(frame, encrypt(getKeySchedule(BROADCAST_ID), payload), MAX_PAYLOAD_SIZE);
+  frame[MAX_PAYLOAD_SIZE] = '\0';
+  if (LoRa_sendMessage(frame, BROADCAST_ID))
+    tdmaLastBeacon = tdmaStart;
+}
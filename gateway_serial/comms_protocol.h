@@ -19,56 +19,219 @@
 #include "gateway_serial_definitions.h"
 #include <cppQueue.h>
 #include <aes256.h>
+#include <wsn_codec.h>
+#include <wsn_trace.h>
 
 #define  IMPLEMENTATION  FIFO
 
 // LoRa msg payload settings
 #define RELAY_INTERVAL 100
-#define MAX_JSON_PAYLOAD_SIZE 120
-#define MAX_R_QUEUE_SIZE 2
+// Longest record for the server plus its terminating null, a JSON link summary with every field at its widest
+#define MAX_JSON_PAYLOAD_SIZE 144
 #define MAX_QUEUE_SIZE 5
+// Queue slots kept free for acks, so that requests held for sleeping nodes never crowd them out
+#define ACK_RESERVE 2
 #define MAX_N_RETRY 3
-#define TIMEOUT_INTERVAL 3000
+// A downlink is retried once it and the node's answer could have gone through, plus this margin in ms
+#define ACK_MARGIN 1500
+// Retry backoff: BACKOFF_FIXED retries right after that timeout, BACKOFF_EXPONENTIAL adds a random wait
+// drawn from a window of BACKOFF_BASE ms that doubles after every attempt, up to BACKOFF_CAP ms
+#define BACKOFF_FIXED 0
+#define BACKOFF_EXPONENTIAL 1
+#ifndef BACKOFF_MODE
+#define BACKOFF_MODE BACKOFF_EXPONENTIAL
+#endif
+#define BACKOFF_BASE 500
+#define BACKOFF_CAP 4000
+#define MAX_IN_FLIGHT 5
+// Spacing of the frames the gateway sends, with TDMA_ENABLED the slots space them and acks go out at once
+#define SEND_INTERVAL (TDMA_ENABLED ? 0 : 250)
+// Uplinks already in the history of their node are acked again but not relayed. A history not updated for
+// DUPLICATE_WINDOW ms (counted in whole seconds) starts over, so that a node that rebooted and reuses its
+// msgIDs is not taken for a retransmission
+#define DUPLICATE_WINDOW 60000
+// Frames are copied out of the radio by the DIO0 receive interrupt into a ring of RX_RING_SIZE slots and
+// handled by the loop. Text commands from the server are collected up to MAX_LINE_SIZE characters. The
+// ATmega328P (Arduino Uno) only has RAM for a ring of two, see GATEWAY_RAM_RESERVE
+#if defined(__AVR_ATmega328P__)
+#define RX_RING_SIZE 2
+#else
+#define RX_RING_SIZE 4
+#endif
+#define MAX_RX_FRAME_SIZE (MAX_BATCH_PAYLOAD_SIZE + 3 + (MULTIHOP_ENABLED ? wsn::Relay::size : 0))
+#define MAX_LINE_SIZE 32
+
+// EU868 duty cycle: share of the time the radio may transmit, in 1/1000, and most airtime that can be
+// saved up for a burst, in ms (1 % of an hour)
+#define DUTY_CYCLE_PERMILLE 10
+#define AIRTIME_BUCKET_SIZE 36000
+#define PREAMBLE_LENGTH 8
+
+// Listen before talk: channel activity detection before every transmission. A busy channel defers the frame
+// by a random delay of up to LBT_BACKOFF ms. CAD_TIMEOUT bounds the wait for the detection in ms
+#ifndef LBT_ENABLED
+#define LBT_ENABLED 0
+#endif
+#define LBT_BACKOFF 200
+#define CAD_TIMEOUT 100
+
+// Low-power nodes set LEN_RX_WINDOW in the length byte of their frames and only listen for RX_WINDOW ms
+// after each of them. Downlinks to them are held until such a window, and must start RX_WINDOW_GUARD ms
+// before it closes. The windows of the RX_WINDOW_NODES low-power nodes heard last are tracked
+#define RX_WINDOW 1500
+#define RX_WINDOW_GUARD 200
+#if defined(__AVR_ATmega328P__)
+#define RX_WINDOW_NODES 4
+#else
+#define RX_WINDOW_NODES 16
+#endif
+
+// Serial protocol towards the server: SERIAL_JSON (text lines, easy to debug) or SERIAL_BINARY
+// (COBS framed records with a CRC, see relayPayload and receiveDownlinkFrames)
+#define SERIAL_JSON 0
+#define SERIAL_BINARY 1
+#ifndef SERIAL_PROTOCOL
+#define SERIAL_PROTOCOL SERIAL_JSON
+#endif
+
+#define RECORD_SIZE 15
+// Records without the RSSI, SNR and VBAT fields, see RELAY_PER_PACKET_LINK
+#define SHORT_RECORD_SIZE 10
+#define LINK_RECORD_SIZE 22
+#define SCAN_RECORD_SIZE 8
+
+// Network scans: a broadcast status request carries a response window of one slot per node ID up to the
+// highest registered one, and every node answers in the slot of its ID. A slot lasts a status frame plus
+// SCAN_SLOT_GUARD ms, sent to the nodes in units of SCAN_SLOT_UNIT ms. The scan is not retransmitted, the
+// gateway counts the answers and reports them to the server SCAN_MARGIN ms after the last slot
+#define SCAN_SLOT_GUARD 50
+#define SCAN_SLOT_UNIT 10
+#define SCAN_MARGIN 500
+
+// Multi-hop: the gateway takes the frames relay nodes forward (see wsn::Relay) and sends the downlinks for a
+// node back the way its last frame came. The last MULTIHOP_RECENT frames received are kept for
+// MULTIHOP_DUP_WINDOW ms: a relayed copy of one of them is dropped and the relay told to stop forwarding the
+// node. The answer to a downlink sent through relays is waited for MULTIHOP_HOP_MARGIN ms longer per hop
+#ifndef MULTIHOP_ENABLED
+#define MULTIHOP_ENABLED 0
+#endif
+#define MULTIHOP_RECENT 8
+#define MULTIHOP_DUP_WINDOW 1500
+#define MULTIHOP_HOP_MARGIN 1000
+
+// TDMA: time is divided into superframes of a beacon slot and one uplink slot per node ID up to the highest
+// registered one, as for scans, or TDMA_SLOTS uplink slots shared modulo the node ID. A superframe starts with
+// a beacon (see wsn::Beacon) once TDMA_BEACON_INTERVAL ms have passed since the last one, nodes keep to the
+// slots in between. A slot fits a frame of TDMA_FRAME_SIZE bytes and an ack on air plus TDMA_SLOT_GUARD ms,
+// rounded up to SCAN_SLOT_UNIT. Nodes synced to a beacon only send in the slot of their ID and are acked at
+// once, requests are sent in the beacon slot
+#ifndef TDMA_ENABLED
+#define TDMA_ENABLED 0
+#endif
+#ifndef TDMA_SLOTS
+#define TDMA_SLOTS 0
+#endif
+#define TDMA_BEACON_INTERVAL 30000
+#define TDMA_FRAME_SIZE (MAX_ENC_PAYLOAD_SIZE + 2)
+#define TDMA_SLOT_GUARD 60
+static_assert(!(TDMA_ENABLED && MULTIHOP_ENABLED), "relays do not hear the beacons");
+
+// Link statistics: the gateway keeps link aggregates of every node (moving average, minimum and maximum of
+// RSSI and SNR, frame, retransmission and loss counts, last VBAT) and sends one summary record per node
+// heard every LINK_STATS_INTERVAL ms, spread evenly over the interval. The averages weigh each frame by
+// 1/2^LINK_EWMA_SHIFT. With RELAY_PER_PACKET_LINK set to 0, the per-packet records leave out RSSI, SNR and
+// VBAT and the sending of acks is not reported, the summaries carry that information
+#ifndef LINK_STATS_ENABLED
+#define LINK_STATS_ENABLED 0
+#endif
+#ifndef RELAY_PER_PACKET_LINK
+#define RELAY_PER_PACKET_LINK 1
+#endif
+#define LINK_STATS_INTERVAL 300000
+#define LINK_EWMA_SHIFT 3
+// A jump in the msgIDs of a node longer than this is taken for a reboot, not for lost messages
+#define LINK_MAX_GAP 64
+
+// Records for the server wait in a ring, each stored after a length byte, so that short records take less
+// room. The ring holds RELAY_RECORDS records of the longest kind the build sends, RELAY_RECORD_SIZE bytes
+// long. In JSON that is a sensor record with RSSI, SNR and VBAT, 132 bytes (117 with typical values), or a
+// link summary, 143 bytes. In binary it is a link summary, 25 bytes framed, or a sensor record, 18 bytes.
+// Shorter records leave room for more. The ATmega328P only has RAM for two JSON records
+#if SERIAL_PROTOCOL == SERIAL_BINARY
+#define RELAY_RECORD_SIZE ((LINK_STATS_ENABLED ? LINK_RECORD_SIZE : RECORD_SIZE) + 3)
+#else
+#define RELAY_RECORD_SIZE (LINK_STATS_ENABLED ? 143 : 132)
+#endif
+#if defined(__AVR_ATmega328P__)
+#define RELAY_RECORDS (SERIAL_PROTOCOL == SERIAL_BINARY ? 8 : 2)
+#else
+#define RELAY_RECORDS 8
+#endif
+#define RELAY_BUFFER_SIZE (RELAY_RECORDS * (RELAY_RECORD_SIZE + 1))
+
+// Adaptive data rate: the gateway picks the fastest modem profile every node can use with ADR_MARGIN dB
+// of SNR to spare, from the last ADR_HISTORY frames of each node, and moves the network to it
+#ifndef ADR_ENABLED
+#define ADR_ENABLED 0
+#endif
+#define ADR_HISTORY 8
+#define ADR_MIN_SAMPLES 4
+#define ADR_MARGIN 6
+#define ADR_INTERVAL 60000
+// Time without a new node showing up before ADR changes the profile. Nodes it has not heard yet are not moved,
+// they find the network again with PROFILE_SCAN_ENABLED on the nodes
+#define ADR_SETTLE 600000
+#define MODEM_PROFILE_ACT_ID 250
+
+// Latency tracing: TRACE(stage) measures the rest of the enclosing block and keeps the last TRACE_RING_SIZE
+// measurements, dumped to the server by the 'x' downlink command (see wsn_trace.h). Compiled out unless
+// TRACE_ENABLED is set
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 0
+#endif
+#define TRACE_RING_SIZE 32
+#if TRACE_ENABLED
+#define TRACE(stage) wsn::TraceScope<TRACE_RING_SIZE> WSN_TRACE_NAME(__LINE__)(traceRing, wsn::stage)
+#else
+#define TRACE(stage)
+#endif
+
+// Expanded AES-256 key schedules kept ready, least recently used one is replaced. A schedule takes 96 bytes,
+// the ATmega328P keeps two
+#if defined(__AVR_ATmega328P__)
+#define KEY_CACHE_SIZE 2
+#else
+#define KEY_CACHE_SIZE 4
+#endif
+#define MAX_FRAME_SIZE 32
 
 #define BLOCK_SIZE 16
 #define MAX_PAYLOAD_SIZE 16
 #define ENC_BLOCK_SIZE (1*BLOCK_SIZE)
 #define MAX_ENC_PAYLOAD_SIZE ((MAX_PAYLOAD_SIZE/BLOCK_SIZE)*ENC_BLOCK_SIZE)+1
-#define KEY_SIZE 32
 
 #define MAX_MSG_ID 256
 
+// Largest plaintext of a batch frame, see wsn::Batch
+#define MAX_BATCH_PAYLOAD_SIZE WSN_MAX_BATCH_SIZE
+
 #define BROADCAST_ID 0xFF
 
-// Encryption keys
-const uint8_t keys[][KEY_SIZE] = {{ //
-  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-  0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
-  0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
-  0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x0f
-},{ //
-  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-  0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
-  0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
-  0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f
-},
-{ //
-  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-  0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
-  0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
-  0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x2f
-},
-{ //
-  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-  0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
-  0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
-  0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x3f
-},{ //
-  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-  0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
-  0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
-  0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x4f
-}};
+// Number of nodes in the registry, see nodeRegistry in gateway_serial_definitions.h
+#define N_NODES (sizeof(nodeRegistry) / sizeof(nodeRegistry[0]))
+static_assert(N_NODES <= 254, "node IDs 0 and BROADCAST_ID cannot be registered");
+// On AVR boards the tables of the gateway, the Serial and LoRa objects and GATEWAY_RAM_RESERVE bytes for the
+// stack (about 350 bytes while a record is formatted) and the small globals must fit in the RAM. Every
+// registered node takes sizeof(NodeState) bytes, plus sizeof(LinkStats) with LINK_STATS_ENABLED and
+// sizeof(AdrNode) with ADR_ENABLED. That leaves room for about 6 nodes on an Arduino Uno, or about 20 with
+// SERIAL_BINARY, see the RAM table in install_guide.md
+#define GATEWAY_RAM_RESERVE 512
+
+// Flags of NodeState
+#define NODE_HEARD 0x01       // an uplink was received, the history fields are valid
+#define NODE_LOW_POWER 0x02   // the node only listens in the receive window after its frames
+#define NODE_SCANNED 0x04     // the node answered the running network scan
+#define NODE_RELAY 0x08       // the node is a relay, it only hears relay frames
 
 // LoRa Modem Settings
 const long frequency = 868E6;
@@ -77,6 +240,30 @@ const int spreadingFactor = 7;
 const long signalBandwidth = 125E3;
 const int codingRateDenominator = 5;
 
+/**
+ * @brief Modem settings of a profile, selected on the nodes through actuator MODEM_PROFILE_ACT_ID
+ * 
+ */
+typedef struct strModemProfile {
+  int spreadingFactor;
+  long signalBandwidth;
+  int codingRateDenominator;
+} ModemProfile;
+
+// Same profiles as setActState on the nodes, profile 0 matches the settings above
+const ModemProfile modemProfiles[] = {
+  {7, 125000, 5},
+  {9, 125000, 5},
+  {11, 125000, 5},
+  {7, 250000, 5},
+  {7, 125000, 8}
+};
+
+// Profiles ADR picks from, fastest first, and the SNR in dB (referred to 125 kHz) each one needs
+const byte adrProfiles[] = {3, 0, 1, 2};
+const float adrRequiredSnr[] = {-4.5, -7.5, -12.5, -17.5};
+#define ADR_N_PROFILES 4
+
 /**
  * @brief Data structure that holds the data for all the fields in the payload
  * 
@@ -89,8 +276,9 @@ typedef struct strPayload {
   char flag;
   int RSSI;
   float SNR;
-  float VBAT;
-  double milis;
+  byte vbat; // Battery voltage of the node in tenths of a volt
+  double milis; // Age of a sensor reading when it was received, in ms
+  byte dups; // Retransmissions from the node not relayed since its previous uplink
 } Payload;
 
 /**
@@ -106,29 +294,264 @@ typedef struct strMsg {
   byte actVal;
 } Msg;
 
-extern int currMsg;
-extern int count;
+/**
+ * @brief Slot of the receive ring. Holds a frame as read from the radio by the receive interrupt, along
+ *        with its RSSI and SNR
+ * 
+ */
+typedef struct strRxPacket {
+  byte data[MAX_RX_FRAME_SIZE];
+  byte len;
+  int rssi;
+  float snr;
+} RxPacket;
+
+/**
+ * @brief Slot of the in-flight table. Holds a downlink message waiting for its response from the node
+ *        along with its own retransmission counter and timer
+ * 
+ */
+typedef struct strInFlight {
+  Msg msg;
+  byte count;
+  unsigned long sentMil;
+  unsigned long wait;
+  bool used;
+} InFlight;
+
+/**
+ * @brief Entry of the key schedule cache, nodeID is BROADCAST_ID for the broadcast key
+ * 
+ */
+typedef struct strKeyCacheEntry {
+  aes256_context ctxt;
+  byte nodeID;
+  unsigned long lastUse;
+  bool used;
+} KeyCacheEntry;
+
+/**
+ * @brief Link history of one node for the ADR engine, one per registry entry. SNR is kept in quarter dB
+ *        referred to 125 kHz, RSSI as a positive number of -dBm. profile is the modem profile the node is
+ *        using, count is 0 until the node is heard
+ * 
+ */
+typedef struct strAdrNode {
+  byte profile;
+  signed char snr[ADR_HISTORY];
+  byte rssi[ADR_HISTORY];
+  byte count;
+  byte next;
+  bool commanded;
+} AdrNode;
+
+/**
+ * @brief Receive window of a low-power node, opened by its last frame
+ * 
+ */
+typedef struct strRxWindow {
+  byte nodeID;
+  unsigned long opened;
+  bool used;
+} RxWindow;
+
+/**
+ * @brief Runtime state of a registered node, one per registry entry. Bit k of mask is set when msgID
+ *        lastMsgID-k-1 was received, which lets an ack also cover the frames sent before it and tells
+ *        retransmissions apart. dups counts the retransmissions not relayed since the last relayed uplink.
+ *        lastSeen is the time of the last uplink in seconds, 16 bits are plenty for DUPLICATE_WINDOW. via
+ *        is the relay the last frame of the node came through, 0 if none, and hops the number of relays on
+ *        the way
+ * 
+ */
+typedef struct strNodeState {
+  byte lastMsgID;
+  byte mask;
+  byte dups;
+  byte flags;
+  uint16_t lastSeen;
+  byte via;
+  byte hops;
+} NodeState;
+
+/**
+ * @brief Frame received recently, to tell relayed copies of it apart, see MULTIHOP_ENABLED
+ * 
+ */
+typedef struct strRecentFrame {
+  byte nodeID;
+  byte msgID;
+  byte type;
+  unsigned long t;
+  bool used;
+} RecentFrame;
+
+/**
+ * @brief Link aggregates of one node, see LINK_STATS_ENABLED. The averages are in 1/16 dB(m) and SNR
+ *        extremes in quarter dB. Counts, extremes and the loss estimate start over with every summary:
+ *        frames counts every frame received, dups the retransmissions of uplinks already received and
+ *        lost the msgIDs skipped by the node's uplinks
+ * 
+ */
+typedef struct strLinkStats {
+  int16_t rssiAvg;
+  int16_t snrAvg;
+  int16_t rssiMin;
+  int16_t rssiMax;
+  signed char snrMin;
+  signed char snrMax;
+  uint16_t frames;
+  uint16_t uplinks;
+  uint16_t dups;
+  uint16_t lost;
+  byte nextMsgID;
+  byte vbat;
+  byte flags;
+} LinkStats;
+
+// Flags of LinkStats
+#define LINK_AVG_VALID 0x01   // the averages hold at least one frame
+#define LINK_SEQ_VALID 0x02   // nextMsgID follows the last uplink
+
+extern InFlight inFlight[MAX_IN_FLIGHT];
+extern byte nodeSlot[256];
+extern NodeState nodeState[N_NODES];
+#if LINK_STATS_ENABLED
+extern LinkStats linkStats[N_NODES];
+extern unsigned long prevMilLink;
+extern unsigned int linkCursor;
+#endif
+extern byte scanSlots;
+extern byte registeredNodes;
+extern bool scanActive;
+extern byte scanMsgID;
+extern byte scanReplies;
+extern unsigned long scanStart;
+extern unsigned long scanWindow;
+extern byte netProfile;
+#if ADR_ENABLED
+extern AdrNode adrNodes[N_NODES];
+extern byte adrTarget;
+extern unsigned long prevMilADR;
+extern unsigned long adrLastJoin;
+#endif
+extern int curSpreadingFactor;
+extern long curSignalBandwidth;
+extern int curCodingRateDenominator;
+extern long airtimeBudget;
+extern RxWindow rxWindows[RX_WINDOW_NODES];
+extern RecentFrame recentFrames[MULTIHOP_RECENT];
+extern byte recentNext;
+extern unsigned long prevMilTx;
+extern unsigned long tdmaStart;
+extern unsigned long tdmaLastBeacon;
+extern byte tdmaBeaconID;
+extern volatile bool cadDone;
+extern volatile bool cadBusy;
+extern unsigned long prevMilDC;
+extern byte dlFrame[MAX_FRAME_SIZE];
+extern int dlFrameLen;
+extern char dlLine[MAX_LINE_SIZE];
+extern int dlLineLen;
+extern RxPacket rxRing[RX_RING_SIZE];
+extern volatile byte rxHead;
+extern volatile byte rxTail;
+extern volatile unsigned int rxDropped;
 extern unsigned long prevMilR;
 extern unsigned long prevMil;
 extern int msgCount;
 
-extern cppQueue relay_q;
+extern byte relayBuf[RELAY_BUFFER_SIZE];
+extern int relayHead;
+extern int relayUsed;
+extern unsigned int relayDropped;
 extern cppQueue msg_q;
-extern aes256_context ctxt;
+extern KeyCacheEntry keyCache[KEY_CACHE_SIZE];
+extern unsigned long keyUseCount;
+#if TRACE_ENABLED
+extern wsn::TraceRing<TRACE_RING_SIZE> traceRing;
+#endif
 
 void LoRa_rxMode();
-void LoRa_txMode();
-void LoRa_sendMessage(byte *message, byte nodeID);
+bool LoRa_txMode(bool toNode);
+bool LoRa_sendMessage(byte *message, byte nodeID);
+bool LoRa_sendFrame(byte relayID, byte hops, byte nodeID, const byte *message, byte len);
+void onCadDone(boolean detected);
 int mymin(int a, int b);
-char  *decryptMsg(char msg[MAX_PAYLOAD_SIZE+1]);
+char  *decryptMsg(aes256_context *ctxt, char msg[MAX_PAYLOAD_SIZE+1]);
+void initNodeRegistry();
+NodeState *findNode(byte nodeID);
+aes256_context *getKeySchedule(byte nodeID);
 void onReceive(int packetSize);
+void receivePackets();
+void handlePacket(RxPacket *pkt);
+bool routeFrame(byte nodeID, const byte *plain, byte relayID, byte hops);
+byte routeRelay(byte nodeID);
+unsigned long routeDelay(byte nodeID);
+void sendPrune(byte relayID, byte nodeID);
+void setModem(int sf, long bw, int crd);
+void setModemProfile(byte profile);
+unsigned long timeOnAir(byte len);
+unsigned long retryWait(byte count);
+void refillAirtime(unsigned long currentMillis);
+long remainingAirtime();
+#if ADR_ENABLED
+void adrRecord(byte nodeID, int rssi, float snr);
+byte adrNodeProfile(byte nodeID);
+int adrRequiredProfile(AdrNode *n);
+bool adrCommandPending();
+void adrCommandDone(byte nodeID, byte profile);
+void adrUpdate(unsigned long currentMillis);
+#endif
+#if LINK_STATS_ENABLED
+void linkRecord(byte nodeID, int rssi, float snr, byte vbat);
+void linkRecordUplink(byte nodeID, byte msgID, byte count, bool duplicate);
+void linkUpdate(unsigned long currentMillis);
+void relayLinkSummary(byte nodeID, LinkStats *s);
+#endif
+byte scanSlotLength();
+void startScan(byte msgID, unsigned long currentMillis);
+void recordScanReply(byte nodeID, byte msgID);
+void scanUpdate(unsigned long currentMillis);
+void relayScanReport();
+byte tdmaSlotCount();
+byte tdmaSlotLength();
+unsigned long tdmaSuperframe();
+bool tdmaDownlinkOpen(unsigned long currentMillis);
+void tdmaUpdate(unsigned long currentMillis);
+void sendBeacon();
+int formatFixed(char *buf, long v, int scale);
+void unpackBatch(aes256_context *ctxt, byte *first, char *frame, int frameLen, int rssi, float snr);
 void onTxDone();
-byte *encrypt(char msg[MAX_PAYLOAD_SIZE]);
-void sendAck(byte msgID, byte nodeID);
+byte *encrypt(aes256_context *ctxt, const byte msg[BLOCK_SIZE]);
+void sendAck(byte msgID, byte nodeID, byte mask);
+byte recordUplink(byte nodeID, byte msgID, bool *duplicate);
+byte slideHistory(NodeState *n, byte msgID, bool *duplicate);
+byte takeDuplicates(byte nodeID);
 void relayMsgFromQueueToServer(unsigned long currentMillis);
+bool relayPush(const char *msg, int len);
+int relayPop(char *msg);
+int relayFree();
 void constructJsonAndAddToQueue(Payload p);
+void constructFrameAndAddToQueue(Payload p);
+void relayPayload(Payload p);
+void relayText(const char *text);
+unsigned int crc16(const byte *data, int len);
+int cobsEncode(const byte *in, int len, byte *out);
+int cobsDecode(const byte *in, int len, byte *out);
+void receiveDownlinkFrames();
+void receiveDownlinkLines();
+void relayDownlinkFrame(byte *frame, int len);
 void relayDownlinkMsg(char *dlMsg);
+#if TRACE_ENABLED
+void traceDump();
+#endif
 void getMsgFromQueueAndSend(unsigned long currentMillis);
+int findInFlight(byte nodeID, byte msgID);
+bool isNodeInFlight(byte nodeID);
+bool requestQueueFull();
+void openRxWindow(byte nodeID, unsigned long currentMillis);
+bool nodeListening(byte nodeID, unsigned long currentMillis);
 void sendStatusRequest(byte nodeID);
 void sendActuatorControl(byte nodeID, byte actID, byte actVal);
 
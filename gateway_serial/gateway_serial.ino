@@ -16,13 +16,14 @@
  * ----------------------------
  * @brief Arduino setup function
  * 
- * Runs once at boot. Configure the serial communication. Configure the LoRa radio.
+ * Runs once at boot. Configure the serial communication. Index the node registry. Configure the LoRa radio.
  * Configure the sensors and actuators input mode
  * 
  * @return void
  */
 void setup() {
   Serial.begin(BAUD_RATE);
+  initNodeRegistry();
 
   #if defined(ESP32)
     SPI.begin(SCK, MISO, MOSI, SS);
@@ -31,22 +32,21 @@ void setup() {
   LoRa.setPins(SS, RST, DIO0);
 
   if (!LoRa.begin(frequency)) {
-    Serial.write("LoRa init failed.\n");
+    relayText("LoRa init failed.");
     while (true);                       // if failed, do nothing
   }
   
   LoRa.setTxPower(txPower);
-  LoRa.setSignalBandwidth(signalBandwidth);
-  LoRa.setCodingRate4(codingRateDenominator);
-  LoRa.setSpreadingFactor(spreadingFactor);
+  setModem(spreadingFactor, signalBandwidth, codingRateDenominator);
   
   LoRa.setSyncWord(netID);
   LoRa.enableCrc();
+  LoRa.onReceive(onReceive);
   LoRa_rxMode();
 
   prevMil = millis();
 
-  Serial.write("Startup complete\n");
+  relayText("Startup complete");
 }
 
 /**
@@ -54,9 +54,12 @@ void setup() {
  * ----------------------------
  * @brief Arduino loop function
  * 
- * Main loop function. checks for incoming uplink messages and downlink requests from the server.
- * calls getMsgFromQueueAndSend on fixed schedules to avoid congestion of the communication channel
- * and sends an uplink message with the node status periodically.
+ * Main loop function. Handles the uplink messages received by the radio interrupt and the downlink
+ * requests from the server, reading the serial port without blocking.
+ * calls getMsgFromQueueAndSend at a fixed minimum spacing to avoid congestion of the communication channel
+ * and sends an uplink message with the node status periodically. Reports a network scan once its window
+ * has closed. With LINK_STATS_ENABLED, sends the link summaries of the nodes. With TDMA_ENABLED, starts the
+ * superframes and sends their beacons.
  * 
  * @return void
  */
@@ -64,26 +67,37 @@ void loop()
 {
   unsigned long currentMillis = millis();
 
-  int packetSize = LoRa.parsePacket();
-  if (packetSize) {
-    onReceive(packetSize);
-  }
+  // Handle the frames received by the radio interrupt
+  receivePackets();
 
   // Receive downlink msgs from server
-  if (Serial.available() > 0) {
-    String dlMsg = Serial.readString();
-    char msg[dlMsg.length()];
-    dlMsg.toCharArray(msg, dlMsg.length());
-
-    relayDownlinkMsg(msg);
-  }
+  #if SERIAL_PROTOCOL == SERIAL_BINARY
+    receiveDownlinkFrames();
+  #else
+    receiveDownlinkLines();
+  #endif
   
   //if((currentMillis-prevMilR) > RELAY_INTERVAL){
   relayMsgFromQueueToServer(currentMillis);
   //}
 
-  if((currentMillis-prevMil) > TIMEOUT_INTERVAL){
+  if((currentMillis-prevMil) > SEND_INTERVAL){
     //sendStatusRequest(1);
     getMsgFromQueueAndSend(currentMillis);
   }
+
+  scanUpdate(currentMillis);
+
+  // Start the superframes on time, after any frame sent above
+  #if TDMA_ENABLED
+    tdmaUpdate(millis());
+  #endif
+
+  #if ADR_ENABLED
+    adrUpdate(currentMillis);
+  #endif
+
+  #if LINK_STATS_ENABLED
+    linkUpdate(currentMillis);
+  #endif
 }
@@ -23,4 +23,49 @@
 const int gatewayID = 0xFF;
 const byte netID = 0xF3;
 
+#define KEY_SIZE 32
+
+// Registry of the nodes of the network, kept in flash. Every node has an entry with its ID (1 to 254, in any
+// order) and its unique AES-256 key; frames from nodes that are not listed are dropped before decryption.
+// Each node also takes RAM, an Arduino Uno holds about 6 of them, see GATEWAY_RAM_RESERVE
+typedef struct strNodeEntry {
+  byte nodeID;
+  uint8_t key[KEY_SIZE];
+} NodeEntry;
+
+// Key of the status requests broadcast to every node, must match keyBroadcast on the nodes
+const uint8_t broadcastKey[KEY_SIZE] PROGMEM = {
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+  0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+  0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+  0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x0f
+};
+
+const NodeEntry nodeRegistry[] PROGMEM = {
+  {0x01, {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f
+  }},
+  {0x02, {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x2f
+  }},
+  {0x03, {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x3f
+  }},
+  {0x04, {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x4f
+  }}
+};
+
 #endif
@@ -0,0 +1,342 @@
+/**
+ * @file wsn_codec.h
+ * @brief Message codec shared by the node and gateway firmware. The plaintext layout of every message type
+ *        is described once, by compile-time field descriptors, and the pack and unpack routines built on
+ *        them are plain byte stores and loads. Every field takes the full 0-255 range: the plaintext is
+ *        zero padded to whole AES blocks and its length is sent along, so no field has to avoid zero
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef WSN_CODEC_H
+#define WSN_CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define WSN_BLOCK_SIZE 16
+// Largest plaintext of a batch frame the gateway takes, 4 blocks hold up to 19 readings
+#define WSN_MAX_BATCH_SIZE 64
+
+// Length byte flag telling the gateway that the node only listens in the receive window after its frames
+#define LEN_RX_WINDOW 0x80
+
+// Node ID sent in the clear by relay frames, which carry a wsn::Relay header before the frame they forward
+#define WSN_RELAY_FRAME 0x00
+
+namespace wsn {
+
+/**
+ * @brief Message types, sent in the type field of the header
+ *
+ */
+enum MsgType : uint8_t {
+  MSG_UPLINK = 'u',   // sensor reading, node to gateway
+  MSG_BATCH = 'b',    // several sensor readings, node to gateway
+  MSG_STATUS = 's',   // status request from the gateway, status update from the node
+  MSG_ACK = 'a',      // acknowledge, both ways
+  MSG_CONTROL = 'c',  // actuator command, gateway to node
+  MSG_BEACON = 't'    // start of a TDMA superframe, gateway to every node
+};
+
+/**
+ * @brief Descriptor of a field of type T stored little endian at byte Offset of the plaintext
+ *
+ */
+template <uint8_t Offset, typename T = uint8_t>
+struct Field {
+  static constexpr uint8_t offset = Offset;
+  static constexpr uint8_t end = Offset + sizeof(T);
+
+  static inline void put(uint8_t *buf, T v) {
+    for (uint8_t i = 0; i < sizeof(T); i++)
+      buf[Offset + i] = (uint8_t)(v >> (8 * i));
+  }
+
+  static inline T get(const uint8_t *buf) {
+    T v = 0;
+    for (uint8_t i = 0; i < sizeof(T); i++)
+      v |= (T)buf[Offset + i] << (8 * i);
+    return v;
+  }
+};
+
+/**
+ * @brief Header of every message. The length byte holds the plaintext length, a multiple of the block
+ *        size, and LEN_RX_WINDOW
+ *
+ */
+struct Header {
+  typedef Field<0> NodeID;
+  typedef Field<1> MsgID;
+  typedef Field<2> Len;
+  typedef Field<3> Type;
+  static constexpr uint8_t size = Type::end;
+};
+
+/**
+ * @brief Single block message: sensor reading (A sensorID, B sensorVal), status update, acknowledge (A
+ *        bitmap of the msgIDs before msgID also received, with the top bit set) and actuator command (A
+ *        actuator ID, B value). Vbat is the battery voltage of the node in tenths of a volt
+ *
+ */
+struct Single : Header {
+  typedef Field<4> A;
+  typedef Field<5> B;
+  typedef Field<6> Vbat;
+  static constexpr uint8_t size = Vbat::end;
+};
+
+/**
+ * @brief Batch message: header, battery voltage, number of readings, then the readings. Readings take
+ *        consecutive msgIDs starting at the one in the header. Age is how long the reading waited in the
+ *        batch, in tenths of a second
+ *
+ */
+struct Batch : Header {
+  typedef Field<4> Vbat;
+  typedef Field<5> Count;
+  static constexpr uint8_t size = Count::end;
+
+  struct Reading {
+    typedef Field<0> SensorID;
+    typedef Field<1> SensorVal;
+    typedef Field<2> Age;
+    static constexpr uint8_t size = Age::end;
+  };
+};
+
+/**
+ * @brief Beacon message, broadcast by the gateway at the start of a TDMA superframe: a beacon slot followed
+ *        by Slots uplink slots of SlotLen units of 10 ms each. Time is the gateway's millis() at the start
+ *        of the superframe, nodes keep their offset to it
+ *
+ */
+struct Beacon : Header {
+  typedef Field<4> Slots;
+  typedef Field<5> SlotLen;
+  typedef Field<6, uint32_t> Time;
+  static constexpr uint8_t size = Time::end;
+};
+
+/**
+ * @brief Header of a relay frame, sent in the clear after the network ID and WSN_RELAY_FRAME and followed by
+ *        the ciphertext of the frame it forwards. Going up, RelayID is the relay that sent the frame and
+ *        NodeID the node it comes from; going down, RelayID is the relay it is for and NodeID the node it
+ *        goes to. Hops holds the number of relays an uplink went through and the RELAY_DOWN and RELAY_PRUNE
+ *        flags. A prune carries no frame and tells the relay to stop forwarding the frames of NodeID
+ *
+ */
+struct Relay {
+  typedef Field<0> Hops;
+  typedef Field<1> RelayID;
+  typedef Field<2> NodeID;
+  static constexpr uint8_t size = NodeID::end;
+};
+
+// Flags of the Hops field of a relay frame
+const uint8_t RELAY_DOWN = 0x80;
+const uint8_t RELAY_PRUNE = 0x40;
+const uint8_t RELAY_HOPS = 0x3F;
+
+static_assert(Single::size <= WSN_BLOCK_SIZE, "single messages must fit in one block");
+static_assert(Batch::size + Batch::Reading::size <= WSN_BLOCK_SIZE, "the first reading must fit in the first block");
+static_assert(Beacon::size <= WSN_BLOCK_SIZE, "beacons must fit in one block");
+
+/**
+ * @brief Rounds a plaintext length up to whole blocks
+ *
+ */
+constexpr uint8_t paddedSize(int len) {
+  return (uint8_t)((len + WSN_BLOCK_SIZE - 1) / WSN_BLOCK_SIZE * WSN_BLOCK_SIZE);
+}
+
+/**
+ * @brief Plaintext length of a batch of n readings
+ *
+ */
+constexpr uint8_t batchSize(int n) {
+  return paddedSize(Batch::size + Batch::Reading::size * n);
+}
+
+/**
+ * @brief Fields of a single block message
+ *
+ */
+struct Message {
+  uint8_t nodeID;
+  uint8_t msgID;
+  uint8_t flags;    // LEN_RX_WINDOW or 0
+  uint8_t type;
+  uint8_t a;
+  uint8_t b;
+  uint8_t vbat;
+};
+
+/**
+ * @brief Fields of a reading in a batch message
+ *
+ */
+struct Reading {
+  uint8_t sensorID;
+  uint8_t sensorVal;
+  uint8_t age;
+};
+
+/**
+ * @brief Fields of a beacon message
+ *
+ */
+struct Superframe {
+  uint8_t slots;
+  uint8_t slotLen;
+  uint32_t time;
+};
+
+/**
+ * @brief Converts a battery voltage to tenths of a volt, the unit of the Vbat fields
+ *
+ */
+inline uint8_t vbatTenths(float v) {
+  if (v <= 0)
+    return 0;
+  if (v >= 25.5)
+    return 255;
+  return (uint8_t)(v * 10 + 0.5);
+}
+
+/**
+ * @brief Writes a single block message, padded with zeros
+ *
+ * @param plain block to write to
+ * @param m fields of the message
+ * @return uint8_t plaintext length
+ */
+inline uint8_t pack(uint8_t *plain, const Message &m) {
+  memset(plain, 0, WSN_BLOCK_SIZE);
+  Single::NodeID::put(plain, m.nodeID);
+  Single::MsgID::put(plain, m.msgID);
+  Single::Len::put(plain, WSN_BLOCK_SIZE | m.flags);
+  Single::Type::put(plain, m.type);
+  Single::A::put(plain, m.a);
+  Single::B::put(plain, m.b);
+  Single::Vbat::put(plain, m.vbat);
+  return WSN_BLOCK_SIZE;
+}
+
+/**
+ * @brief Reads a single block message
+ *
+ * @param plain decrypted block
+ * @param m fields of the message
+ * @return void
+ */
+inline void unpack(const uint8_t *plain, Message *m) {
+  m->nodeID = Single::NodeID::get(plain);
+  m->msgID = Single::MsgID::get(plain);
+  m->flags = Single::Len::get(plain) & LEN_RX_WINDOW;
+  m->type = Single::Type::get(plain);
+  m->a = Single::A::get(plain);
+  m->b = Single::B::get(plain);
+  m->vbat = Single::Vbat::get(plain);
+}
+
+/**
+ * @brief Writes a beacon message, padded with zeros
+ *
+ * @param plain block to write to
+ * @param msgID ID of the beacon
+ * @param s fields of the beacon
+ * @return uint8_t plaintext length
+ */
+inline uint8_t packBeacon(uint8_t *plain, uint8_t msgID, const Superframe &s) {
+  memset(plain, 0, WSN_BLOCK_SIZE);
+  Beacon::NodeID::put(plain, 0xFF);      // BROADCAST_ID of the firmware
+  Beacon::MsgID::put(plain, msgID);
+  Beacon::Len::put(plain, WSN_BLOCK_SIZE);
+  Beacon::Type::put(plain, MSG_BEACON);
+  Beacon::Slots::put(plain, s.slots);
+  Beacon::SlotLen::put(plain, s.slotLen);
+  Beacon::Time::put(plain, s.time);
+  return WSN_BLOCK_SIZE;
+}
+
+/**
+ * @brief Reads a beacon message
+ *
+ * @param plain decrypted block
+ * @param s fields of the beacon
+ * @return void
+ */
+inline void unpackBeacon(const uint8_t *plain, Superframe *s) {
+  s->slots = Beacon::Slots::get(plain);
+  s->slotLen = Beacon::SlotLen::get(plain);
+  s->time = Beacon::Time::get(plain);
+}
+
+/**
+ * @brief Writes the header of a batch message of n readings and pads the whole batch with zeros. The
+ *        readings are written with packReading
+ *
+ * @param plain buffer of batchSize(n) bytes
+ * @param m header fields, type, a and b are not used
+ * @param n number of readings
+ * @return uint8_t plaintext length
+ */
+inline uint8_t packBatch(uint8_t *plain, const Message &m, uint8_t n) {
+  uint8_t len = batchSize(n);
+  memset(plain, 0, len);
+  Batch::NodeID::put(plain, m.nodeID);
+  Batch::MsgID::put(plain, m.msgID);
+  Batch::Len::put(plain, len | m.flags);
+  Batch::Type::put(plain, MSG_BATCH);
+  Batch::Vbat::put(plain, m.vbat);
+  Batch::Count::put(plain, n);
+  return len;
+}
+
+/**
+ * @brief Writes reading i of a batch message
+ *
+ */
+inline void packReading(uint8_t *plain, uint8_t i, const Reading &r) {
+  uint8_t *at = plain + Batch::size + Batch::Reading::size * i;
+  Batch::Reading::SensorID::put(at, r.sensorID);
+  Batch::Reading::SensorVal::put(at, r.sensorVal);
+  Batch::Reading::Age::put(at, r.age);
+}
+
+/**
+ * @brief Reads the header of a batch message from its first block
+ *
+ * @param plain decrypted first block
+ * @param m header fields
+ * @param len plaintext length of the whole batch
+ * @param n number of readings
+ * @return true if the length and count are consistent, and len is at most maxLen
+ */
+inline bool unpackBatch(const uint8_t *plain, Message *m, uint8_t *len, uint8_t *n, int maxLen) {
+  unpack(plain, m);
+  *len = Batch::Len::get(plain) & ~LEN_RX_WINDOW;
+  *n = Batch::Count::get(plain);
+  m->vbat = Batch::Vbat::get(plain);
+  return *len % WSN_BLOCK_SIZE == 0 && *len <= maxLen && *n >= 1 && Batch::size + Batch::Reading::size * *n <= *len;
+}
+
+/**
+ * @brief Reads reading i of a batch message, the blocks holding it must be decrypted
+ *
+ */
+inline void unpackReading(const uint8_t *plain, uint8_t i, Reading *r) {
+  const uint8_t *at = plain + Batch::size + Batch::Reading::size * i;
+  r->sensorID = Batch::Reading::SensorID::get(at);
+  r->sensorVal = Batch::Reading::SensorVal::get(at);
+  r->age = Batch::Reading::Age::get(at);
+}
+
+}
+
+#endif
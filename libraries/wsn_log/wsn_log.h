@@ -0,0 +1,164 @@
+/**
+ * @file wsn_log.h
+ * @brief Binary logging for the firmware. A log call stores an event ID and its raw arguments, COBS framed,
+ *        in a RAM buffer instead of formatting text, and the loop hands the buffer to the serial port only
+ *        as fast as the port takes it without blocking. network_manager/src/log_decoder.py turns the records
+ *        back into text. The firmware owns the buffer and its event IDs and wraps the log calls in level
+ *        macros that expand to nothing above the LOG_LEVEL it is built with
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef WSN_LOG_H
+#define WSN_LOG_H
+
+#include <stdint.h>
+
+// Log levels, a build keeps the calls of its LOG_LEVEL and below
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// Largest event ID plus arguments of a record
+#define WSN_LOG_MAX_RECORD 12
+
+namespace wsn {
+
+// Event ID of the record telling how many records the full buffer dropped, firmware events start at 1
+const uint8_t LOG_DROPPED = 0;
+
+/**
+ * @brief Size of the arguments of a record
+ *
+ */
+template <typename... Args>
+struct LogArgsSize {
+  static constexpr uint8_t value = 0;
+};
+
+template <typename T, typename... Rest>
+struct LogArgsSize<T, Rest...> {
+  static constexpr uint8_t value = sizeof(T) + LogArgsSize<Rest...>::value;
+};
+
+inline void logPut(uint8_t *, uint8_t &) {}
+
+/**
+ * @brief Stores the arguments of a record as they are in memory, little endian on every supported board
+ *
+ */
+template <typename T, typename... Rest>
+inline void logPut(uint8_t *rec, uint8_t &n, T v, Rest... rest) {
+  const uint8_t *b = (const uint8_t *)&v;
+  for (uint8_t i = 0; i < sizeof(T); i++)
+    rec[n++] = b[i];
+  logPut(rec, n, rest...);
+}
+
+/**
+ * @brief Buffer of N bytes of framed log records. A record that does not fit is dropped and counted, the
+ *        count is logged as a LOG_DROPPED record once there is room again
+ *
+ */
+template <uint8_t N>
+struct LogBuffer {
+  uint8_t buf[N];
+  uint8_t head;
+  uint8_t used;
+  uint16_t dropped;
+
+  /**
+   * @brief Adds a record. Arguments are written with their own size, so pass fixed width types
+   *
+   */
+  template <typename... Args>
+  void log(uint8_t event, Args... args) {
+    static_assert(1 + LogArgsSize<Args...>::value <= WSN_LOG_MAX_RECORD, "too many log arguments");
+    uint8_t rec[WSN_LOG_MAX_RECORD];
+    uint8_t n = 0;
+    rec[n++] = event;
+    logPut(rec, n, args...);
+
+    if (dropped > 0) {
+      uint8_t d[3] = {LOG_DROPPED, (uint8_t)dropped, (uint8_t)(dropped >> 8)};
+      if (push(d, 3))
+        dropped = 0;
+    }
+    if (dropped > 0 || !push(rec, n)) {
+      if (dropped < 0xFFFF)
+        dropped ++;
+    }
+  }
+
+  /**
+   * @brief Writes a record COBS encoded and followed by a zero byte, if the n + 2 bytes fit
+   *
+   */
+  bool push(const uint8_t *rec, uint8_t n) {
+    if (used + n + 2 > N)
+      return false;
+    uint8_t code = used;
+    uint8_t pos = used + 1;
+    for (uint8_t i = 0; i < n; i++) {
+      if (rec[i] == 0) {
+        at(code) = pos - code;
+        code = pos++;
+      } else {
+        at(pos++) = rec[i];
+      }
+    }
+    at(code) = pos - code;
+    at(pos++) = 0;
+    used = pos;
+    return true;
+  }
+
+  uint8_t &at(uint8_t i) {
+    return buf[(head + i) % N];
+  }
+
+  /**
+   * @brief Writes to out as many buffered bytes as fit in its transmit buffer, without blocking
+   *
+   */
+  template <class Out>
+  void drain(Out &out) {
+    int room = out.availableForWrite();
+    while (used > 0 && room > 0) {
+      uint8_t n = used;
+      if (n > N - head)
+        n = N - head;
+      if (n > room)
+        n = room;
+      out.write(buf + head, n);
+      head = (head + n) % N;
+      used -= n;
+      room -= n;
+    }
+  }
+
+  /**
+   * @brief Writes every buffered byte to out, blocking until they are in its transmit buffer
+   *
+   */
+  template <class Out>
+  void flush(Out &out) {
+    while (used > 0) {
+      uint8_t n = used;
+      if (n > N - head)
+        n = N - head;
+      out.write(buf + head, n);
+      head = (head + n) % N;
+      used -= n;
+    }
+  }
+};
+
+}
+
+#endif
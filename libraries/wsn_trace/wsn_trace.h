@@ -0,0 +1,109 @@
+/**
+ * @file wsn_trace.h
+ * @brief Latency tracing shared by the node and gateway firmware. A trace point measures the time spent in
+ *        the rest of the enclosing block with micros() and keeps it, with the ID of the stage, in a fixed
+ *        ring in RAM that is dumped on request. The firmware owns the ring and wraps the trace points in a
+ *        macro that expands to nothing when tracing is disabled, so release builds pay nothing
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef WSN_TRACE_H
+#define WSN_TRACE_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+// Unique name of the trace point variable on each line
+#define WSN_TRACE_NAME_(line) wsnTrace##line
+#define WSN_TRACE_NAME(line) WSN_TRACE_NAME_(line)
+
+namespace wsn {
+
+/**
+ * @brief Traced stages, the IDs are shared by both firmwares and by network_manager/src/trace_histogram.py
+ *
+ */
+enum TraceStage : uint8_t {
+  TRACE_RX_READ = 1,      // reading a frame out of the radio FIFO
+  TRACE_DECRYPT = 2,      // decrypting the first block of a frame
+  TRACE_HANDLE = 3,       // handling a received frame, decryption and ack included
+  TRACE_ACK = 4,          // building and encrypting an ack
+  TRACE_TX = 5,           // sending a frame, until the radio is back in receive mode
+  TRACE_DL_PARSE = 6,     // gateway: parsing and queueing a downlink command from the server
+  TRACE_RECORD = 7,       // gateway: formatting a record for the server and queueing it
+  TRACE_SERIAL = 8,       // gateway: writing a record to the serial port
+  TRACE_STATUS = 9,       // node: building and sending a status update
+  TRACE_SENSOR = 10       // node: building and sending a sensor message
+};
+
+/**
+ * @brief One measurement: the stage and its duration in microseconds
+ *
+ */
+struct TraceEntry {
+  uint8_t stage;
+  uint32_t duration;
+};
+
+/**
+ * @brief Ring of the last N measurements, the oldest one is overwritten when it is full. Measurements can be
+ *        added from the radio interrupt, on AVR interrupts are held off while an entry is written
+ *
+ */
+template <uint8_t N>
+struct TraceRing {
+  TraceEntry entries[N];
+  uint8_t next;
+  uint8_t count;
+
+  void add(uint8_t stage, uint32_t duration) {
+    #if defined(__AVR__)
+      uint8_t sreg = SREG;
+      cli();
+    #endif
+    entries[next].stage = stage;
+    entries[next].duration = duration;
+    next = (next + 1) % N;
+    if (count < N)
+      count ++;
+    #if defined(__AVR__)
+      SREG = sreg;
+    #endif
+  }
+
+  /**
+   * @brief Returns measurement i, oldest first
+   *
+   */
+  const TraceEntry &at(uint8_t i) const {
+    return entries[(next + N - count + i) % N];
+  }
+
+  void clear() {
+    count = 0;
+  }
+};
+
+/**
+ * @brief Trace point: adds the time between its construction and the end of the enclosing block to the ring
+ *
+ */
+template <uint8_t N>
+struct TraceScope {
+  TraceRing<N> &ring;
+  uint8_t stage;
+  unsigned long start;
+
+  TraceScope(TraceRing<N> &r, uint8_t s) : ring(r), stage(s), start(micros()) {}
+  ~TraceScope() {
+    ring.add(stage, micros() - start);
+  }
+};
+
+}
+
+#endif
@@ -0,0 +1,94 @@
+## @package log_decoder
+#  Decoder of the binary log of the node firmware
+#
+#  The node writes its log as COBS framed records terminated by a zero byte: an event ID followed by the raw
+#  little endian arguments of the event (see libraries/wsn_log/wsn_log.h). This script reads the records
+#  from the serial port of the node, or from a capture of it, and prints them as text, with the time they
+#  were read. Trace dumps are printed as "trace <stage> <microseconds>" lines for trace_histogram.py
+#
+#  usage: python log_decoder.py <serial port or capture file> [baud rate]
+
+import struct
+import sys
+from datetime import datetime
+import serial_protocol
+
+LEVELS = {1: 'ERROR', 2: 'WARN', 3: 'INFO', 4: 'DEBUG'}
+
+## Events of the node, the IDs follow LogEvent in node/comms_protocol.h: level, argument layout and text
+EVENTS = {
+	0: (2, '<H', '{} log records dropped, buffer full'),
+	1: (3, '', 'Node startup complete'),
+	2: (1, '', 'LoRa init failed'),
+	3: (4, '<B', 'motion detected on sensor {}'),
+	4: (4, '<B', 'add ack to queue: {}'),
+	5: (4, '<B', 'add status to queue: {}'),
+	6: (3, '<BB', 'Set actuator: {} with value: {}'),
+	7: (4, '<BB', 'add sensor msg {} to queue, VBAT {:.1f} V'),
+	8: (4, '<BB', 'add batch to queue: msg {}, {} readings'),
+	9: (2, '<B', 'Failed to send msg with id: {}'),
+	10: (4, '<Bc', 'send msg: {} ({})'),
+	11: (4, '<B', 'Message with ID: {} delivered!'),
+	12: (4, '<BBB', 'frame received: network {:#04x}, node {:#04x}, {} bytes'),
+	13: (4, '<cBhf', 'msg {} with id {} for this node, RSSI {} dBm, SNR {:.2f} dB'),
+	14: (3, '<BI', 'trace {} {}'),
+	15: (3, '', 'trace end'),
+	16: (4, '<BB', 'forward frame of node {} to the gateway, hop {}'),
+	17: (4, '<B', 'forward downlink to node {}'),
+	18: (4, '<B', 'stop forwarding node {}, the gateway hears it another way'),
+	19: (2, '<B', 'no route to node {}'),
+	20: (4, '<iB', 'synced to beacon: offset {} ms, {} slots'),
+	21: (2, '', 'no beacon heard, sending outside the slots'),
+	22: (2, '<B', 'gateway not heard, trying modem profile {}'),
+}
+
+## Function that converts a record into its level and text, returns None if the record is not known
+def decode_record(record):
+	if not record or record[0] not in EVENTS:
+		return None
+	level, layout, text = EVENTS[record[0]]
+	if len(record) - 1 != struct.calcsize(layout):
+		return None
+	args = list(struct.unpack(layout, record[1:])) if layout else []
+	args = [a.decode('ascii', 'replace') if isinstance(a, bytes) else a for a in args]
+	# VBAT is sent in tenths of a volt
+	if record[0] == 7:
+		args[1] /= 10
+	return LEVELS[level], text.format(*args)
+
+## Function that reads the records of a byte stream and prints them until read returns None, serial port
+#  timeouts return no bytes and are waited out
+def decode_stream(read):
+	frame = bytearray()
+	while True:
+		data = read()
+		if data is None:
+			return
+		for b in data:
+			if b != 0:
+				frame.append(b)
+				continue
+			record = serial_protocol.cobs_decode(bytes(frame))
+			frame = bytearray()
+			msg = decode_record(record)
+			if msg is None:
+				print(datetime.now(), 'corrupted record')
+			else:
+				print(datetime.now(), '%-5s' % msg[0], msg[1], flush=True)
+
+def main():
+	if len(sys.argv) < 2:
+		print('usage: python log_decoder.py <serial port or capture file> [baud rate]')
+		return 1
+	path = sys.argv[1]
+	if path.startswith('/dev/') or path.upper().startswith('COM'):
+		import serial
+		ser = serial.Serial(path, int(sys.argv[2]) if len(sys.argv) > 2 else 115200, timeout=1)
+		decode_stream(lambda: ser.read(ser.in_waiting or 1))
+	else:
+		with open(path, 'rb') as f:
+			decode_stream(lambda: f.read(4096) or None)
+	return 0
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -17,24 +17,50 @@ from datetime import datetime
 import numpy as np
 import matplotlib.pyplot as plt
 from matplotlib.backends.backend_tkagg import FigureCanvasTkAgg
+from matplotlib.ticker import MaxNLocator
 plt.rcParams.update({'font.size': 6})
 import yaml
 import csv
 import time
+import serial_protocol
+import timeseries_log
+from collections import deque
+import os
 
 
 # Global variables declaration.
 maxNum = 5
 gateway_status = "Offline"
 
+# Copies of an uplink heard by several gateways arrive within MERGE_WINDOW seconds of each other and the one
+# with the best RSSI is kept. Copies arriving up to DEDUP_WINDOW seconds later are dropped. Downlinks go
+# through the gateway that heard the node best in the last ROUTE_TIMEOUT seconds
+MERGE_WINDOW = 0.5
+DEDUP_WINDOW = 60
+ROUTE_TIMEOUT = 600
+merge_lock = threading.Lock()
+pending = dict()
+merged = dict()
+links = dict()
+
+# Number of RSSI and SNR values kept in memory per node for the plots, with the number of the packet they came
+# with, the whole capture is in the log. At most PLOT_POINTS of them are drawn and the plots are redrawn at most every PLOT_INTERVAL seconds
+HISTORY_SIZE = 500
+PLOT_POINTS = 100
+PLOT_INTERVAL = 0.5
+
+# Events the serial and merge threads send to the GUI thread, which alone may change the elements of the window
+GATEWAY_EVENT = '_GATEWAYEVENT_'
+NODE_EVENT = '_NODEEVENT_'
+window = None
+
 _VARS = {'rssi_canvas': None,
          'snr_canvas': None,
-		 'dl_msgs': {
-			'timestamps': list(),
-			'nodeID': list(),
-			'msgID': list(),
-			'delay': list(),
-		 }}
+		 'rssi_line': None,
+		 'snr_line': None,
+		 'plot_idx': -1,
+		 'plot_time': 0,
+		 'log': None}
 
 
 ## Function that runs a test on the network
@@ -63,6 +89,12 @@ def idxFromID(id):
 	return idx
 	
 
+## Function that hands an update of the GUI to the GUI thread. Updates sent before the window exists are
+#  dropped, the node data they follow is shown when the node is selected
+def post_gui_event(key, value):
+	if window is not None:
+		window.write_event_value(key, value)
+
 ## Function that draws a plot onto a figure
 def draw_figure(canvas, figure):
 	figure_canvas_agg = FigureCanvasTkAgg(figure, canvas)
@@ -70,23 +102,76 @@ def draw_figure(canvas, figure):
 	figure_canvas_agg.get_tk_widget().pack(side='top', fill='both', expand=1)
 	return figure_canvas_agg
 
-## Function that sends a downlink message to the gateway through the serial connection
-def send_dl_msg(data):
+## Function that creates a plot with a single line onto a canvas. The line is then updated in place by update_plots
+def make_plot(num, canvas, ylim):
+	figure = plt.figure(num=num)
+	line, = plt.plot([], [], 'bo-', linewidth=0.5, markersize=3)
+	plt.ylim(*ylim)
+	plt.gca().xaxis.set_major_locator(MaxNLocator(integer=True))
+	return draw_figure(canvas, figure), line
+
+## Function that shows the last values of a node on the RSSI and SNR plots, against the number of the packet
+#  they came with. Long histories are decimated to PLOT_POINTS values, always keeping the newest one
+def update_plots(idx):
+	# The serial threads append to the history, copy it at once
+	history = np.array(nodes[idx]['link_history'].copy(), dtype=float).reshape(-1, 3)
+	x = history[:, 0]
+	step = max(1, -(-len(x) // PLOT_POINTS))
+	keep = slice((len(x) - 1) % step, None, step)
+	for col, key in ((1, 'rssi'), (2, 'snr')):
+		line = _VARS[key + '_line']
+		line.set_data(x[keep], history[keep, col])
+		if len(x):
+			line.axes.set_xlim(x[0] - 1, x[-1] + 1)
+		_VARS[key + '_canvas'].draw_idle()
+
+## Function that sends a downlink message to a gateway through its serial connection
+def write_dl_msg(gw, data):
+	ser = gw['ser']
+	if gw['binary']:
+		ser.write(serial_protocol.encode_dl_msg(data))
+		ser.flush()
+		return
 	data = bytes(data, encoding='utf-8')
 	ser.write(data)
 	ser.write(bytes("\n", encoding='utf-8'))
 	ser.flush()
 
-## Function to export the gathered data onto a .csv file
+## Function that sends a downlink message. Messages for one node go through the gateway that heard it best,
+#  broadcasts and modem changes go through every gateway
+def send_dl_msg(data):
+	fields = data.strip().split(',')
+	targets = gateways
+	if fields[0] in ('s', 'c') and len(fields) > 1 and fields[1].lstrip('-').isdigit() and int(fields[1]) != -1:
+		targets = [best_gateway(int(fields[1]))]
+	for gw in targets:
+		write_dl_msg(gw, data)
+
+## Function that returns the gateway with the best RSSI from a node in the last ROUTE_TIMEOUT seconds, or the
+#  one that heard it last if none did
+def best_gateway(nID):
+	now = time.time()
+	best = None
+	last = None
+	with merge_lock:
+		heard = dict(links.get(nID, {}))
+	for i, (rssi, t) in heard.items():
+		if now - t < ROUTE_TIMEOUT and (best is None or rssi > best[0]):
+			best = (rssi, i)
+		if last is None or t > last[0]:
+			last = (t, i)
+	if best is not None:
+		return gateways[best[1]]
+	if last is not None:
+		return gateways[last[1]]
+	return gateways[0]
+
+## Function to export the gathered data onto a .csv file, streamed from the on-disk log
 def export_data(path):
 	#print(path)
 	with open(path, 'w', newline='') as csvfile:
 		writer = csv.writer(csvfile, delimiter=',', quotechar='|', quoting=csv.QUOTE_MINIMAL)
-		for node in nodes:
-			for i in range(len(node['timestamps'])):
-				writer.writerow([node['timestamps'][i], node['delay_list'][i], node['msgID_list'][i], node['id'], node['rssi_list'][i], node['snr_list'][i], node['battery_list'][i], '0'])
-		for i in range(len(_VARS['dl_msgs']['timestamps'])):
-			writer.writerow([_VARS['dl_msgs']['timestamps'][i], _VARS['dl_msgs']['delay'][i], _VARS['dl_msgs']['msgID'][i], _VARS['dl_msgs']['nodeID'][i], 0, 0, 0, '1'])
+		_VARS['log'].export_csv(writer)
 	print('Data exported!')
 	#timestamp, nodeID, rssi, snr, battery, DL/UL
 	#if DL we only care about timestamp and nodeID
@@ -147,6 +232,10 @@ def gui():
 			sg.Text('Packets sent:', background_color='white', text_color='black'),
 			sg.Text('0', key='_PACKETSSENT_', background_color='white', text_color='black')
 		],
+		[
+			sg.Text('Duplicates:', background_color='white', text_color='black'),
+			sg.Text('0', key='_DUPLICATES_', background_color='white', text_color='black')
+		],
 		#[
 		#	sg.Text('Packets received:', background_color='white', text_color='black'),
 		#	sg.Text('0', key='_PACKETSRECEIVED_', background_color='white', text_color='black')
@@ -163,6 +252,10 @@ def gui():
 			sg.Text('Battery Level (V):', background_color='white', text_color='black'),
 			sg.Text('', key='_BAT_', background_color='white', text_color='black')
 		],
+		[
+			sg.Text('Link (gateway):', background_color='white', text_color='black'),
+			sg.Text('', key='_LINK_', background_color='white', text_color='black')
+		],
 		[
 			sg.Column(layout = [
 				[
@@ -216,45 +309,48 @@ def gui():
 	global window
 	window = sg.Window('Sensor Network Manager', layout, finalize=True)
 	
-	for i in range(len(nodes)):
-		plt.figure(num=0)
-		plt.plot([],[],'.k')
-		#nodes[i]['rssi_plot_canvas'] = FigureCanvasTkAgg(plt.figure(num=0), window.Element('rssi_canvas').TKCanvas)
-		_VARS['rssi_canvas'] = FigureCanvasTkAgg(plt.figure(num=0), window.Element('rssi_canvas').TKCanvas)
-		#nodes[i]['rssi_plot_canvas'].get_tk_widget().hide()
-		nodes[i]['rssi_list'] = list()
-		plt.figure(num=1)
-		plt.plot([],[],'.k')
-		#nodes[i]['snr_plot_canvas'] = FigureCanvasTkAgg(plt.figure(num=1), window.Element('snr_canvas').TKCanvas)
-		_VARS['snr_canvas'] = FigureCanvasTkAgg(plt.figure(num=1), window.Element('snr_canvas').TKCanvas)
-		nodes[i]['snr_list'] = list()
-
-		nodes[i]['timestamps'] = list()
-		nodes[i]['battery_list'] = list()
-		nodes[i]['msgID_list'] = list()
-		nodes[i]['delay_list'] = list()
+	_VARS['rssi_canvas'], _VARS['rssi_line'] = make_plot(0, window.Element('rssi_canvas').TKCanvas, (-120, 20))
+	_VARS['snr_canvas'], _VARS['snr_line'] = make_plot(1, window.Element('snr_canvas').TKCanvas, (-15, 15))
 
 	while True:
 		event, values = window.read(timeout = 200)
 		if event == sg.WIN_CLOSED or event == 'Exit': 
 			break
+		# Redraw the plots of the node last shown, at most every PLOT_INTERVAL seconds
+		if _VARS['plot_idx'] >= 0 and time.time() - _VARS['plot_time'] >= PLOT_INTERVAL:
+			update_plots(_VARS['plot_idx'])
+			_VARS['plot_idx'] = -1
+			_VARS['plot_time'] = time.time()
 		if event == '_TEST_':
 			global nt_thread
 			nt_thread.start()
 		if event == 'export_data_path':
 			path = values['export_data_path']
-			export_data(path)
+			# Runs aside so long captures do not stall the GUI
+			threading.Thread(target=export_data, args=(path,)).start()
 		if event == 'Send' and len(values['_DLMSG_']):
 			data = values['_DLMSG_']
 			send_dl_msg(data)
 			window.Element('_DLMSG_').update(value="")
     		
+		if event == GATEWAY_EVENT:
+			status, boot_time = values[event]
+			window.Element('_GATEWAYSTATUS_').update(value=status, text_color='#42cf68')
+			window.Element('_BOOTTIME_').update(value=boot_time)
+		if event == NODE_EVENT:
+			idx, select = values[event]
+			active_nodes = sum(node["state"] == 1 for node in nodes)
+			window.Element('_ACTIVENODES_').update(value=str(active_nodes))
+			if select:
+				window.Element('_LIST_').update(set_to_index=idx)
+				setTabTitles(idx)
+			if idx in window.Element('_LIST_').get_indexes():
+				updateTabs(idx)
 		if event == '_LIST_' and len(values['_LIST_']): 
 			r = parse("[\'Node {}\']", str(values['_LIST_']))
 			idx = int(r[0])
 			idx = idxFromID(idx)
-			window.Element('_STATUSTAB_').update(title='Node ' + str(nodes[idx]['id']) + ' Status')
-			window.Element('_STATSTAB_').update(title='Node ' + str(nodes[idx]['id']) + ' Stats')
+			setTabTitles(idx)
 			updateTabs(idx)
 		if event == '_RSNET_':
 			active_nodes = 0
@@ -287,11 +383,19 @@ def gui():
 		
 		window.refresh()
 
-	window.close()
+	# The serial threads run until main stops them, their updates must not reach the closed window
+	closed = window
+	window = None
+	closed.close()
 
 firstTime = True
 
-## Function that updates the GUI
+## Function that names the tabs after the node shown, runs on the GUI thread
+def setTabTitles(idx):
+	window.Element('_STATUSTAB_').update(title='Node ' + str(nodes[idx]['id']) + ' Status')
+	window.Element('_STATSTAB_').update(title='Node ' + str(nodes[idx]['id']) + ' Stats')
+
+## Function that updates the GUI, runs on the GUI thread
 def updateTabs(idx):
 	global nodes
 	global window
@@ -303,32 +407,14 @@ def updateTabs(idx):
 	window.Element('_PACKETSSENT_').update(value=str(nodes[idx]['packets_sent']))
 	#window.Element('_PACKETSRECEIVED_').update(value=str(nodes[idx]['packets_received']))
 	window.Element('_PACKETSSENT_').update(value=str(nodes[idx]['packets_sent']))
+	window.Element('_DUPLICATES_').update(value=str(nodes[idx]['duplicates']))
 	window.Element('_AVGRSSI_').update(value=str(nodes[idx]['avg_rssi']))
 	window.Element('_AVGSNR_').update(value=str(nodes[idx]['avg_snr']))
 	window.Element('_BAT_').update(value=str(nodes[idx]['battery']))
+	window.Element('_LINK_').update(value=nodes[idx]['link'])
 
-	# \\  -------- PYPLOT -------- //
-	if(len(nodes[idx]['rssi_list'])>0):
-		#nodes[idx]['rssi_plot_canvas'].get_tk_widget().forget()
-		_VARS['rssi_canvas'].get_tk_widget().forget()
-		plt.figure(num=0)
-		plt.clf()
-		plt.plot(range(1,len(nodes[idx]['rssi_list'])+1), nodes[idx]['rssi_list'], 'bo-', linewidth=0.5, markersize=3)
-		plt.xticks(np.arange(1, len(nodes[idx]['rssi_list'])+1))
-		plt.ylim(-120, 20)
-		#nodes[idx]['rssi_plot_canvas'] = draw_figure(window.Element('rssi_canvas').TKCanvas, plt.figure(num=0))
-		_VARS['rssi_canvas'] = draw_figure(window.Element('rssi_canvas').TKCanvas, plt.figure(num=0))
-
-		#nodes[idx]['snr_plot_canvas'].get_tk_widget().forget()
-		_VARS['snr_canvas'].get_tk_widget().forget()
-		plt.figure(num=1)
-		plt.clf()
-		plt.plot(range(1,len(nodes[idx]['snr_list'])+1), nodes[idx]['snr_list'], 'bo-', linewidth=0.5, markersize=3)
-		plt.xticks(np.arange(1, len(nodes[idx]['snr_list'])+1))
-		plt.ylim(-15, 15)
-		#nodes[idx]['snr_plot_canvas'] = draw_figure(window.Element('snr_canvas').TKCanvas, plt.figure(num=1))
-		_VARS['snr_canvas'] = draw_figure(window.Element('snr_canvas').TKCanvas, plt.figure(num=1))
-	# \\  -------- PYPLOT -------- //
+	# The plots are redrawn by the GUI loop
+	_VARS['plot_idx'] = idx
 
 	for i in range(maxNum):
 		if i < len(nodes[idx]['sensors']):
@@ -355,98 +441,189 @@ def updateTabs(idx):
 	window.Element('_ACTUATORSPANE_').contents_changed()
 
 
-## Function that handles the received messages from the gateway through the serial communication
-def serial_comm():
+## Function that handles the received messages from one gateway through the serial communication
+def serial_comm(gw):
+	ser = gw['ser']
 	while  True:
 		global stop_threads
 		if stop_threads:
 			break
-		global nodes
-		global window
 
-		line = ser.readline()
-		line = line.decode('utf-8', "ignore")
-		if(len(line) > 4):
+		if gw['binary']:
+			msg = serial_protocol.read_msg(ser)
+			if msg is None:
+				continue
+		else:
+			line = ser.readline()
+			line = line.decode('utf-8', "ignore")
+			if(len(line) <= 4):
+				continue
 			line = line.strip('rm').strip('\n').rstrip()
-			if line == "Startup complete":
-				window.Element('_GATEWAYSTATUS_').update(value=line, text_color='#42cf68')
-				window.Element('_BOOTTIME_').update(value=datetime.now().strftime("%d/%m/%Y %H:%M:%S"))
+			try:
+				msg = json.loads(line)
+			except:
+				msg = {'f': 't', 'text': line}
+
+		if msg['f'] == 't':
+			if msg['text'] == "Startup complete":
+				gw['state'] = 1
+				started = sum(g['state'] == 1 for g in gateways)
+				post_gui_event(GATEWAY_EVENT, (msg['text'] + ' (' + str(started) + '/' + str(len(gateways)) + ')', datetime.now().strftime("%d/%m/%Y %H:%M:%S")))
 			else:
-				try:
-					print(datetime.now(), line)
-					msg = json.loads(line)
-
-					if(msg['f'] == 'd'):
-						_VARS['dl_msgs']['nodeID'].append(msg['nID'])
-						_VARS['dl_msgs']['timestamps'].append(datetime.now())
-						_VARS['dl_msgs']['msgID'].append(msg['msgID'])
-						_VARS['dl_msgs']['delay'].append(msg['t'])
-					else:
-						nidx = idxFromID(int(msg['nID']))
-						now = datetime.now()
-						dt_string = now.strftime("%d/%m/%Y %H:%M:%S")
-
-						if(int(msg['RSSI']) != 0):
-							nodes[idxFromID(int(msg['nID']))]['packets_sent'] += 1	
-							t_packets = nodes[idxFromID(int(msg['nID']))]['packets_sent'] + nodes[idxFromID(int(msg['nID']))]['packets_received']
-							avg_rssi = float(nodes[idxFromID(int(msg['nID']))]['avg_rssi']) * float(t_packets-1)/t_packets + float(msg['RSSI']) * float(1/t_packets)
-							avg_snr = nodes[idxFromID(int(msg['nID']))]['avg_snr'] * float(t_packets-1)/t_packets + float(msg['SNR']) * float(1/t_packets)
-							bat = float(msg['VBAT'])
-							
-							nodes[idxFromID(int(msg['nID']))]['avg_rssi'] = round(avg_rssi, 2)
-							nodes[idxFromID(int(msg['nID']))]['avg_snr'] = round(avg_snr, 2)
-							nodes[idxFromID(int(msg['nID']))]['battery'] = round(bat, 1)
-
-							for node in nodes:
-								if int(node['id']) == int(msg['nID']):
-									node['rssi_list'] += [float(msg['RSSI'])]
-									node['snr_list'] += [float(msg['SNR'])]
-									node['battery_list'] += [float(msg['VBAT'])]
-									node['timestamps'] += [datetime.now()]
-									node['msgID_list'] += [int(msg['msgID'])]
-									node['delay_list'] += [msg['t']]
-
-						if((int(msg['nID']) != 255) and (msg['f'] == 's')):
-							nodes[idxFromID(int(msg['nID']))]['state'] = int(msg['state'])
-
-							active_nodes = sum(node["state"] == 1 for node in nodes)
-							window.Element('_ACTIVENODES_').update(value=str(active_nodes))
-							nodes[nidx]['last_activity'] = 'state update' + ' at ' + dt_string
-							if(nidx == window.Element('_LIST_').get_indexes()[0]):
-								updateTabs(nidx)
-
-						if((int(msg['nID']) != 255) and (msg['f'] == 'u')):
-							nodes[nidx]['last_activity'] = str(nodes[nidx]['sensors'][int(msg['sID'])-1]['name']) + ' with value: ' + msg['sVal'] + ' at ' + dt_string
-							window.Element('_LIST_').update(set_to_index=nidx)
-							window.Element('_STATUSTAB_').update(title='Node ' + msg['nID'] + ' Status')
-							window.Element('_STATSTAB_').update(title='Node ' + msg['nID'] + ' Info')
-
-							
-							nodes[nidx]['sensors'][int(msg['sID'])-1]['last_activity'] = dt_string
-							nodes[nidx]['sensors'][int(msg['sID'])-1]['state'] = msg['sVal']
-
-							nodes[idxFromID(int(msg['nID']))]['state'] = 1
-							active_nodes = sum(node["state"] == 1 for node in nodes)
-							window.Element('_ACTIVENODES_').update(value=str(active_nodes))
-							updateTabs(nidx)
-						if((int(msg['nID']) != 255) and (msg['f'] == 'a')):
-							nodes[nidx]['last_activity'] = str(nodes[nidx]['actuators'][int(msg['actID'])-1]['name']) + ' with value: ' + msg['actVal'] + ' at ' + dt_string
-							window.Element('_LIST_').update(set_to_index=nidx)
-							window.Element('_STATUSTAB_').update(title='Node ' + msg['nID'] + ' Status')
-							window.Element('_STATSTAB_').update(title='Node ' + msg['nID'] + ' Info')
-							nodes[nidx]['actuators'][int(msg['actID'])-1]['last_activity'] = dt_string
-							nodes[nidx]['actuators'][int(msg['actID'])-1]['state'] = msg['actVal']
-							nodes[idxFromID(int(msg['nID']))]['state'] = 1
-							active_nodes = sum(node["state"] == 1 for node in nodes)
-							window.Element('_ACTIVENODES_').update(value=str(active_nodes))
-							if(nidx == window.Element('_LIST_').get_indexes()[0]):
-								updateTabs(nidx)
-					
-				except:
-					continue
-					#print("ERROR reading from serial!!")
-
-sc_thread = threading.Thread(target=serial_comm)
+				print(datetime.now(), 'gateway ' + str(gw['index']) + ': ' + msg['text'])
+			continue
+
+		if msg['f'] == 'l':
+			update_link(gw, msg)
+			continue
+
+		if msg['f'] == 'n':
+			scan_report(gw, msg)
+			continue
+
+		merge_msg(gw, msg)
+
+## Function that takes in the link summary of a node sent by a gateway. Every summary updates the routing of
+#  the downlinks, the ones of the gateway that hears the node best are shown for the node
+def update_link(gw, msg):
+	try:
+		nID = int(msg['nID'])
+		nidx = idxFromID(nID)
+		rssi = [float(v) for v in msg['RSSI'].split(',')]
+		snr = [float(v) for v in msg['SNR'].split(',')]
+	except:
+		return
+	print(datetime.now(), msg)
+	with merge_lock:
+		links.setdefault(nID, dict())[gw['index']] = (rssi[0], time.time())
+	if nidx < 0 or best_gateway(nID) is not gw:
+		return
+
+	nodes[nidx]['link'] = 'RSSI %.1f dBm (%d to %d), SNR %.2f dB (%.2f to %.2f), PER %s %%' % (*rssi, *snr, msg['PER'])
+	nodes[nidx]['battery'] = float(msg['VBAT'])
+	# Without link information in every packet, the averages come from the gateway
+	if not nodes[nidx]['link_history']:
+		nodes[nidx]['avg_rssi'] = rssi[0]
+		nodes[nidx]['avg_snr'] = snr[0]
+	post_gui_event(NODE_EVENT, (nidx, False))
+
+## Function that takes in the report a gateway sends when the response window of a network scan closes. The
+#  status replies themselves arrive as ordinary status messages
+def scan_report(gw, msg):
+	try:
+		print(datetime.now(), 'gateway %d: Scan complete: %s of %s nodes answered in %.1f s' % (gw['index'], msg['n'], msg['of'], int(msg['ms']) / 1000))
+	except:
+		return
+
+## Function that merges the copies of an uplink heard by several gateways. Records the link from the node to
+#  the gateway and holds the first copy for MERGE_WINDOW seconds, keeping the copy with the best RSSI
+def merge_msg(gw, msg):
+	try:
+		# Gateways that only send link summaries leave the RSSI out, the first copy is then kept
+		rssi = int(msg['RSSI']) if 'RSSI' in msg else None
+		key = (msg['f'], int(msg['nID']), int(msg['msgID']))
+	except:
+		return
+	# Records made by the gateway itself (downlink status, failed requests) are not heard over the air
+	if msg['f'] not in ('u', 's', 'a') or rssi == 0 or len(gateways) == 1:
+		if rssi:
+			with merge_lock:
+				links.setdefault(key[1], dict())[gw['index']] = (rssi, time.time())
+		process_msg(msg)
+		return
+
+	now = time.time()
+	with merge_lock:
+		if rssi is not None:
+			links.setdefault(key[1], dict())[gw['index']] = (rssi, now)
+		if key in merged:
+			return
+		if key in pending:
+			if rssi is not None and rssi > int(pending[key]['msg'].get('RSSI', rssi)):
+				pending[key]['msg'] = msg
+			return
+		pending[key] = {'msg': msg, 'time': now}
+
+## Function that hands the merged uplinks on once their MERGE_WINDOW has passed and forgets the ones older
+#  than DEDUP_WINDOW
+def merge_comm():
+	while True:
+		global stop_threads
+		if stop_threads:
+			break
+		now = time.time()
+		ready = list()
+		with merge_lock:
+			for key in list(pending.keys()):
+				if now - pending[key]['time'] >= MERGE_WINDOW:
+					ready.append(pending.pop(key)['msg'])
+					merged[key] = now
+			for key in [k for k in merged if now - merged[k] >= DEDUP_WINDOW]:
+				del merged[key]
+		for msg in ready:
+			process_msg(msg)
+		time.sleep(MERGE_WINDOW / 5)
+
+## Function that updates the network state with a message received from the network and tells the GUI thread
+#  which node changed. Sensor and actuator messages bring their node to the front
+def process_msg(msg):
+	global nodes
+
+	try:
+		print(datetime.now(), msg)
+
+		if(msg['f'] == 'd'):
+			_VARS['log'].append_downlink(int(msg['t']), int(msg['msgID']), int(msg['nID']))
+		else:
+			nidx = idxFromID(int(msg['nID']))
+			now = datetime.now()
+			dt_string = now.strftime("%d/%m/%Y %H:%M:%S")
+
+			# Retransmissions the gateway acked again but did not relay, a sign of lost acks
+			nodes[nidx]['duplicates'] += int(msg.get('dup', 0))
+
+			# Records made by the gateway itself have an RSSI of 0, the ones of gateways that only send link
+			# summaries have none
+			if(msg.get('RSSI') == None):
+				nodes[nidx]['packets_sent'] += 1
+				_VARS['log'].append_uplink(int(msg['t']), int(msg['msgID']), int(msg['nID']), np.nan, np.nan, np.nan)
+			elif(int(msg['RSSI']) != 0):
+				nodes[idxFromID(int(msg['nID']))]['packets_sent'] += 1	
+				t_packets = nodes[idxFromID(int(msg['nID']))]['packets_sent'] + nodes[idxFromID(int(msg['nID']))]['packets_received']
+				avg_rssi = float(nodes[idxFromID(int(msg['nID']))]['avg_rssi']) * float(t_packets-1)/t_packets + float(msg['RSSI']) * float(1/t_packets)
+				avg_snr = nodes[idxFromID(int(msg['nID']))]['avg_snr'] * float(t_packets-1)/t_packets + float(msg['SNR']) * float(1/t_packets)
+				bat = float(msg['VBAT'])
+				
+				nodes[idxFromID(int(msg['nID']))]['avg_rssi'] = round(avg_rssi, 2)
+				nodes[idxFromID(int(msg['nID']))]['avg_snr'] = round(avg_snr, 2)
+				nodes[idxFromID(int(msg['nID']))]['battery'] = round(bat, 1)
+
+				nodes[nidx]['link_history'].append((nodes[nidx]['packets_sent'], float(msg['RSSI']), float(msg['SNR'])))
+				_VARS['log'].append_uplink(int(msg['t']), int(msg['msgID']), int(msg['nID']), float(msg['RSSI']), float(msg['SNR']), bat)
+
+			if((int(msg['nID']) != 255) and (msg['f'] == 's')):
+				nodes[idxFromID(int(msg['nID']))]['state'] = int(msg['state'])
+				nodes[nidx]['last_activity'] = 'state update' + ' at ' + dt_string
+				post_gui_event(NODE_EVENT, (nidx, False))
+
+			if((int(msg['nID']) != 255) and (msg['f'] == 'u')):
+				nodes[nidx]['last_activity'] = str(nodes[nidx]['sensors'][int(msg['sID'])-1]['name']) + ' with value: ' + msg['sVal'] + ' at ' + dt_string
+				nodes[nidx]['sensors'][int(msg['sID'])-1]['last_activity'] = dt_string
+				nodes[nidx]['sensors'][int(msg['sID'])-1]['state'] = msg['sVal']
+
+				nodes[idxFromID(int(msg['nID']))]['state'] = 1
+				post_gui_event(NODE_EVENT, (nidx, True))
+			if((int(msg['nID']) != 255) and (msg['f'] == 'a')):
+				nodes[nidx]['last_activity'] = str(nodes[nidx]['actuators'][int(msg['actID'])-1]['name']) + ' with value: ' + msg['actVal'] + ' at ' + dt_string
+				nodes[nidx]['actuators'][int(msg['actID'])-1]['last_activity'] = dt_string
+				nodes[nidx]['actuators'][int(msg['actID'])-1]['state'] = msg['actVal']
+				nodes[idxFromID(int(msg['nID']))]['state'] = 1
+				post_gui_event(NODE_EVENT, (nidx, True))
+		
+	except:
+		return
+		#print("ERROR reading from serial!!")
+
 nt_thread = threading.Thread(target=network_test)
 
 ## Main function
@@ -454,7 +631,7 @@ def main():
 	global active_nodes
 	active_nodes = 0
 	global total_nodes
-	global ser
+	global gateways
 	global nodes
 	global stop_threads
 	stop_threads = False
@@ -465,12 +642,22 @@ def main():
 		except yaml.YAMLError as exc:
 			print(exc)
 
-	gateways = config['wsn_config']['gateways']
-	for i in range(len(gateways)):
+	gateways = list()
+	for gw in config['wsn_config']['gateways']:
+		try:
+			ser = serial.Serial(gw['serial_port'], 9600, timeout=1)
+		except:
+			print("Serial port " + gw['serial_port'] + " not available!")
+			continue
 		gateways_data = {
-			'state': 0
+			'state': 0,
+			'index': len(gateways),
+			'binary': gw.get('protocol', 'json') == 'binary',
+			'ser': ser
 		}
-		gateways[i] = {**gateways[i], **gateways_data}
+		gateways.append({**gw, **gateways_data})
+	if not gateways:
+		return
 
 	nodes = config['wsn_config']['nodes']
 
@@ -479,15 +666,11 @@ def main():
 		'last_activity': '',
 		'packets_sent':0,
 		'packets_received':0,
+		'duplicates':0,
 		'avg_rssi': 0,
 		'avg_snr': 0,
 		'battery': 0,
-		'timestamps': list(),
-		'rssi_list': list(),
-		'snr_list': list(),
-		'battery_list': list(),
-		'msgID_list': list(),
-		'delay_list': list(),
+		'link': '',
 		'rssi_plot_canvas': None,
 		'snr_plot_canvas': None
 	}
@@ -505,25 +688,29 @@ def main():
 			nodes[i]['sensors'][j] = {**nodes[i]['sensors'][j], **sensors_data}
 		for j in range(len(nodes[i]['actuators'])):
 			nodes[i]['actuators'][j] = {**nodes[i]['actuators'][j], **actuators_data}
-		nodes[i] = {**nodes[i], **node_data}
+		nodes[i] = {**nodes[i], **node_data, 'link_history': deque(maxlen=HISTORY_SIZE)}
 
 	total_nodes = len(nodes)
 
-	try:
-		ser = serial.Serial(gateways[0]['serial_port'], 9600, timeout=1)
-	except:
-		print("Serial port not available!")
-		return
+	# Every run appends to its own log, named after its start time
+	log_dir = config['wsn_config'].get('log_dir', '../logs')
+	_VARS['log'] = timeseries_log.TimeSeriesLog(os.path.join(log_dir, datetime.now().strftime("%Y%m%d_%H%M%S")))
 
-	sc_thread.start()
+	sc_threads = [threading.Thread(target=serial_comm, args=(gw,)) for gw in gateways]
+	sc_threads.append(threading.Thread(target=merge_comm))
+	for t in sc_threads:
+		t.start()
 
 	gui()
 
 	stop_threads = True
-	sc_thread.join()
+	for t in sc_threads:
+		t.join()
 	#nt_thread.join()
 
-	ser.close()
+	for gw in gateways:
+		gw['ser'].close()
+	_VARS['log'].close()
 
 	return 0
 
@@ -0,0 +1,157 @@
+## @package serial_protocol
+#  Binary serial protocol between the gateway and the network manager
+#
+#  Used when the gateway is built with SERIAL_PROTOCOL set to SERIAL_BINARY. Every record is followed by its
+#  CRC-16/CCITT-FALSE, encoded with Consistent Overhead Byte Stuffing (COBS) and terminated by a zero byte.
+#  Decoded uplink records are returned as dictionaries with the same keys and string values as the json
+#  messages of the text protocol, so the rest of the network manager handles both the same way
+
+import struct
+
+## Layout of the fixed size uplink records: flag, t, msgID, nodeID, field A, field B, RSSI, SNR (hundredths
+#  of dB), VBAT (tenths of V), retransmissions the gateway did not relay (uplinks only)
+RECORD_FORMAT = '<cIBBBBhhBB'
+RECORD_SIZE = struct.calcsize(RECORD_FORMAT)
+
+## Layout of the sensor, status and ack records of gateways that do not send link information with every
+#  packet: flag, t, msgID, nodeID, field A, field B, retransmissions the gateway did not relay (uplinks only)
+SHORT_RECORD_FORMAT = '<cIBBBBB'
+SHORT_RECORD_SIZE = struct.calcsize(SHORT_RECORD_FORMAT)
+
+## Layout of the link summary records: flag, nodeID, frames, retransmissions, lost msgIDs, PER (%), RSSI
+#  average (tenths of dBm), minimum and maximum (dBm), SNR average, minimum and maximum (hundredths of dB),
+#  VBAT (tenths of V)
+LINK_RECORD_FORMAT = '<cBHHHBhhhhhhB'
+LINK_RECORD_SIZE = struct.calcsize(LINK_RECORD_FORMAT)
+
+## Layout of the network scan reports: flag, msgID of the scan, nodes that answered, registered nodes, length
+#  of the response window (ms)
+SCAN_RECORD_FORMAT = '<cBBBI'
+SCAN_RECORD_SIZE = struct.calcsize(SCAN_RECORD_FORMAT)
+
+## Function that computes the CRC-16/CCITT-FALSE checksum of a byte string
+def crc16(data):
+	crc = 0xFFFF
+	for b in data:
+		crc ^= b << 8
+		for _ in range(8):
+			crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+			crc &= 0xFFFF
+	return crc
+
+## Function that encodes a byte string with COBS, the result has no zero bytes
+def cobs_encode(data):
+	out = bytearray()
+	for block in data.split(b'\x00'):
+		while len(block) >= 254:
+			out += bytes([255]) + block[:254]
+			block = block[254:]
+		out += bytes([len(block) + 1]) + block
+	return bytes(out)
+
+## Function that decodes a COBS encoded frame, returns None if the frame is malformed
+def cobs_decode(data):
+	out = bytearray()
+	i = 0
+	while i < len(data):
+		code = data[i]
+		i += 1
+		if code == 0 or i + code - 1 > len(data):
+			return None
+		out += data[i:i + code - 1]
+		i += code - 1
+		if code < 255 and i < len(data):
+			out.append(0)
+	return bytes(out)
+
+## Function that builds a frame from a record: appends the CRC, encodes it and adds the delimiter
+def encode_frame(record):
+	crc = crc16(record)
+	return cobs_encode(record + struct.pack('<H', crc)) + b'\x00'
+
+## Function that checks and decodes a frame (without its delimiter), returns the record or None
+def decode_frame(frame):
+	data = cobs_decode(frame)
+	if data is None or len(data) < 3:
+		return None
+	record, crc = data[:-2], struct.unpack('<H', data[-2:])[0]
+	if crc16(record) != crc:
+		return None
+	return record
+
+## Function that converts a link summary record into a message dictionary, RSSI and SNR hold the average,
+#  minimum and maximum separated by commas
+def parse_link_record(record):
+	f, nID, n, dup, lost, per, rssi, rssiMin, rssiMax, snr, snrMin, snrMax, vbat = struct.unpack(LINK_RECORD_FORMAT, record)
+	return {'f': 'l', 'nID': str(nID), 'n': str(n), 'dup': str(dup), 'lost': str(lost), 'PER': str(per),
+		'RSSI': '%.1f,%d,%d' % (rssi / 10, rssiMin, rssiMax),
+		'SNR': '%.2f,%.2f,%.2f' % (snr / 100, snrMin / 100, snrMax / 100),
+		'VBAT': '%.1f' % (vbat / 10)}
+
+## Function that converts an uplink record into a message dictionary. Short records give messages without
+#  the RSSI, SNR and VBAT keys
+def parse_record(record):
+	flag = chr(record[0])
+	if flag == 't':
+		return {'f': 't', 'text': record[1:].decode('utf-8', 'ignore')}
+	if flag == 'l':
+		return parse_link_record(record) if len(record) == LINK_RECORD_SIZE else None
+	if flag == 'n':
+		if len(record) != SCAN_RECORD_SIZE:
+			return None
+		f, msgID, n, of, ms = struct.unpack(SCAN_RECORD_FORMAT, record)
+		return {'f': 'n', 'msgID': str(msgID), 'n': str(n), 'of': str(of), 'ms': str(ms)}
+	if len(record) == SHORT_RECORD_SIZE and flag in ('u', 's', 'a'):
+		f, t, msgID, nID, a, b, dup = struct.unpack(SHORT_RECORD_FORMAT, record)
+		rssi = None
+	elif len(record) == RECORD_SIZE:
+		f, t, msgID, nID, a, b, rssi, snr, vbat, dup = struct.unpack(RECORD_FORMAT, record)
+	else:
+		return None
+
+	msg = {'t': str(t), 'msgID': str(msgID), 'f': flag, 'nID': str(nID)}
+	if flag == 'd':
+		msg['status'] = str(a)
+		return msg
+	if flag == 'f':
+		msg['f'] = 's'
+		msg.update({'state': '0', 'RSSI': '0', 'SNR': '0', 'VBAT': '0'})
+		return msg
+	if flag == 'u':
+		msg.update({'sID': str(a), 'sVal': str(b), 'dup': str(dup)})
+	elif flag == 'a':
+		msg.update({'actID': str(a), 'actVal': str(b)})
+	elif flag == 's':
+		msg['state'] = str(a)
+	if rssi is None:
+		return msg
+	msg.update({'RSSI': str(rssi), 'SNR': '%.2f' % (snr / 100), 'VBAT': '%.1f' % (vbat / 10)})
+	return msg
+
+## Function that reads the next frame from the serial port and decodes it. Returns None on timeout or if the
+#  frame is corrupted
+def read_msg(ser):
+	frame = ser.read_until(b'\x00')
+	if not frame.endswith(b'\x00'):
+		return None
+	record = decode_frame(frame[:-1])
+	if record is None:
+		return None
+	return parse_record(record)
+
+## Function that converts a downlink command in the text protocol format ('s,nodeID', 'c,nodeID,actID,actVal',
+#  'p,codingRate,bandwidth,spreadingFactor' or 'x', the trace dump) into a binary frame
+def encode_dl_msg(data):
+	fields = data.strip().split(',')
+	values = [int(v) for v in fields[1:]]
+	if fields[0] == 's':
+		record = struct.pack('<cB', b's', values[0] & 0xFF)
+	elif fields[0] == 'c':
+		record = struct.pack('<cBBB', b'c', values[0], values[1], values[2])
+	elif fields[0] == 'p':
+		record = struct.pack('<cBIB', b'p', values[0], values[1], values[2])
+	elif fields[0] == 'x':
+		record = b'x'
+	else:
+		raise ValueError('unknown downlink message: ' + data)
+	return encode_frame(record)
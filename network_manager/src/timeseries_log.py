@@ -0,0 +1,100 @@
+## @package timeseries_log
+#  Append-only columnar log of the messages seen by the network manager
+#
+#  Every column is kept in its own file of fixed size little endian values, so the log only grows at its end,
+#  can be memory mapped by numpy and a partial row left by a crash is simply ignored. The network manager only
+#  keeps the last few values of each node in memory for the live view, the whole capture lives here and the
+#  csv export streams from it in blocks
+
+import os
+import threading
+from datetime import datetime
+import numpy as np
+
+## Columns of the log: reception time (seconds since the epoch), gateway timestamp of the message (ms), message
+#  ID, node ID, RSSI, SNR, VBAT and direction (0 for uplinks, 1 for downlinks)
+COLUMNS = [
+	('time', '<f8'),
+	('t', '<u4'),
+	('msgID', 'u1'),
+	('nID', 'u1'),
+	('rssi', '<f4'),
+	('snr', '<f4'),
+	('vbat', '<f4'),
+	('dir', 'u1'),
+]
+
+## Number of rows written to the csv file at a time by export_csv
+EXPORT_BLOCK = 4096
+
+## Rows are flushed to disk after FLUSH_ROWS appends or when the log is read
+FLUSH_ROWS = 64
+
+class TimeSeriesLog:
+	## Opens the log in directory path, creating it if needed. Rows of an existing log are kept
+	def __init__(self, path):
+		self.path = path
+		self.lock = threading.Lock()
+		os.makedirs(path, exist_ok=True)
+		self.files = [open(self._column_path(name), 'ab') for name, _ in COLUMNS]
+		self.rows = self._rows_on_disk()
+		# Drop a partial row left by an interrupted append
+		for f, (_, dtype) in zip(self.files, COLUMNS):
+			f.truncate(self.rows * np.dtype(dtype).itemsize)
+		self.unflushed = 0
+
+	def _column_path(self, name):
+		return os.path.join(self.path, name + '.bin')
+
+	## Returns the number of complete rows in the column files
+	def _rows_on_disk(self):
+		return min(os.path.getsize(self._column_path(name)) // np.dtype(dtype).itemsize for name, dtype in COLUMNS)
+
+	## Appends one row, values are given in the order of COLUMNS
+	def append(self, *values):
+		with self.lock:
+			for f, (_, dtype), v in zip(self.files, COLUMNS, values):
+				f.write(np.array(v, dtype=dtype).tobytes())
+			self.rows += 1
+			self.unflushed += 1
+			if self.unflushed >= FLUSH_ROWS:
+				self._flush()
+
+	## Appends an uplink row
+	def append_uplink(self, t, msgID, nID, rssi, snr, vbat):
+		self.append(datetime.now().timestamp(), t, msgID, nID, rssi, snr, vbat, 0)
+
+	## Appends a downlink row
+	def append_downlink(self, t, msgID, nID):
+		self.append(datetime.now().timestamp(), t, msgID, nID, 0, 0, 0, 1)
+
+	def _flush(self):
+		for f in self.files:
+			f.flush()
+		self.unflushed = 0
+
+	## Returns the columns of the rows logged so far as read-only memory maps
+	def columns(self):
+		with self.lock:
+			self._flush()
+			rows = self.rows
+		if rows == 0:
+			return {name: np.zeros(0, dtype=dtype) for name, dtype in COLUMNS}
+		return {name: np.memmap(self._column_path(name), dtype=dtype, mode='r', shape=(rows,)) for name, dtype in COLUMNS}
+
+	## Writes the rows logged so far to a csv file, EXPORT_BLOCK rows at a time, in the layout of the old
+	#  in-memory export: timestamp, delay, msgID, nodeID, RSSI, SNR, VBAT, DL/UL
+	def export_csv(self, writer):
+		cols = self.columns()
+		rows = len(cols['time'])
+		for start in range(0, rows, EXPORT_BLOCK):
+			block = {name: np.array(col[start:start + EXPORT_BLOCK]) for name, col in cols.items()}
+			for i in range(len(block['time'])):
+				writer.writerow([datetime.fromtimestamp(block['time'][i]), block['t'][i], block['msgID'][i], block['nID'][i],
+					round(float(block['rssi'][i]), 2), round(float(block['snr'][i]), 2), round(float(block['vbat'][i]), 2), block['dir'][i]])
+
+	def close(self):
+		with self.lock:
+			self._flush()
+			for f in self.files:
+				f.close()
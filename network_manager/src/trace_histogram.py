@@ -0,0 +1,88 @@
+## @package trace_histogram
+#  Per-stage latency histograms from the trace dumps of the gateway or node firmware
+#
+#  Firmware built with TRACE_ENABLED keeps its last latency measurements and prints them, one "trace <stage>
+#  <microseconds>" line each, when asked: the gateway on the 'x' downlink message, the node on an actuator
+#  command for TRACE_DUMP_ACT_ID (in its binary log, printed by log_decoder.py). The lines can be anywhere in
+#  the input, so the output of the network manager, of log_decoder.py, of a serial monitor or of the
+#  simulator can be given as is. Several dumps are added up
+#
+#  usage: python trace_histogram.py [--plot] [file ...]
+
+import re
+import sys
+import numpy as np
+
+## Stage names, the IDs follow wsn::TraceStage in libraries/wsn_trace/wsn_trace.h
+STAGES = {
+	1: 'radio read',
+	2: 'decrypt',
+	3: 'handle frame',
+	4: 'ack',
+	5: 'transmit',
+	6: 'downlink parse',
+	7: 'record format',
+	8: 'serial write',
+	9: 'status',
+	10: 'sensor message',
+}
+
+## Edges of the histogram bins, in microseconds: powers of two up to 2^25 us (about 34 s)
+BINS = [0] + [1 << i for i in range(26)]
+
+TRACE_LINE = re.compile(r'trace (\d+) (\d+)')
+
+## Function that reads the trace lines of a text stream and returns the durations of every stage
+def read_trace(f):
+	durations = dict()
+	for line in f:
+		m = TRACE_LINE.search(line)
+		if m:
+			durations.setdefault(int(m.group(1)), []).append(int(m.group(2)))
+	return {stage: np.array(d) for stage, d in durations.items()}
+
+## Function that prints the statistics and the histogram of every stage
+def print_histograms(durations):
+	for stage in sorted(durations):
+		d = durations[stage]
+		print('%s (stage %d): %d samples, mean %.0f us, p50 %.0f us, p95 %.0f us, max %d us' % (STAGES.get(stage, 'unknown'),
+			stage, len(d), d.mean(), np.percentile(d, 50), np.percentile(d, 95), d.max()))
+		counts, _ = np.histogram(d, bins=BINS)
+		width = 50 / counts.max()
+		for i, c in enumerate(counts):
+			if c:
+				print('  < %9d us %6d %s' % (BINS[i + 1], c, '#' * max(1, int(c * width))))
+		print()
+
+## Function that shows the histograms of all stages with matplotlib, on a log scale of durations
+def plot_histograms(durations):
+	import matplotlib.pyplot as plt
+	fig, axes = plt.subplots(len(durations), 1, squeeze=False, figsize=(8, 2 * len(durations)))
+	for ax, stage in zip(axes[:, 0], sorted(durations)):
+		ax.hist(np.maximum(durations[stage], 1), bins=BINS[1:])
+		ax.set_xscale('log')
+		ax.set_title(STAGES.get(stage, 'stage %d' % stage))
+	axes[-1, 0].set_xlabel('duration (us)')
+	fig.tight_layout()
+	plt.show()
+
+def main():
+	args = sys.argv[1:]
+	plot = '--plot' in args
+	files = [a for a in args if a != '--plot']
+
+	durations = dict()
+	for f in [open(name) for name in files] or [sys.stdin]:
+		for stage, d in read_trace(f).items():
+			durations[stage] = np.concatenate([durations.get(stage, np.zeros(0, dtype=int)), d])
+	if not durations:
+		print('No trace lines found')
+		return 1
+
+	print_histograms(durations)
+	if plot:
+		plot_histograms(durations)
+	return 0
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -11,15 +11,45 @@
 
 #include "comms_protocol.h"
 
-int currMsg = -1;
-int count = 0;
 unsigned long prevMil;
-unsigned long prevMilSU;
 float VBAT = 1.0;
 int msgCount = 0;
 
 cppQueue  msg_q(sizeof(Msg), MAX_QUEUE_SIZE, IMPLEMENTATION);
-aes256_context ctxt;
+aes256_context ctxtNode;
+aes256_context ctxtBroadcast;
+InFlight window[UPLINK_WINDOW];
+Reading batch[BATCH_MAX_READINGS];
+int batchCount = 0;
+int pendingProfile = -1;
+int curSpreadingFactor = spreadingFactor;
+long curSignalBandwidth = signalBandwidth;
+int curCodingRateDenominator = codingRateDenominator;
+long airtimeBudget = (long)AIRTIME_BUCKET_SIZE * 1000;
+unsigned long rxWindowEnd = 0;
+volatile bool cadDone = false;
+volatile bool cadBusy = false;
+unsigned long prevMilDC = 0;
+byte pendingProfileMsgID = 0;
+byte curProfile = 0;
+byte failedUplinks = 0;
+bool scanReplyPending = false;
+unsigned long scanReplyAt = 0;
+byte scanReplyMsgID = 0;
+Route routes[RELAY_ROUTES];
+long tdmaOffset = 0;
+unsigned long tdmaTime = 0;
+unsigned long tdmaSlotLen = 0;
+byte tdmaSlots = 0;
+unsigned long tdmaSyncedAt = 0;
+bool tdmaSynced = false;
+#if TRACE_ENABLED
+wsn::TraceRing<TRACE_RING_SIZE> traceRing;
+bool traceDumpPending = false;
+#endif
+#if LOG_LEVEL > LOG_LEVEL_NONE
+wsn::LogBuffer<LOG_BUFFER_SIZE> logBuffer;
+#endif
 
 /**
  * @brief Sets the LoRa radio to receive mode
@@ -27,70 +57,223 @@ aes256_context ctxt;
  * @return void
  */
 void LoRa_rxMode() {
-  LoRa.enableInvertIQ();
+  // A relay listens to the nodes and the other relays like a gateway
+  if (RELAY_ENABLED)
+    LoRa.disableInvertIQ();
+  else
+    LoRa.enableInvertIQ();
   LoRa.receive();
 }
 
 /**
- * @brief Sets the LoRa radio to transmit mode
+ * @brief Sets the LoRa radio to transmit mode. With LBT_ENABLED, first runs a channel activity detection
+ *        with the transmit settings and reports whether the channel is free
  * 
- * @return void
+ * @param toNode whether the frame goes to a node, sent with inverted IQ like the gateway's, instead of
+ *        to the gateway or a relay
+ * @return true if the frame can be sent, false if another transmission was detected
  */
-void LoRa_txMode() {
+bool LoRa_txMode(bool toNode) {
   LoRa.idle();
-  LoRa.disableInvertIQ();
+  if (toNode)
+    LoRa.enableInvertIQ();
+  else
+    LoRa.disableInvertIQ();
+  #if LBT_ENABLED
+    cadDone = false;
+    LoRa.onCadDone(onCadDone);
+    LoRa.channelActivityDetection();
+    unsigned long start = millis();
+    while (!cadDone && (millis() - start) < CAD_TIMEOUT)
+      delay(1);
+    LoRa.onCadDone(NULL);
+    LoRa.idle();
+    if (cadDone && cadBusy)
+      return false;
+  #endif
+  return true;
 }
 
 /**
- * @brief Sets the radio to transmit mode, sends a message string using the LoRa radio
- *        and sets the radio back to receive mode
+ * @brief Whether the receive window after the last frame sent is still open. Always true outside
+ *        low-power mode, where the radio listens all the time
  * 
- * @param message message to send
+ * @param currentMillis current time in millisenconds since boot
+ * @return true if the node should be listening
+ */
+bool rxWindowOpen(unsigned long currentMillis) {
+  #if LOW_POWER
+    return (long)(rxWindowEnd - currentMillis) > 0;
+  #else
+    return true;
+  #endif
+}
+
+/**
+ * @brief Time until the node has something to do: send a queued message, retry an uplink, answer a
+ *        network scan or send a batch that has waited BATCH_MAX_AGE. Sensor changes wake the node on their own
+ * 
+ * @param currentMillis current time in millisenconds since boot
+ * @return unsigned long time to sleep in ms, at most SLEEP_MAX
+ */
+unsigned long timeToNextEvent(unsigned long currentMillis) {
+  unsigned long next = SLEEP_MAX;
+  unsigned long pacing = (currentMillis - prevMil) > SEND_INTERVAL ? 0 : SEND_INTERVAL - (currentMillis - prevMil) + 1;
+
+  if (!msg_q.isEmpty())
+    next = pacing;
+  for (int i=0; i<UPLINK_WINDOW; i++) {
+    if (!window[i].used)
+      continue;
+    unsigned long due = pacing;
+    if (window[i].count > 0 && (currentMillis - window[i].sentMil) <= window[i].wait)
+      due = window[i].wait - (currentMillis - window[i].sentMil) + 1;
+    if (due < next)
+      next = due;
+  }
+  if (scanReplyPending) {
+    unsigned long due = (long)(scanReplyAt - currentMillis) > 0 ? scanReplyAt - currentMillis : 0;
+    if (due < next)
+      next = due;
+  }
+  if (batchCount > 0) {
+    unsigned long age = currentMillis - batch[0].t;
+    unsigned long due = age >= BATCH_MAX_AGE ? 0 : BATCH_MAX_AGE - age;
+    if (due < next)
+      next = due;
+  }
+  return next;
+}
+
+/**
+ * @brief Puts the radio to sleep and, on ESP32, the MCU in light sleep until the timer runs out or a
+ *        sensor input changes level. RAM is kept, so the loop resumes where it was
+ * 
+ * @param ms longest time to sleep in ms, only used on ESP32
  * @return void
  */
-void LoRa_sendMessage(byte *message) {
-  LoRa_txMode();                        // set tx mode
+void lowPowerSleep(unsigned long ms) {
+  LoRa.sleep();
+  #if defined(ESP32)
+    if (ms == 0)
+      return;
+    esp_sleep_enable_timer_wakeup((uint64_t)ms * 1000);
+    for (int i=0; i<sensN; i++)
+      gpio_wakeup_enable((gpio_num_t)sensPin[i], digitalRead(sensPin[i]) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+    #if LOG_LEVEL > LOG_LEVEL_NONE
+      // The UART stops in light sleep, send the pending log records first
+      logBuffer.flush(Serial);
+      Serial.flush();
+    #endif
+    esp_light_sleep_start();
+  #else
+    // Other boards only put the radio to sleep, the loop keeps polling
+    (void)ms;
+  #endif
+}
+
+/**
+ * @brief Called from the DIO0 interrupt when a channel activity detection ends
+ * 
+ * @param detected whether LoRa activity was detected
+ * @return void
+ */
+void onCadDone(boolean detected) {
+  cadBusy = detected;
+  cadDone = true;
+}
+
+/**
+ * @brief Sends a message of the node to the gateway. A relay sends its own messages as relay frames
+ *        without hops, so that the gateway knows to answer it with relay frames
+ * 
+ * @param message message to send
+ * @param len length of the message in bytes
+ * @return true if the message was sent, false if the channel was busy
+ */
+bool LoRa_sendMessage(byte *message, byte len) {
+  #if RELAY_ENABLED
+    byte head[1 + wsn::Relay::size] = {WSN_RELAY_FRAME};
+    wsn::Relay::Hops::put(head + 1, 0);
+    wsn::Relay::RelayID::put(head + 1, nodeID);
+    wsn::Relay::NodeID::put(head + 1, nodeID);
+  #else
+    byte head[] = {nodeID};
+  #endif
+  return LoRa_sendFrame(head, sizeof(head), message, len, false);
+}
+
+/**
+ * @brief Sets the radio to transmit mode, sends a frame using the LoRa radio
+ *        and sets the radio back to receive mode
+ * 
+ * @param head start of the frame after the network ID: the node ID in the clear and the relay header, if any
+ * @param headLen length of head in bytes
+ * @param body rest of the frame
+ * @param len length of body in bytes
+ * @param toNode whether the frame goes to a node, see LoRa_txMode
+ * @return true if the frame was sent, false if the channel was busy
+ */
+bool LoRa_sendFrame(const byte *head, byte headLen, const byte *body, byte len, bool toNode) {
+  TRACE(TRACE_TX);
+  if (!LoRa_txMode(toNode)) {           // set tx mode
+    LoRa_rxMode();
+    return false;
+  }
   LoRa.beginPacket();                   // start packet
   LoRa.write(netID);
-  LoRa.write(nodeID);
+  LoRa.write(head, headLen);
   //LoRa.print(message);                  // add payload
-  LoRa.write(message, MAX_ENC_PAYLOAD_SIZE);
+  LoRa.write(body, len);
   LoRa.endPacket(false);                 // finish packet and send it
+  airtimeBudget -= timeOnAir(headLen + len + 1);
   LoRa_rxMode();
+  rxWindowEnd = millis() + RX_WINDOW + timeOnAir(MAX_ENC_PAYLOAD_SIZE + 2) / 1000;
+  return true;
 }
 
 /**
- * @brief Encrypts a message (character array) using the AES256 algorythm with the corresponding node key
- *        The encryption is made by encrypting blocks of 16 bytes and joining them together
+ * @brief Expands the node and broadcast keys once, so that sending and receiving messages only run the
+ *        block cipher. Called from setup
  * 
- * @param msg message array to be decrypted
+ * @return void
+ */
+void initKeySchedules() {
+  aes256_init(&ctxtNode, (uint8_t *) key);
+  aes256_init(&ctxtBroadcast, (uint8_t *) keyBroadcast);
+}
+
+/**
+ * @brief Encrypts a block packed by the message codec using the AES256 algorythm with the corresponding
+ *        node key
+ * 
+ * @param ctxt expanded key schedule to encrypt with
+ * @param msg plaintext block
  * @return byte* a byte array containing the encrypted message
  */
-byte *encrypt(char msg[MAX_PAYLOAD_SIZE]) {
-  String enc = "";
-  aes256_init(&ctxt,(uint8_t *) key);
-  const char * p = msg;
+byte *encrypt(aes256_context *ctxt, const byte msg[BLOCK_SIZE]) {
   static byte plain [BLOCK_SIZE];
-  memset (plain, 0, BLOCK_SIZE);  // ensure trailing zeros
-  memcpy (plain, p, mymin (strlen (p), BLOCK_SIZE));
+  memcpy (plain, msg, BLOCK_SIZE);
 
-  aes256_encrypt_ecb(&ctxt, plain);
+  aes256_encrypt_ecb(ctxt, plain);
   return plain;
-  aes256_done(&ctxt);
 }
 
 /**
  * @brief Decrypts a message string using the AES256 algorythm with the corresponding node key
  * 
+ * @param ctxt expanded key schedule to decrypt with
  * @param msg message string to be decrypted
  * @return char* an array of characters containing the decrypted message
  */
-char  *decryptMsg(char msg[MAX_PAYLOAD_SIZE+1]) {
+char  *decryptMsg(aes256_context *ctxt, char msg[MAX_PAYLOAD_SIZE+1]) {
+  TRACE(TRACE_DECRYPT);
   static uint8_t data[MAX_PAYLOAD_SIZE+1];
   memcpy(data, msg, MAX_PAYLOAD_SIZE+1);
   //static char m[MAX_PAYLOAD_SIZE+1];
   //msg.toCharArray(m, MAX_PAYLOAD_SIZE+1);
-  aes256_decrypt_ecb(&ctxt, (uint8_t *)data);
+  aes256_decrypt_ecb(ctxt, (uint8_t *)data);
   return (char *)data;
 }
 
@@ -117,29 +300,22 @@ int mymin(int a, int b){
  * @return void
  */
 void sendAck(byte msgID) {
-  String enc;
-  char payload[MAX_PAYLOAD_SIZE];
-  char encP[MAX_ENC_PAYLOAD_SIZE];
-  byte l = (byte)MAX_PAYLOAD_SIZE;
+  TRACE(TRACE_ACK);
+  byte payload[BLOCK_SIZE];
   Msg msg;
 
   #if defined(ESP32)
     VBAT = (float)(analogRead(vbatPin)) / 4095*2*3.3*1.1;
   #endif
-  int a = VBAT;
-  int b = VBAT*10-a*10;
-  sprintf(payload, "%c%c%c%c%c%c%c%c", (char)nodeID, (char)msgID, (char)l, 'a', (char)48, (char)48, (char)a+1, (char)b+1);
+  wsn::Message m = {nodeID, msgID, LEN_FLAGS, wsn::MSG_ACK, 0, 0, wsn::vbatTenths(VBAT)};
+  wsn::pack(payload, m);
 
-  //enc = splitAndEncrypt(payload);
-  //enc.toCharArray(msg.msg, MAX_ENC_PAYLOAD_SIZE);
-  byte *plain = encrypt(payload);
+  byte *plain = encrypt(&ctxtNode, payload);
   memcpy(msg.msg, plain, MAX_PAYLOAD_SIZE);
   msg.msg[MAX_PAYLOAD_SIZE] = '\0';
+  msg.len = MAX_ENC_PAYLOAD_SIZE;
 
-  Serial.print("add ack to queue: ");
-  Serial.println(payload);
-  //Serial.print("enc msg: ");
-  //Serial.println(msg.msg);
+  LOG_DEBUG(LOG_ACK_QUEUED, msgID);
 
   msg.msgID = msgID;
   msg.flag = 'a';  
@@ -148,41 +324,72 @@ void sendAck(byte msgID) {
 
 
 /**
- * @brief Send an uplink message containing the node status
+ * @brief Builds an uplink message containing the node status
  * 
+ * @param msg message to fill in
  * @param msgID ID of the status request message
  * @return void
  */
-void sendStatus(byte msgID) {
-  Msg msg;
-  String enc;
-  char payload[MAX_PAYLOAD_SIZE];
-  msg.msgID = msgID;
-  byte l = (byte) MAX_PAYLOAD_SIZE;
+void buildStatus(Msg *msg, byte msgID) {
+  byte payload[BLOCK_SIZE];
+  msg->msgID = msgID;
 
   #if defined(ESP32)
     VBAT = (float)(analogRead(vbatPin)) / 4095*2*3.3*1.1;
   #endif
-  int a = VBAT;
-  int b = VBAT*10-a*10;
-  sprintf(payload, "%c%c%c%c%c%c%c%c", (char)nodeID, (char)msgID, (char)l, 's', (char)48, (char)48, (char)a+1, (char)b+1);
+  wsn::Message m = {nodeID, msgID, LEN_FLAGS, wsn::MSG_STATUS, 0, 0, wsn::vbatTenths(VBAT)};
+  wsn::pack(payload, m);
  
-  //enc = splitAndEncrypt(payload);
-  //enc.toCharArray(msg.msg, MAX_ENC_PAYLOAD_SIZE);
-  byte *plain = encrypt(payload);
-  memcpy(msg.msg, plain, MAX_PAYLOAD_SIZE);
-  msg.msg[MAX_PAYLOAD_SIZE] = '\0';
+  byte *plain = encrypt(&ctxtNode, payload);
+  memcpy(msg->msg, plain, MAX_PAYLOAD_SIZE);
+  msg->msg[MAX_PAYLOAD_SIZE] = '\0';
+  msg->len = MAX_ENC_PAYLOAD_SIZE;
+  msg->flag = 's';
+}
+
+/**
+ * @brief Send an uplink message containing the node status
+ * 
+ * @param msgID ID of the status request message
+ * @return void
+ */
+void sendStatus(byte msgID) {
+  TRACE(TRACE_STATUS);
+  Msg msg;
+  buildStatus(&msg, msgID);
   
-  Serial.print("add status to queue: ");
-  Serial.println(payload);
-  //Serial.print("enc msg: ");
-  //Serial.println(msg.msg);
+  LOG_DEBUG(LOG_STATUS_QUEUED, msgID);
 
   // Add msg to msg queue
-  msg.flag = 's';
   msg_q.push(&msg);
 }
 
+/**
+ * @brief Answers a network scan once the slot of the node, or its TDMA slot, has come. The answer is sent at
+ *        once, outside the pacing of the send queue, so that it stays in its slot. Without the airtime for it
+ *        or with the channel busy it is queued like any other status message
+ * 
+ * @param currentMillis current time in millisenconds since boot
+ * @return void
+ */
+void sendScanReply(unsigned long currentMillis) {
+  if (!scanReplyPending || (long)(currentMillis - scanReplyAt) < 0 || !tdmaSlotOpen(currentMillis))
+    return;
+  TRACE(TRACE_STATUS);
+  Msg msg;
+  scanReplyPending = false;
+  buildStatus(&msg, scanReplyMsgID);
+
+  refillAirtime(currentMillis);
+  if (airtimeBudget < (long)timeOnAir(msg.len + 2) || !LoRa_sendMessage(msg.msg, msg.len)) {
+    LOG_DEBUG(LOG_STATUS_QUEUED, msg.msgID);
+    msg_q.push(&msg);
+    return;
+  }
+  LOG_DEBUG(LOG_SENT, msg.msgID, (byte)msg.flag);
+  prevMil = currentMillis;
+}
+
 /**
  * @brief Sets the state of the relevant actuator with the relevant value
  * 
@@ -191,47 +398,123 @@ void sendStatus(byte msgID) {
  * @return void
  */
 void setActState(int ID, int val) {
-  if(ID == 250){
+  if(ID == MODEM_PROFILE_ACT_ID){
+    if (val >= 0 && val < N_MODEM_PROFILES)
+      curProfile = val;
     switch(val){
       case 0:
-      LoRa.setSpreadingFactor(7);
-      LoRa.setCodingRate4(5);
-      LoRa.setSignalBandwidth(125E3);
+      setModem(7, 125E3, 5);
       break;
 
       case 1:
-      LoRa.setSpreadingFactor(9);
-      LoRa.setCodingRate4(5);
-      LoRa.setSignalBandwidth(125E3);
+      setModem(9, 125E3, 5);
       break;
 
       case 2:
-      LoRa.setSpreadingFactor(11);
-      LoRa.setCodingRate4(5);
-      LoRa.setSignalBandwidth(125E3);
+      setModem(11, 125E3, 5);
       break;
 
       case 3:
-      LoRa.setSpreadingFactor(7);
-      LoRa.setCodingRate4(5);
-      LoRa.setSignalBandwidth(250E3);
+      setModem(7, 250E3, 5);
       break;
 
       case 4:
-      LoRa.setSpreadingFactor(7);
-      LoRa.setCodingRate4(8);
-      LoRa.setSignalBandwidth(125E3);
+      setModem(7, 125E3, 8);
       break;
     }
   }else{
-    Serial.print("Set actuator: ");
-    Serial.print(ID);
-    Serial.print(" with value: ");
-    Serial.println(val);
+    LOG_INFO(LOG_ACTUATOR, (byte)ID, (byte)val);
     digitalWrite(actPin[ID], val);
   }
 }
 
+/**
+ * @brief Applies modem settings to the radio and keeps them for the time on air calculation
+ * 
+ * @param sf spreading factor
+ * @param bw signal bandwidth in Hz
+ * @param crd coding rate denominator
+ * @return void
+ */
+void setModem(int sf, long bw, int crd) {
+  LoRa.setSpreadingFactor(sf);
+  LoRa.setCodingRate4(crd);
+  LoRa.setSignalBandwidth(bw);
+  curSpreadingFactor = sf;
+  curSignalBandwidth = bw;
+  curCodingRateDenominator = crd;
+}
+
+/**
+ * @brief Computes how long a frame occupies the channel with the current modem settings, following the
+ *        Semtech SX1276 datasheet: explicit header, CRC on, low data rate optimization above 16 ms symbols
+ * 
+ * @param len length of the frame in bytes
+ * @return unsigned long time on air in microseconds
+ */
+unsigned long timeOnAir(byte len) {
+  float tSym = (float)(1L << curSpreadingFactor) * 1E6 / curSignalBandwidth;
+  int de = tSym > 16000 ? 1 : 0;
+  long num = 8L * len - 4 * curSpreadingFactor + 28 + 16;
+  long den = 4 * (curSpreadingFactor - 2 * de);
+  long nPayload = num > 0 ? (num + den - 1) / den * curCodingRateDenominator : 0;
+  return (unsigned long)((PREAMBLE_LENGTH + 4.25 + 8 + nPayload) * tSym);
+}
+
+/**
+ * @brief Time to wait for the ack of a frame before sending it again: the frame and the ack on air
+ *        plus ACK_MARGIN for the gateway to get to it
+ * 
+ * @param len length of the message in bytes
+ * @return unsigned long timeout in ms
+ */
+unsigned long retryTimeout(byte len) {
+  return (timeOnAir(len + 2) + timeOnAir(MAX_ENC_PAYLOAD_SIZE + 2)) / 1000 + ACK_MARGIN;
+}
+
+/**
+ * @brief Time to wait before sending a frame again. With BACKOFF_EXPONENTIAL a random backoff is added to
+ *        retryTimeout, so that nodes whose frames collided do not retry at the same time again
+ * 
+ * @param len length of the message in bytes
+ * @param count attempts made so far, 1 after the first transmission
+ * @return unsigned long wait in ms
+ */
+unsigned long retryWait(byte len, byte count) {
+  unsigned long wait = retryTimeout(len);
+  #if BACKOFF_MODE == BACKOFF_EXPONENTIAL
+    unsigned long window = BACKOFF_CAP;
+    if (count <= 8 && ((unsigned long)BACKOFF_BASE << (count - 1)) < BACKOFF_CAP)
+      window = (unsigned long)BACKOFF_BASE << (count - 1);
+    wait += random(window + 1);
+  #endif
+  return wait;
+}
+
+/**
+ * @brief Adds the airtime earned since the last call to the duty cycle budget, DUTY_CYCLE_PERMILLE us
+ *        per ms, up to AIRTIME_BUCKET_SIZE
+ * 
+ * @param currentMillis current time in millisenconds since boot
+ * @return void
+ */
+void refillAirtime(unsigned long currentMillis) {
+  airtimeBudget += (long)(currentMillis - prevMilDC) * DUTY_CYCLE_PERMILLE;
+  if (airtimeBudget > (long)AIRTIME_BUCKET_SIZE * 1000)
+    airtimeBudget = (long)AIRTIME_BUCKET_SIZE * 1000;
+  prevMilDC = currentMillis;
+}
+
+/**
+ * @brief Returns the airtime the duty cycle still allows right now
+ * 
+ * @return long remaining budget in ms
+ */
+long remainingAirtime() {
+  refillAirtime(millis());
+  return airtimeBudget / 1000;
+}
+
 /**
  * @brief Adds to the message queue an uplink message containing sensor data.
  * 
@@ -240,33 +523,44 @@ void setActState(int ID, int val) {
  *       then double it (note above that Adafruit halves the voltage), then multiply that by the reference voltage of the ESP32 which 
  *       is 3.3V and then vinally, multiply that again by the ADC Reference Voltage of 1100mV.
  * 
+ * In batching mode (BATCH_MAX_READINGS above 1) the reading is added to the batch instead, see sendBatch.
+ * 
  * @param sensorID ID of the relevant sensor
  * @param sensorVal value read from the relevant sensor
  * @return void
  */
 void sendSensorData(byte sensorID, byte sensorVal) {
+  TRACE(TRACE_SENSOR);
+  #if BATCH_MAX_READINGS > 1
+    // Batching mode, the reading waits in the batch until it is full or old enough
+    msgCount ++;
+    batch[batchCount].sensorID = sensorID;
+    batch[batchCount].sensorVal = sensorVal;
+    batch[batchCount].t = millis();
+    batchCount ++;
+    if (batchCount == BATCH_MAX_READINGS)
+      sendBatch();
+    return;
+  #endif
+
   Msg msg;
-  String enc;
-  char payload[MAX_PAYLOAD_SIZE];
+  byte payload[BLOCK_SIZE];
   msgCount ++;
   if (msgCount == 0)
     msgCount ++;
   msg.msgID = (byte) msgCount;
-  byte l = MAX_PAYLOAD_SIZE;
 
   #if defined(ESP32)
     VBAT = (float)(analogRead(vbatPin)) / 4095*2*3.3*1.1;
   #endif
-  Serial.println(VBAT);
-  int a = VBAT;
-  int b = VBAT*10-a*10;
-  sprintf(payload, "%c%c%c%c%c%c%c%c", (char)nodeID, (char)msg.msgID, (char)l, 'u', (char)(sensorID + 1), (char)(sensorVal + 1), (char)a+1, (char)b+1);
-
-  //enc = splitAndEncrypt(payload);
-  //enc.toCharArray(msg.msg, MAX_ENC_PAYLOAD_SIZE);
-  byte *plain = encrypt(payload);
+  wsn::Message m = {nodeID, msg.msgID, LEN_FLAGS, wsn::MSG_UPLINK, sensorID, sensorVal, wsn::vbatTenths(VBAT)};
+  LOG_DEBUG(LOG_SENSOR_QUEUED, msg.msgID, m.vbat);
+  wsn::pack(payload, m);
+
+  byte *plain = encrypt(&ctxtNode, payload);
   memcpy(msg.msg, plain, MAX_PAYLOAD_SIZE);
   msg.msg[MAX_PAYLOAD_SIZE] = '\0';
+  msg.len = MAX_ENC_PAYLOAD_SIZE;
 
   // Add msg to msg queue
   msg.flag = 'u';
@@ -274,117 +568,534 @@ void sendSensorData(byte sensorID, byte sensorVal) {
 }
 
 /**
- * @brief Get a message from the send queue and send it. Implements retransmission 
- *        in case an acknowledge message is not received. Aware of a failed transmission.
+ * @brief Adds to the message queue one uplink message containing every reading in the batch. Each reading
+ *        keeps the msgID it got when it was taken, the message uses the msgID of the first one.
+ *        See wsn::Batch for the layout, the age of a reading is capped at 25.5 s
+ * 
+ * @return void
+ */
+void sendBatch() {
+  if (batchCount == 0)
+    return;
+
+  Msg msg;
+  byte plain[MAX_BATCH_PAYLOAD_SIZE];
+  unsigned long now = millis();
+
+  #if defined(ESP32)
+    VBAT = (float)(analogRead(vbatPin)) / 4095*2*3.3*1.1;
+  #endif
+
+  msg.msgID = (byte)(msgCount - batchCount + 1);
+  wsn::Message m = {nodeID, msg.msgID, LEN_FLAGS, wsn::MSG_BATCH, 0, 0, wsn::vbatTenths(VBAT)};
+  byte l = wsn::packBatch(plain, m, batchCount);
+  for (int i=0; i<batchCount; i++) {
+    unsigned long age = (now - batch[i].t) / 100;
+    wsn::Reading r = {batch[i].sensorID, batch[i].sensorVal, (byte)mymin(age, 255)};
+    wsn::packReading(plain, i, r);
+  }
+
+  for (int i=0; i<l; i+=BLOCK_SIZE)
+    aes256_encrypt_ecb(&ctxtNode, plain + i);
+  memcpy(msg.msg, plain, l);
+  msg.msg[l] = '\0';
+  msg.len = l + 1;
+
+  LOG_DEBUG(LOG_BATCH_QUEUED, msg.msgID, (byte)batchCount);
+
+  msg.flag = 'u';
+  msg_q.push(&msg);
+  batchCount = 0;
+}
+
+/**
+ * @brief Sends the batch once its oldest reading has waited BATCH_MAX_AGE
+ * 
+ * @param currentMillis current time in millisenconds since boot
+ * @return void
+ */
+void checkBatch(unsigned long currentMillis) {
+  if (batchCount > 0 && (currentMillis - batch[0].t) >= BATCH_MAX_AGE)
+    sendBatch();
+}
+
+/**
+ * @brief Get a message from the send queue and send it. Sensor messages are moved to the uplink window,
+ *        where up to UPLINK_WINDOW of them wait for their ack at the same time, each with its own
+ *        retransmission counter and timer. Status and acknowledge messages, and the frames a relay
+ *        forwards, are sent first and are not retransmitted. With TDMA_ENABLED, a node synced to the beacons
+ *        only sends in its slot. Aware of a failed transmission.
  * 
  * @param currentMillis current time in millisenconds since boot
  * @return void
  */
 void getMsgFromQueueAndSend(unsigned long currentMillis) {
-  if (!msg_q.isEmpty()) {
-    Msg msg;
-    msg_q.peek(&msg);
-
-    if (currMsg == msg.msgID)
-      count ++;
-    else
-      count = 0;
-
-    currMsg = msg.msgID;
-    if (count < MAX_N_RETRY) {
-      Serial.print("send msg: ");
-      //Serial.println(msg.msg);
-      LoRa_sendMessage(msg.msg);
-      if ((msg.flag == 's') || (msg.flag == 'a')){
-        msg_q.drop();
-        currMsg = -1;
+  Msg msg;
+  bool ready = false;
+
+  // Wait until the duty cycle budget covers the longest frame and, synced to the beacons, for the slot
+  refillAirtime(currentMillis);
+  if (airtimeBudget < (long)timeOnAir(MAX_MSG_SIZE + 2) || !tdmaSlotOpen(currentMillis))
+    return;
+
+  // Go once through the queue, keeping the order of the messages left in it
+  int n = msg_q.getCount();
+  for (int i=0; i<n; i++) {
+    Msg q;
+    msg_q.pop(&q);
+    if (q.flag != 'u') {
+      if (!ready) {
+        msg = q;
+        ready = true;
+        continue;
       }
     } else {
-      Serial.print("Failed to send msg with id: ");
-      Serial.println(msg.msgID);
-      msg_q.drop();
-      currMsg = -1;
+      int j;
+      for (j=0; j<UPLINK_WINDOW; j++)
+        if (!window[j].used)
+          break;
+      if (j < UPLINK_WINDOW) {
+        window[j].msg = q;
+        window[j].count = 0;
+        window[j].used = true;
+        continue;
+      }
+    }
+    msg_q.push(&q);
+  }
+
+  // Without a status or ack to send, send the sensor message that is due the longest
+  int due = -1;
+  for (int i=0; i<UPLINK_WINDOW && !ready; i++) {
+    if (!window[i].used)
+      continue;
+    if (window[i].count > 0 && (currentMillis - window[i].sentMil) <= window[i].wait)
+      continue;
+    if (window[i].count >= MAX_N_RETRY) {
+      LOG_WARN(LOG_SEND_FAILED, window[i].msg.msgID);
+      window[i].used = false;
+      #if PROFILE_SCAN_ENABLED
+        // The gateway may be listening on another profile
+        if (++failedUplinks >= PROFILE_SCAN_FAILURES) {
+          failedUplinks = 0;
+          setActState(MODEM_PROFILE_ACT_ID, (curProfile + 1) % N_MODEM_PROFILES);
+          LOG_WARN(LOG_PROFILE_SCAN, curProfile);
+        }
+      #endif
+    } else if (due == -1 || window[i].count == 0 || (window[due].count > 0 && (long)(window[due].sentMil + window[due].wait - window[i].sentMil - window[i].wait) > 0)) {
+      due = i;
     }
+  }
+  if (due != -1) {
+    msg = window[due].msg;
+    ready = true;
+  }
+
+  if (ready) {
+    // Frames forwarded by a relay are queued whole, 'r' for the gateway or a relay and 'd' for a node
+    bool forward = msg.flag == 'r' || msg.flag == 'd';
+    if (forward ? !LoRa_sendFrame(msg.msg, msg.len, NULL, 0, msg.flag == 'd') : !LoRa_sendMessage(msg.msg, msg.len)) {
+      // Channel busy: put a status, ack or forwarded frame back in the queue and try again after a short random delay
+      if (due == -1)
+        msg_q.push(&msg);
+      prevMil = currentMillis - SEND_INTERVAL + random(LBT_BACKOFF);
+      return;
+    }
+    if (due != -1) {
+      window[due].count ++;
+      window[due].sentMil = currentMillis;
+      window[due].wait = retryWait(window[due].msg.len, window[due].count);
+    }
+    LOG_DEBUG(LOG_SENT, msg.msgID, (byte)msg.flag);
     prevMil = currentMillis;
+
+    if (msg.flag == 'a' && pendingProfile != -1 && msg.msgID == pendingProfileMsgID) {
+      setActState(MODEM_PROFILE_ACT_ID, pendingProfile);
+      pendingProfile = -1;
+    }
+  }
+}
+
+/**
+ * @brief Releases the window slots of the sensor messages covered by an acknowledge message
+ * 
+ * @param msgID ID of the acknowledged message
+ * @param mask bitmap of the 7 msgIDs before msgID also received by the gateway (bit k for msgID-k-1)
+ * @return void
+ */
+void ackWindow(byte msgID, byte mask) {
+  for (int i=0; i<UPLINK_WINDOW; i++) {
+    if (!window[i].used)
+      continue;
+    byte back = (byte)(msgID - window[i].msg.msgID);
+    if (back == 0 || (back <= 7 && (mask & (1 << (back - 1))))) {
+      LOG_DEBUG(LOG_DELIVERED, window[i].msg.msgID);
+      window[i].used = false;
+    }
   }
 }
 
 /**
  * @brief Called every time a new message is received. Filters unwanted messages, decrypts the payload,
  *        gets the relevant fields from the payload and sends back an acknowledge message if necessary.
+ *        A broadcast status request with response slots (a network scan) is answered in the slot of
+ *        the node ID, see sendScanReply. A command for TRACE_DUMP_ACT_ID asks the loop for a dump of the
+ *        latency trace. A beacon syncs the node to the TDMA superframe, see tdmaSync. On a relay, frames for
+ *        other nodes are handed to relayFrame first.
  * 
  * @param packetSize size of the incoming message in bytes
  * @return void
  */
 void onReceive(int packetSize){
-  byte rNetID = LoRa.read();
-  byte rnID = LoRa.read();
-  char buffer1[MAX_ENC_PAYLOAD_SIZE];
-  char buffer2[MAX_ENC_PAYLOAD_SIZE];
+  TRACE(TRACE_HANDLE);
+  byte rNetID;
+  byte rnID;
+  char buffer1[MAX_RX_SIZE];
   String message = "";
   int i=0;
-  while (LoRa.available() && i<MAX_ENC_PAYLOAD_SIZE) {
-    //Serial.println(LoRa.peek(), HEX);
-    buffer1[i] = (char)LoRa.read();
-    //message += (char)LoRa.read();
-    
-    i++;
+  unsigned long rxMillis = millis();
+  {
+    TRACE(TRACE_RX_READ);
+    rNetID = LoRa.read();
+    rnID = LoRa.read();
+    while (LoRa.available() && i<MAX_RX_SIZE) {
+      //Serial.println(LoRa.peek(), HEX);
+      buffer1[i] = (char)LoRa.read();
+      //message += (char)LoRa.read();
+      
+      i++;
+    }
   }
-  Serial.println("msg");
-  //Serial.println(message.length());
-  //Serial.println(MAX_ENC_PAYLOAD_SIZE);
-  //Serial.println(rNetID == netID);
+  LOG_DEBUG(LOG_FRAME, rNetID, rnID, (byte)i);
+  // A relay forwards the frames of other nodes and keeps the downlinks for itself
+  if (RELAY_ENABLED && rNetID == netID && !relayFrame(&rnID, (byte *)buffer1, &i))
+    return;
   if (rNetID == netID) {
-    Serial.println("New msg received");
     
 
     //int j = message.length() / ENC_BLOCK_SIZE;
     //int h = message.length() / (1 * j);
     
-    byte len;
     Payload p;
 
-    if (rnID == BROADCAST_ID)
-      aes256_init(&ctxt,(uint8_t *) keyBroadcast);
-    else
-      aes256_init(&ctxt,(uint8_t *) key);
+    aes256_context *ctxt = (rnID == BROADCAST_ID) ? &ctxtBroadcast : &ctxtNode;
     //for (int i = 0; i < j; i++) {
     //  if (i == 0)
     //    strcpy(buffer1, decryptMsg(message.substring(i * ENC_BLOCK_SIZE, (i + 1) * ENC_BLOCK_SIZE)));
     //  else
     //    strcat(buffer1, decryptMsg(message.substring(i * ENC_BLOCK_SIZE, (i + 1) * ENC_BLOCK_SIZE)));
     //}
-    strcpy(buffer2, decryptMsg(buffer1));
-    aes256_done(&ctxt);
+    wsn::Message m;
+    byte *plain = (byte *)decryptMsg(ctxt, buffer1);
+    wsn::unpack(plain, &m);
+    p.nodeID = m.nodeID;
+    p.msgID = m.msgID;
+    p.flag = m.type;
+    p.sensorID = m.a;
+    p.sensorVal = m.b;
 
-    buffer2[6] = '\0';
-
-    Serial.println(buffer2);
-    if(sscanf(buffer2, "%c%c%c%c%c%c", &p.nodeID, &p.msgID, &len, &p.flag, &p.sensorID, &p.sensorVal) == 6){
-      Serial.println(p.flag);
-      Msg msg;
-      msg_q.peek(&msg);
+    if (i >= BLOCK_SIZE) {
       if (p.nodeID == nodeID || p.nodeID == BROADCAST_ID) {
-        Serial.println("rssi,snr");
-        Serial.println(LoRa.packetRssi());
-        Serial.println(LoRa.packetSnr());
+        LOG_DEBUG(LOG_MSG, (byte)p.flag, (byte)p.msgID, (int16_t)LoRa.packetRssi(), (float)LoRa.packetSnr());
+        failedUplinks = 0;
         if (p.flag == 'a') {
-          if (p.msgID == msg.msgID) {
-            Serial.print("Message with ID: ");
-            Serial.print(p.msgID);
-            Serial.println(" delivered!");
-            msg_q.drop();
-          }
+          // Gateways that send a bitmap mark it with the top bit
+          if (p.sensorID & 0x80)
+            ackWindow(p.msgID, p.sensorID & 0x7F);
+          else
+            ackWindow(p.msgID, 0);
         } else if (p.flag == 's') {
-          Serial.print("received msg with id: ");
-          Serial.println(p.msgID);
-          sendStatus(p.msgID);
+          // Field A holds the number of slots of a scan and field B their length in SCAN_SLOT_UNIT ms,
+          // requests without slots are answered at once
+          if (p.nodeID == BROADCAST_ID && p.sensorID > 0) {
+            scanReplyMsgID = p.msgID;
+            scanReplyAt = millis() + (unsigned long)((nodeID - 1) % p.sensorID) * p.sensorVal * SCAN_SLOT_UNIT;
+            if (tdmaSynced)
+              scanReplyAt = millis() + tdmaWait(millis());
+            scanReplyPending = true;
+          } else {
+            sendStatus(p.msgID);
+          }
         } else if (p.flag == 'c') {
-          // Set actuator value and send ack
-          setActState((int)(p.sensorID - 1), (int)(p.sensorVal - 1));
+          // Set actuator value and send ack. A modem profile change waits until the ack has gone out
+          // on the current profile, see getMsgFromQueueAndSend
+          if (p.sensorID == MODEM_PROFILE_ACT_ID) {
+            pendingProfile = p.sensorVal;
+            pendingProfileMsgID = p.msgID;
+          } else if (p.sensorID == TRACE_DUMP_ACT_ID) {
+            #if TRACE_ENABLED
+              traceDumpPending = true;
+            #endif
+          } else {
+            setActState(p.sensorID, p.sensorVal);
+          }
           sendAck(p.msgID);
+        } else if (p.flag == wsn::MSG_BEACON && p.nodeID == BROADCAST_ID) {
+          tdmaSync(plain, packetSize, rxMillis);
         }
       }
     }  
   }
 }
+
+/**
+ * @brief Handles a frame heard by a relay. Frames of other nodes and the uplinks of other relays are
+ *        forwarded to the gateway, downlinks for this relay are forwarded to the node they go to. A downlink
+ *        for the relay itself is unwrapped, so that it is handled like a frame from the gateway
+ * 
+ * @param rnID node ID in the clear, set to the node ID of an unwrapped downlink
+ * @param frame frame after the node ID, the relay header is taken out of an unwrapped downlink
+ * @param len length of the frame in bytes, updated
+ * @return true if the frame is for this node and still has to be handled
+ */
+bool relayFrame(byte *rnID, byte *frame, int *len) {
+  unsigned long currentMillis = millis();
+  if (*rnID != WSN_RELAY_FRAME) {
+    // A node's own frame, the relay hears neither the gateway nor its own frames
+    if (*rnID != nodeID && *rnID != BROADCAST_ID && *len >= BLOCK_SIZE)
+      relayUplink(*rnID, 0, 0, frame, *len, currentMillis);
+    return false;
+  }
+  if (*len < wsn::Relay::size)
+    return false;
+
+  byte hops = wsn::Relay::Hops::get(frame);
+  byte relayID = wsn::Relay::RelayID::get(frame);
+  byte destID = wsn::Relay::NodeID::get(frame);
+  const byte *inner = frame + wsn::Relay::size;
+  int innerLen = *len - wsn::Relay::size;
+  if (!(hops & wsn::RELAY_DOWN)) {
+    // Uplink of another relay, forwarded unless it went through too many relays already
+    if (relayID != nodeID && destID != nodeID && (hops & wsn::RELAY_HOPS) < RELAY_MAX_HOPS && innerLen >= BLOCK_SIZE)
+      relayUplink(destID, relayID, hops & wsn::RELAY_HOPS, inner, innerLen, currentMillis);
+    return false;
+  }
+  if (relayID != nodeID)
+    return false;
+  if (hops & wsn::RELAY_PRUNE) {
+    relayPrune(destID, currentMillis);
+    return false;
+  }
+  if (destID != nodeID) {
+    relayDownlink(destID, inner, innerLen);
+    return false;
+  }
+  *rnID = nodeID;
+  *len = innerLen;
+  memmove(frame, inner, innerLen);
+  return true;
+}
+
+/**
+ * @brief Queues the frame of a node for the gateway and updates the route to the node. Frames of a node
+ *        pruned by the gateway, and a frame already forwarded within RELAY_DEDUP_WINDOW, are not forwarded
+ * 
+ * @param srcID ID of the node the frame comes from
+ * @param via relay the frame was heard from, 0 if from the node itself
+ * @param hops relays the frame went through before this one
+ * @param frame ciphertext of the frame
+ * @param len length of the frame in bytes, at least BLOCK_SIZE
+ * @param currentMillis current time in millisenconds since boot
+ * @return void
+ */
+void relayUplink(byte srcID, byte via, byte hops, const byte *frame, int len, unsigned long currentMillis) {
+  Route *r = findRoute(srcID);
+  if (r == NULL) {
+    r = addRoute(srcID);
+    r->via = via;
+  } else if (via == 0 || r->via == via || (currentMillis - r->lastSeen) > RELAY_ROUTE_TIMEOUT) {
+    // A shorter route, or the same one, is taken at once, a longer one only once this one is stale
+    r->via = via;
+  }
+  if (r->via == via)
+    r->lastSeen = currentMillis;
+
+  if (r->pruned && (currentMillis - r->prunedAt) < RELAY_PRUNE_TIME)
+    return;
+  r->pruned = false;
+  uint16_t tag = frame[0] | (frame[1] << 8);
+  if (r->tag == tag && (currentMillis - r->forwarded) < RELAY_DEDUP_WINDOW)
+    return;
+  r->tag = tag;
+  r->forwarded = currentMillis;
+
+  Msg msg;
+  msg.msg[0] = WSN_RELAY_FRAME;
+  wsn::Relay::Hops::put(msg.msg + 1, hops + 1);
+  wsn::Relay::RelayID::put(msg.msg + 1, nodeID);
+  wsn::Relay::NodeID::put(msg.msg + 1, srcID);
+  len = mymin(len, MAX_MSG_SIZE - 1 - wsn::Relay::size);
+  memcpy(msg.msg + 1 + wsn::Relay::size, frame, len);
+  msg.len = 1 + wsn::Relay::size + len;
+  msg.msgID = 0;
+  msg.flag = 'r';
+  LOG_DEBUG(LOG_RELAY_UP, srcID, (byte)(hops + 1));
+  msg_q.push(&msg);
+}
+
+/**
+ * @brief Queues a downlink of the gateway for a node: as a plain frame if the relay hears the node itself,
+ *        or as a relay frame for the next relay on the route
+ * 
+ * @param destID ID of the node the downlink goes to
+ * @param frame ciphertext of the downlink
+ * @param len length of the downlink in bytes
+ * @return void
+ */
+void relayDownlink(byte destID, const byte *frame, int len) {
+  Route *r = findRoute(destID);
+  if (r == NULL) {
+    LOG_WARN(LOG_RELAY_NO_ROUTE, destID);
+    return;
+  }
+
+  Msg msg;
+  byte n = 0;
+  if (r->via == 0) {
+    msg.msg[n++] = destID;
+    msg.flag = 'd';
+  } else {
+    msg.msg[n++] = WSN_RELAY_FRAME;
+    wsn::Relay::Hops::put(msg.msg + n, wsn::RELAY_DOWN);
+    wsn::Relay::RelayID::put(msg.msg + n, r->via);
+    wsn::Relay::NodeID::put(msg.msg + n, destID);
+    n += wsn::Relay::size;
+    msg.flag = 'r';
+  }
+  len = mymin(len, MAX_MSG_SIZE - n);
+  memcpy(msg.msg + n, frame, len);
+  msg.len = n + len;
+  msg.msgID = 0;
+  LOG_DEBUG(LOG_RELAY_DOWN, destID);
+  msg_q.push(&msg);
+}
+
+/**
+ * @brief Stops forwarding the frames of a node for RELAY_PRUNE_TIME, because the gateway already gets
+ *        them without this relay. Only this relay is pruned, the others on the route keep forwarding
+ * 
+ * @param destID ID of the node
+ * @param currentMillis current time in millisenconds since boot
+ * @return void
+ */
+void relayPrune(byte destID, unsigned long currentMillis) {
+  Route *r = findRoute(destID);
+  if (r == NULL)
+    return;
+  r->pruned = true;
+  r->prunedAt = currentMillis;
+  LOG_DEBUG(LOG_RELAY_PRUNED, destID);
+}
+
+/**
+ * @brief Looks up the route to a node
+ * 
+ * @param destID ID of the node
+ * @return Route* the route, or NULL if the relay has not heard the node
+ */
+Route *findRoute(byte destID) {
+  for (int i=0; i<RELAY_ROUTES; i++)
+    if (routes[i].used && routes[i].nodeID == destID)
+      return &routes[i];
+  return NULL;
+}
+
+/**
+ * @brief Adds a route to a node, in a free entry or in place of the one used longest ago
+ * 
+ * @param destID ID of the node, must not have a route yet
+ * @return Route* the new route, to be filled in
+ */
+Route *addRoute(byte destID) {
+  int old = 0;
+  for (int i=0; i<RELAY_ROUTES; i++) {
+    if (!routes[i].used) {
+      old = i;
+      break;
+    }
+    if ((long)(routes[old].lastSeen - routes[i].lastSeen) > 0)
+      old = i;
+  }
+  memset(&routes[old], 0, sizeof(Route));
+  routes[old].nodeID = destID;
+  routes[old].lastSeen = millis();
+  routes[old].used = true;
+  return &routes[old];
+}
+
+/**
+ * @brief Syncs the node to a beacon: keeps the offset of millis() to the gateway's time at the start of the
+ *        beacon, taken as its time on air before it was received, and the slots of the superframe
+ * 
+ * @param plain decrypted beacon
+ * @param packetSize length of the beacon frame in bytes
+ * @param rxMillis time the beacon was received, in millisenconds since boot
+ * @return void
+ */
+void tdmaSync(const byte *plain, int packetSize, unsigned long rxMillis) {
+  wsn::Superframe s;
+  wsn::unpackBeacon(plain, &s);
+  if (!TDMA_ENABLED || s.slots == 0 || s.slotLen == 0)
+    return;
+  unsigned long start = rxMillis - timeOnAir(packetSize) / 1000;
+  tdmaOffset = (long)(s.time - start);
+  tdmaTime = s.time;
+  tdmaSlots = s.slots;
+  tdmaSlotLen = (unsigned long)s.slotLen * SCAN_SLOT_UNIT;
+  tdmaSyncedAt = rxMillis;
+  tdmaSynced = true;
+  LOG_DEBUG(LOG_TDMA_SYNC, (int32_t)tdmaOffset, tdmaSlots);
+}
+
+/**
+ * @brief Whether the node may start a frame now: always when it is not synced to the beacons, otherwise
+ *        only in the transmit window of its slot. The sync is dropped after TDMA_SYNC_TIMEOUT without a beacon
+ * 
+ * @param currentMillis current time in millisenconds since boot
+ * @return true if a frame can be sent now
+ */
+bool tdmaSlotOpen(unsigned long currentMillis) {
+  if (tdmaSynced && (currentMillis - tdmaSyncedAt) > TDMA_SYNC_TIMEOUT) {
+    tdmaSynced = false;
+    LOG_WARN(LOG_TDMA_LOST);
+  }
+  return !tdmaSynced || tdmaWait(currentMillis) == 0;
+}
+
+/**
+ * @brief Time until the slot of the node starts, counted in the gateway's time, the node's millis() plus
+ *        tdmaOffset. The node must be synced
+ * 
+ * @param currentMillis current time in millisenconds since boot
+ * @return unsigned long wait in ms, 0 while the transmit window of the slot is open
+ */
+unsigned long tdmaWait(unsigned long currentMillis) {
+  unsigned long len = (tdmaSlots + 1UL) * tdmaSlotLen;
+  unsigned long phase = (currentMillis + tdmaOffset - tdmaTime) % len;
+  unsigned long start = (1UL + (nodeID - 1) % tdmaSlots) * tdmaSlotLen;
+  if (phase >= start && phase < start + TDMA_TX_WINDOW)
+    return 0;
+  return (start + len - phase) % len;
+}
+
+#if TRACE_ENABLED
+/**
+ * @brief Sends the measurements of the latency trace on the serial port as LOG_TRACE records, which the log
+ *        decoder prints as "trace <stage> <microseconds>" lines, oldest first, followed by LOG_TRACE_END, and
+ *        empties the trace. Called from the loop after a command for TRACE_DUMP_ACT_ID, so that the sending
+ *        is not measured. Blocks until the records are in the serial transmit buffer
+ * 
+ * @return void
+ */
+void traceDump() {
+  for (byte i=0; i<traceRing.count; i++) {
+    const wsn::TraceEntry &e = traceRing.at(i);
+    LOG_INFO(LOG_TRACE, e.stage, e.duration);
+    logBuffer.flush(Serial);
+  }
+  LOG_INFO(LOG_TRACE_END);
+  logBuffer.flush(Serial);
+  traceRing.clear();
+  traceDumpPending = false;
+}
+#endif
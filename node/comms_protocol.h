@@ -18,14 +18,35 @@
 #include <LoRa.h>
 #include <cppQueue.h>
 #include <aes256.h>
+#include <wsn_codec.h>
+#include <wsn_trace.h>
+#include <wsn_log.h>
 #include "node_definitions.h"
+#if defined(ESP32)
+  #include <esp_sleep.h>
+  #include <driver/gpio.h>
+#endif
 
 #define  IMPLEMENTATION  FIFO
 
 // LoRa msg payload settings
 #define MAX_N_RETRY 3
-#define TIMEOUT_INTERVAL 6000
-#define MAX_QUEUE_SIZE 5
+// An uplink is retried once it and the gateway's ack could have gone through, plus this margin in ms
+#define ACK_MARGIN 2000
+// Retry backoff: BACKOFF_FIXED retries right after that timeout, BACKOFF_EXPONENTIAL adds a random wait
+// drawn from a window of BACKOFF_BASE ms that doubles after every attempt, up to BACKOFF_CAP ms
+#define BACKOFF_FIXED 0
+#define BACKOFF_EXPONENTIAL 1
+#ifndef BACKOFF_MODE
+#define BACKOFF_MODE BACKOFF_EXPONENTIAL
+#endif
+#define BACKOFF_BASE 1000
+#define BACKOFF_CAP 8000
+#define MAX_QUEUE_SIZE (RELAY_ENABLED ? 12 : 5)
+#define SEND_INTERVAL 500
+
+// Sensor messages waiting for an ack at the same time, 1 gives stop-and-wait
+#define UPLINK_WINDOW 4
 
 #define BLOCK_SIZE 16
 #define MAX_PAYLOAD_SIZE 16
@@ -34,10 +55,168 @@
 
 #define MAX_MSG_ID 256
 
-#define STATUS_UPDATE_INTERVAL 60000
+// EU868 duty cycle: share of the time the radio may transmit, in 1/1000, and most airtime that can be
+// saved up for a burst, in ms (1 % of an hour)
+#define DUTY_CYCLE_PERMILLE 10
+#define AIRTIME_BUCKET_SIZE 36000
+#define PREAMBLE_LENGTH 8
+
+// Listen before talk: channel activity detection before every transmission. A busy channel defers the frame
+// by a random delay of up to LBT_BACKOFF ms. CAD_TIMEOUT bounds the wait for the detection in ms
+#ifndef LBT_ENABLED
+#define LBT_ENABLED 0
+#endif
+#define LBT_BACKOFF 200
+#define CAD_TIMEOUT 100
+
+// Low-power mode: the radio and, on ESP32, the MCU sleep between events (sensor change or timer, at most
+// SLEEP_MAX ms). After every frame the node listens for RX_WINDOW ms, plus the time on air of a downlink,
+// for acks and downlinks; the gateway holds downlinks until then
+#ifndef LOW_POWER
+#define LOW_POWER 0
+#endif
+#define RX_WINDOW 1500
+#define SLEEP_MAX 60000
+// Length byte flags, see LEN_RX_WINDOW in wsn_codec.h
+#define LEN_FLAGS (LOW_POWER ? LEN_RX_WINDOW : 0)
+
+// Relay role, for mains-powered nodes: the node listens like a gateway and forwards the frames it hears from
+// other nodes, and the uplinks of other relays up to RELAY_MAX_HOPS, to the gateway as relay frames (see
+// wsn::Relay), and the gateway's downlinks back to them. It keeps a route to the last RELAY_ROUTES nodes it
+// heard: the relay their frames came through, or none. A route is only replaced by one through another
+// relay once it has not been used for RELAY_ROUTE_TIMEOUT ms. A frame heard again within RELAY_DEDUP_WINDOW
+// ms is not forwarded again, nor the frames of a node for RELAY_PRUNE_TIME ms after the gateway tells the
+// relay it gets them another way
+#ifndef RELAY_ENABLED
+#define RELAY_ENABLED 0
+#endif
+#define RELAY_ROUTES 16
+#define RELAY_MAX_HOPS 3
+#define RELAY_ROUTE_TIMEOUT 120000
+#define RELAY_DEDUP_WINDOW 2000
+#define RELAY_PRUNE_TIME 600000
+static_assert(!(RELAY_ENABLED && LOW_POWER), "a relay listens all the time");
+
+// TDMA: a node that hears a beacon of the gateway (see wsn::Beacon) keeps the offset of its millis() to the
+// gateway's and the slots of the superframe, and only starts a frame in the first TDMA_TX_WINDOW ms of its
+// slot: slot (nodeID - 1) modulo the number of slots, after the beacon slot. Without a beacon for
+// TDMA_SYNC_TIMEOUT ms it sends whenever it can again
+#ifndef TDMA_ENABLED
+#define TDMA_ENABLED 0
+#endif
+#define TDMA_TX_WINDOW 20
+#define TDMA_SYNC_TIMEOUT 120000
+static_assert(!(TDMA_ENABLED && (LOW_POWER || RELAY_ENABLED)), "low-power nodes and relays do not hear the beacons");
+
+// Sensor readings sent together in one frame, 1 sends every reading in its own frame
+#ifndef BATCH_MAX_READINGS
+#define BATCH_MAX_READINGS 1
+#endif
+// Longest time a reading waits in the batch before the batch is sent, in ms
+#define BATCH_MAX_AGE 10000
+// Plaintext of a batch frame, see wsn::Batch
+#define MAX_BATCH_PAYLOAD_SIZE wsn::batchSize(BATCH_MAX_READINGS)
+#if RELAY_ENABLED
+// A relay also queues the frames it forwards: the node ID in the clear, the relay header and a batch frame
+#define MAX_MSG_SIZE (1 + wsn::Relay::size + WSN_MAX_BATCH_SIZE + 1)
+#else
+#define MAX_MSG_SIZE (MAX_BATCH_PAYLOAD_SIZE + 1)
+#endif
+// Longest frame read from the radio, after the network ID and node ID
+#define MAX_RX_SIZE (RELAY_ENABLED ? wsn::Relay::size + WSN_MAX_BATCH_SIZE + 1 : MAX_ENC_PAYLOAD_SIZE)
+static_assert(MAX_BATCH_PAYLOAD_SIZE <= WSN_MAX_BATCH_SIZE, "batches of BATCH_MAX_READINGS do not fit the gateway");
+
+// A network scan (a broadcast status request) gives the number of response slots and their length in units
+// of SCAN_SLOT_UNIT ms, the node answers in slot (nodeID - 1) modulo the number of slots, or in its TDMA
+// slot. TDMA slots come in the same unit
+#define SCAN_SLOT_UNIT 10
 
 #define BROADCAST_ID 0xFF
 
+// Actuator ID that selects the modem profile instead of an output pin
+#define MODEM_PROFILE_ACT_ID 250
+#define N_MODEM_PROFILES 5
+// Modem profile recovery, for gateways with ADR_ENABLED: a node that gives up PROFILE_SCAN_FAILURES sensor
+// messages in a row without hearing from the gateway moves on to the next modem profile, until it finds the
+// one the network uses. This brings back a node that rebooted onto the compile-time profile, or that missed
+// a profile change
+#ifndef PROFILE_SCAN_ENABLED
+#define PROFILE_SCAN_ENABLED 0
+#endif
+#define PROFILE_SCAN_FAILURES 4
+// Actuator ID that dumps the latency trace on the serial port, the command is only acked without TRACE_ENABLED
+#define TRACE_DUMP_ACT_ID 251
+
+// Latency tracing: TRACE(stage) measures the rest of the enclosing block and keeps the last TRACE_RING_SIZE
+// measurements (see wsn_trace.h). Compiled out unless TRACE_ENABLED is set
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 0
+#endif
+#define TRACE_RING_SIZE 32
+#if TRACE_ENABLED
+#define TRACE(stage) wsn::TraceScope<TRACE_RING_SIZE> WSN_TRACE_NAME(__LINE__)(traceRing, wsn::stage)
+#else
+#define TRACE(stage)
+#endif
+
+// Logging: the LOG_<level> calls up to LOG_LEVEL store binary records in a buffer of LOG_BUFFER_SIZE bytes
+// that the loop sends on the serial port without blocking (see wsn_log.h), the others are compiled out.
+// Read the port with network_manager/src/log_decoder.py
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+#define LOG_BUFFER_SIZE 64
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logBuffer.log(__VA_ARGS__)
+#else
+#define LOG_ERROR(...)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) logBuffer.log(__VA_ARGS__)
+#else
+#define LOG_WARN(...)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) logBuffer.log(__VA_ARGS__)
+#else
+#define LOG_INFO(...)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logBuffer.log(__VA_ARGS__)
+#else
+#define LOG_DEBUG(...)
+#endif
+static_assert(!TRACE_ENABLED || LOG_LEVEL >= LOG_LEVEL_INFO, "the trace dump is sent as INFO log records");
+
+/**
+ * @brief Log events and their arguments, network_manager/src/log_decoder.py keeps the same table
+ *
+ */
+enum LogEvent : byte {
+  LOG_STARTUP = 1,            // INFO
+  LOG_LORA_INIT_FAILED = 2,   // ERROR
+  LOG_MOTION = 3,             // DEBUG sensorID
+  LOG_ACK_QUEUED = 4,         // DEBUG msgID
+  LOG_STATUS_QUEUED = 5,      // DEBUG msgID
+  LOG_ACTUATOR = 6,           // INFO actID, value
+  LOG_SENSOR_QUEUED = 7,      // DEBUG msgID, VBAT (tenths of V)
+  LOG_BATCH_QUEUED = 8,       // DEBUG msgID of the first reading, readings
+  LOG_SEND_FAILED = 9,        // WARN msgID
+  LOG_SENT = 10,              // DEBUG msgID, flag
+  LOG_DELIVERED = 11,         // DEBUG msgID
+  LOG_FRAME = 12,             // DEBUG network ID, node ID, length
+  LOG_MSG = 13,               // DEBUG flag, msgID, RSSI (int16_t dBm), SNR (float dB)
+  LOG_TRACE = 14,             // INFO stage, duration (uint32_t us)
+  LOG_TRACE_END = 15,         // INFO
+  LOG_RELAY_UP = 16,          // DEBUG node ID, hops
+  LOG_RELAY_DOWN = 17,        // DEBUG node ID
+  LOG_RELAY_PRUNED = 18,      // DEBUG node ID
+  LOG_RELAY_NO_ROUTE = 19,    // WARN node ID
+  LOG_TDMA_SYNC = 20,         // DEBUG offset to the gateway (int32_t ms), slots
+  LOG_TDMA_LOST = 21,         // WARN
+  LOG_PROFILE_SCAN = 22       // WARN modem profile
+};
+
 // Broadcast Encryption key
 const uint8_t keyBroadcast[] = { //
   0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
@@ -74,32 +253,132 @@ typedef struct strPayload {
  * 
  */
 typedef struct strMsg {
-  byte msg[MAX_ENC_PAYLOAD_SIZE];
+  byte msg[MAX_MSG_SIZE];
+  byte len;
   byte msgID;
   char flag;
 } Msg;
 
-extern int currMsg;
-extern int count;
+/**
+ * @brief Route of a relay to a node it heard: via is the relay the node's frames came through, 0 if the
+ *        relay hears the node itself. tag (the first bytes of the ciphertext) and forwarded identify the
+ *        last frame of the node forwarded
+ * 
+ */
+typedef struct strRoute {
+  byte nodeID;
+  byte via;
+  uint16_t tag;
+  unsigned long lastSeen;
+  unsigned long forwarded;
+  unsigned long prunedAt;
+  bool pruned;
+  bool used;
+} Route;
+
+/**
+ * @brief Sensor reading waiting in the batch, t is the time it was taken in milliseconds since boot
+ * 
+ */
+typedef struct strReading {
+  byte sensorID;
+  byte sensorVal;
+  unsigned long t;
+} Reading;
+
+/**
+ * @brief Slot of the uplink window. Holds a sensor message waiting for its ack along with its own
+ *        retransmission counter and timer
+ * 
+ */
+typedef struct strInFlight {
+  Msg msg;
+  byte count;
+  unsigned long sentMil;
+  unsigned long wait;
+  bool used;
+} InFlight;
+
+extern InFlight window[UPLINK_WINDOW];
+extern Reading batch[BATCH_MAX_READINGS];
+extern int batchCount;
 extern unsigned long prevMil;
-extern unsigned long prevMilSU;
 extern int msgCount;
+extern int curSpreadingFactor;
+extern long curSignalBandwidth;
+extern int curCodingRateDenominator;
+extern long airtimeBudget;
+extern unsigned long rxWindowEnd;
+extern volatile bool cadDone;
+extern volatile bool cadBusy;
+extern unsigned long prevMilDC;
+extern int pendingProfile;
+extern byte pendingProfileMsgID;
+extern byte curProfile;
+extern byte failedUplinks;
+extern bool scanReplyPending;
+extern unsigned long scanReplyAt;
+extern byte scanReplyMsgID;
+extern Route routes[RELAY_ROUTES];
+extern long tdmaOffset;
+extern unsigned long tdmaTime;
+extern unsigned long tdmaSlotLen;
+extern byte tdmaSlots;
+extern unsigned long tdmaSyncedAt;
+extern bool tdmaSynced;
 
 extern cppQueue msg_q;
-extern aes256_context ctxt;
+extern aes256_context ctxtNode;
+extern aes256_context ctxtBroadcast;
+#if TRACE_ENABLED
+extern wsn::TraceRing<TRACE_RING_SIZE> traceRing;
+extern bool traceDumpPending;
+#endif
+#if LOG_LEVEL > LOG_LEVEL_NONE
+extern wsn::LogBuffer<LOG_BUFFER_SIZE> logBuffer;
+#endif
 
 void LoRa_rxMode();
-void LoRa_txMode();
-void LoRa_sendMessage(byte *message);
-char  *decryptMsg(char msg[MAX_PAYLOAD_SIZE+1]);
+bool LoRa_txMode(bool toNode);
+bool LoRa_sendMessage(byte *message, byte len);
+bool LoRa_sendFrame(const byte *head, byte headLen, const byte *body, byte len, bool toNode);
+void onCadDone(boolean detected);
+bool rxWindowOpen(unsigned long currentMillis);
+unsigned long timeToNextEvent(unsigned long currentMillis);
+void lowPowerSleep(unsigned long ms);
+char  *decryptMsg(aes256_context *ctxt, char msg[MAX_PAYLOAD_SIZE+1]);
 void onReceive(int packetSize);
 void onTxDone();
-byte *encrypt(char msg[MAX_PAYLOAD_SIZE]);
+byte *encrypt(aes256_context *ctxt, const byte msg[BLOCK_SIZE]);
+void initKeySchedules();
 void sendSensorData(byte sensorID, byte sensorVal);
+void sendBatch();
+void checkBatch(unsigned long currentMillis);
 void getMsgFromQueueAndSend(unsigned long currentMillis);
+void ackWindow(byte msgID, byte mask);
+void buildStatus(Msg *msg, byte msgID);
 void sendStatus(byte msgID);
+void sendScanReply(unsigned long currentMillis);
 void sendAck(byte msgID);
 void setActState(int ID, int val);
+void setModem(int sf, long bw, int crd);
+unsigned long timeOnAir(byte len);
+unsigned long retryTimeout(byte len);
+unsigned long retryWait(byte len, byte count);
+void refillAirtime(unsigned long currentMillis);
+long remainingAirtime();
 int mymin(int a, int b);
+bool relayFrame(byte *rnID, byte *frame, int *len);
+void relayUplink(byte srcID, byte via, byte hops, const byte *frame, int len, unsigned long currentMillis);
+void relayDownlink(byte destID, const byte *frame, int len);
+void relayPrune(byte destID, unsigned long currentMillis);
+Route *findRoute(byte destID);
+Route *addRoute(byte destID);
+void tdmaSync(const byte *plain, int packetSize, unsigned long rxMillis);
+bool tdmaSlotOpen(unsigned long currentMillis);
+unsigned long tdmaWait(unsigned long currentMillis);
+#if TRACE_ENABLED
+void traceDump();
+#endif
 
 #endif
@@ -11,7 +11,7 @@
  */
 
 #include "comms_protocol.h"
-int motionState = 0;
+int motionState[sensN];
 long t1;
 long t2;
 
@@ -38,22 +38,24 @@ void setup() {
   LoRa.setPins(SS, RST, DIO0);
   
   if (!LoRa.begin(frequency)) {
-    Serial.println("LoRa init failed.");
+    LOG_ERROR(LOG_LORA_INIT_FAILED);
+    #if LOG_LEVEL > LOG_LEVEL_NONE
+      logBuffer.flush(Serial);
+    #endif
     while (true);
   }
 
-  LoRa.setSpreadingFactor(spreadingFactor);
-  LoRa.setCodingRate4(codingRateDenominator);
-  LoRa.setSignalBandwidth(signalBandwidth);
+  setModem(spreadingFactor, signalBandwidth, codingRateDenominator);
 
   LoRa.setSyncWord(netID);
   LoRa.enableCrc();
   LoRa_rxMode();
 
+  initKeySchedules();
+
   prevMil = millis();
-  prevMilSU = millis();
   
-  Serial.println("Node startup complete");
+  LOG_INFO(LOG_STARTUP);
 }
 
 
@@ -61,42 +63,59 @@ void setup() {
  * @brief Arduino loop function
  * 
  * Main loop function. checks for incoming uplink messages and downlink requests from the server.
- * calls getMsgFromQueueAndSend on fixed schedules to avoid congestion of the communication channel
- * and sends an uplink message with the node status periodically.
+ * calls getMsgFromQueueAndSend at a fixed minimum spacing to avoid congestion of the communication channel.
+ * Answers a network scan in the slot of the node. Sends the pending log records as the serial port takes
+ * them.
  * 
  * @return void
  */
 void loop() {
   unsigned long currentMillis = millis();
 
-  // Receive Downlink msg
-  int packetSize = LoRa.parsePacket();
-  if (packetSize) {
-    onReceive(packetSize);
+  // Send the log records the serial port has room for
+  #if LOG_LEVEL > LOG_LEVEL_NONE
+    logBuffer.drain(Serial);
+  #endif
+
+  // Receive Downlink msg, in low-power mode only while the receive window is open
+  if (rxWindowOpen(currentMillis)) {
+    int packetSize = LoRa.parsePacket();
+    if (packetSize) {
+      onReceive(packetSize);
+    }
   }
 
+  // Answer a network scan in the slot of the node
+  sendScanReply(currentMillis);
+
   // Send Uplink msg
-  if((currentMillis-prevMil) > TIMEOUT_INTERVAL){
+  if((currentMillis-prevMil) > SEND_INTERVAL){
     getMsgFromQueueAndSend(currentMillis);
   }
 
-  // Send node status
-  if((currentMillis-prevMilSU) > STATUS_UPDATE_INTERVAL){
-    byte msgID = random(MAX_MSG_ID);
-    //sendStatus(msgID);
-    prevMilSU = currentMillis;
-  }
-
   // Send sensor data
   if(millis() > 30000){
-    int val = digitalRead(sensPin[0]);
-    if((val == 1) && (motionState == 0)){
-      Serial.println("motion detected");
-      sendSensorData(0, 1);
-      t1 = millis();
+    for(int i=0; i<sensN; i++){
+      int val = digitalRead(sensPin[i]);
+      if((val == 1) && (motionState[i] == 0)){
+        LOG_DEBUG(LOG_MOTION, (byte)i);
+        sendSensorData(i, 1);
+        t1 = millis();
+      }
+      motionState[i] = val;
     }
-    motionState = val;
   }
+  checkBatch(currentMillis);
+
+  #if TRACE_ENABLED
+    if (traceDumpPending)
+      traceDump();
+  #endif
+
+  #if LOW_POWER
+    if (!rxWindowOpen(millis()))
+      lowPowerSleep(timeToNextEvent(millis()));
+  #endif
 
   
 }
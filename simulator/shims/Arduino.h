@@ -0,0 +1,165 @@
+/**
+ * @file Arduino.h
+ * @brief Host stand-in for the Arduino core. Provides just enough of the core API (types, timing, GPIO,
+ *        String and Serial) for the node and gateway firmware to compile and run inside the simulator
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "sim_host.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef uint16_t word;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define LED_BUILTIN 2
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define PROGMEM
+#define F(s) (s)
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define memcpy_P memcpy
+#define sprintf_P sprintf
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+inline unsigned long millis() { return (unsigned long)(sim::host().micros() / 1000); }
+inline unsigned long micros() { return (unsigned long)sim::host().micros(); }
+inline void delay(unsigned long ms) { sim::host().delayMicros((uint64_t)ms * 1000); }
+inline void delayMicroseconds(unsigned int us) { sim::host().delayMicros(us); }
+
+inline long random(long howbig) { return howbig <= 0 ? 0 : sim::host().random(0, howbig); }
+inline long random(long howsmall, long howbig) { return howsmall >= howbig ? howsmall : sim::host().random(howsmall, howbig); }
+inline void randomSeed(unsigned long seed) { sim::host().randomSeed(seed); }
+
+inline void pinMode(uint8_t pin, uint8_t mode) { (void)pin; (void)mode; }
+inline int digitalRead(uint8_t pin) { return sim::host().digitalRead(pin); }
+inline void digitalWrite(uint8_t pin, uint8_t val) { sim::host().digitalWrite(pin, val); }
+inline int analogRead(uint8_t pin) { return sim::host().analogRead(pin); }
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+/**
+ * @brief Minimal Arduino String, backed by std::string
+ *
+ */
+class String {
+ public:
+  String() {}
+  String(const char *s) : s_(s ? s : "") {}
+  String(const std::string &s) : s_(s) {}
+  explicit String(char c) : s_(1, c) {}
+  explicit String(int v) : s_(std::to_string(v)) {}
+  explicit String(long v) : s_(std::to_string(v)) {}
+  explicit String(unsigned long v) : s_(std::to_string(v)) {}
+
+  unsigned int length() const { return (unsigned int)s_.size(); }
+  const char *c_str() const { return s_.c_str(); }
+  char charAt(unsigned int i) const { return i < s_.size() ? s_[i] : 0; }
+  char operator[](unsigned int i) const { return charAt(i); }
+  String substring(unsigned int from) const { return from < s_.size() ? String(s_.substr(from)) : String(); }
+  String substring(unsigned int from, unsigned int to) const {
+    return from < s_.size() && to > from ? String(s_.substr(from, to - from)) : String();
+  }
+  int indexOf(char c) const {
+    size_t i = s_.find(c);
+    return i == std::string::npos ? -1 : (int)i;
+  }
+  void toCharArray(char *buf, unsigned int bufsize) const {
+    if (!bufsize || !buf)
+      return;
+    unsigned int n = length() < bufsize - 1 ? length() : bufsize - 1;
+    memcpy(buf, s_.data(), n);
+    buf[n] = '\0';
+  }
+  void trim() {
+    size_t b = s_.find_first_not_of(" \t\r\n");
+    size_t e = s_.find_last_not_of(" \t\r\n");
+    s_ = b == std::string::npos ? std::string() : s_.substr(b, e - b + 1);
+  }
+
+  String &operator+=(const String &o) { s_ += o.s_; return *this; }
+  String &operator+=(const char *o) { s_ += o; return *this; }
+  String &operator+=(char c) { s_ += c; return *this; }
+  friend String operator+(String a, const String &b) { return a += b; }
+  bool operator==(const String &o) const { return s_ == o.s_; }
+  bool operator==(const char *o) const { return s_ == o; }
+
+ private:
+  std::string s_;
+};
+
+/**
+ * @brief Serial port stand-in. Output is timed at the configured baud rate by the running device,
+ *        input is whatever the simulator has queued for it
+ *
+ */
+class HardwareSerial {
+ public:
+  void begin(unsigned long baud) { sim::host().serialBegin(baud); }
+  void end() {}
+  operator bool() const { return true; }
+
+  int available() { return sim::host().serialAvailable(); }
+  int availableForWrite() { return sim::host().serialAvailableForWrite(); }
+  int read() { return sim::host().serialRead(); }
+  int peek() { return sim::host().serialPeek(); }
+  void flush() {}
+  void setTimeout(unsigned long ms) { sim::host().serialSetTimeout(ms); }
+  String readString();
+  String readStringUntil(char terminator);
+  size_t readBytes(char *buf, size_t n);
+
+  size_t write(uint8_t c) { sim::host().serialWrite(&c, 1); return 1; }
+  size_t write(const uint8_t *buf, size_t n) { sim::host().serialWrite(buf, n); return n; }
+  size_t write(const char *buf, size_t n) { return write((const uint8_t *)buf, n); }
+  size_t write(const char *s) { return write(s, strlen(s)); }
+
+  size_t print(const char *s) { return write(s); }
+  size_t print(const String &s) { return write(s.c_str(), s.length()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char v, int base = DEC) { return print((unsigned long)v, base); }
+  size_t print(int v, int base = DEC) { return print((long)v, base); }
+  size_t print(unsigned int v, int base = DEC) { return print((unsigned long)v, base); }
+  size_t print(long v, int base = DEC);
+  size_t print(unsigned long v, int base = DEC);
+  size_t print(double v, int digits = 2);
+
+  size_t println() { return write("\r\n"); }
+  template <typename T>
+  size_t println(const T &v) { size_t n = print(v); return n + println(); }
+  template <typename T>
+  size_t println(const T &v, int fmt) { size_t n = print(v, fmt); return n + println(); }
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,83 @@
+/**
+ * @file LoRa.h
+ * @brief Host stand-in for the arduino-LoRa library (sandeepmistry/arduino-LoRa). Keeps the public API of
+ *        LoRaClass and forwards every call to the simulated SX127x radio of the running device
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef LORA_H
+#define LORA_H
+
+#include <Arduino.h>
+#include <SPI.h>
+
+#define LORA_DEFAULT_SS_PIN 10
+#define LORA_DEFAULT_RESET_PIN 9
+#define LORA_DEFAULT_DIO0_PIN 2
+
+#define PA_OUTPUT_RFO_PIN 0
+#define PA_OUTPUT_PA_BOOST_PIN 1
+
+class LoRaClass {
+ public:
+  int begin(long frequency);
+  void end();
+
+  int beginPacket(int implicitHeader = false);
+  int endPacket(bool async = false);
+
+  int parsePacket(int size = 0);
+  int packetRssi();
+  float packetSnr();
+  long packetFrequencyError();
+  int rssi();
+
+  size_t write(uint8_t byte);
+  size_t write(const uint8_t *buffer, size_t size);
+  size_t print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+  size_t print(const String &s) { return write((const uint8_t *)s.c_str(), s.length()); }
+
+  int available();
+  int read();
+  int peek();
+  void flush() {}
+
+  void onReceive(void (*callback)(int));
+  void onTxDone(void (*callback)());
+  void onCadDone(void (*callback)(boolean));
+  void channelActivityDetection();
+
+  void receive(int size = 0);
+  void idle();
+  void sleep();
+
+  void setTxPower(int level, int outputPin = PA_OUTPUT_PA_BOOST_PIN);
+  void setFrequency(long frequency);
+  void setSpreadingFactor(int sf);
+  void setSignalBandwidth(long sbw);
+  void setCodingRate4(int denominator);
+  void setPreambleLength(long length);
+  void setSyncWord(int sw);
+  void enableCrc();
+  void disableCrc();
+  void enableInvertIQ();
+  void disableInvertIQ();
+  void setOCP(uint8_t mA) { (void)mA; }
+  void setGain(uint8_t gain) { (void)gain; }
+
+  byte random();
+
+  void setPins(int ss = LORA_DEFAULT_SS_PIN, int reset = LORA_DEFAULT_RESET_PIN, int dio0 = LORA_DEFAULT_DIO0_PIN) {
+    (void)ss; (void)reset; (void)dio0;
+  }
+  void setSPI(SPIClass &spi) { (void)spi; }
+  void setSPIFrequency(uint32_t frequency) { (void)frequency; }
+};
+
+extern LoRaClass LoRa;
+
+#endif
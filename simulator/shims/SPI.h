@@ -0,0 +1,26 @@
+/**
+ * @file SPI.h
+ * @brief Host stand-in for the Arduino SPI library. The simulated radio is not register mapped, so the
+ *        bus is a no-op
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SPI_H
+#define SPI_H
+
+#include <Arduino.h>
+
+class SPIClass {
+ public:
+  void begin() {}
+  void begin(int8_t sck, int8_t miso, int8_t mosi, int8_t ss) { (void)sck; (void)miso; (void)mosi; (void)ss; }
+  void end() {}
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,28 @@
+/**
+ * @file aes256.h
+ * @brief Host build of the byte-oriented AES-256 library (ilvn/aes256) used by the firmware. Same context
+ *        layout and on-the-fly key schedule, so host runs cost and behave like the boards
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef AES256_H
+#define AES256_H
+
+#include <stdint.h>
+
+typedef struct {
+  uint8_t key[32];
+  uint8_t enckey[32];
+  uint8_t deckey[32];
+} aes256_context;
+
+void aes256_init(aes256_context *ctx, const uint8_t *key);
+void aes256_done(aes256_context *ctx);
+void aes256_encrypt_ecb(aes256_context *ctx, uint8_t *buf);
+void aes256_decrypt_ecb(aes256_context *ctx, uint8_t *buf);
+
+#endif
@@ -0,0 +1,124 @@
+/**
+ * @file cppQueue.h
+ * @brief Host stand-in for the cppQueue library (SMFSW/Queue). Same API and semantics, but records are
+ *        kept inside the object instead of on the heap so a queue is part of the firmware state image
+ *        that the simulator swaps between virtual devices
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef CPPQUEUE_H
+#define CPPQUEUE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bytes of record storage available to every queue instance
+#ifndef CPPQUEUE_SIM_STORAGE
+#define CPPQUEUE_SIM_STORAGE 1024
+#endif
+
+typedef enum enumcppQueueType {
+  FIFO = 0,
+  LIFO = 1
+} cppQueueType;
+
+class cppQueue {
+ public:
+  cppQueue(const size_t size_rec, const uint16_t nb_recs = 20, const cppQueueType type = FIFO,
+           const bool overwrite = false, void *const pQDat = NULL, const size_t lenQDat = 0)
+      : rec_sz(size_rec), rec_nb(nb_recs), impl(type), ovw(overwrite), in(0), out(0), cnt(0) {
+    (void)pQDat;
+    (void)lenQDat;
+    if (size_rec * nb_recs > CPPQUEUE_SIM_STORAGE) {
+      fprintf(stderr, "cppQueue: %u records of %u bytes exceed CPPQUEUE_SIM_STORAGE (%u)\n",
+              (unsigned)nb_recs, (unsigned)size_rec, (unsigned)CPPQUEUE_SIM_STORAGE);
+      abort();
+    }
+  }
+
+  bool push(const void *const record) {
+    if (isFull()) {
+      if (!ovw)
+        return false;
+      if (impl == FIFO)
+        out = (out + 1) % rec_nb;
+      else
+        in = (in + rec_nb - 1) % rec_nb;
+      cnt--;
+    }
+    memcpy(&queue[in * rec_sz], record, rec_sz);
+    in = (in + 1) % rec_nb;
+    cnt++;
+    return true;
+  }
+
+  bool pop(void *const record) {
+    if (!peek(record))
+      return false;
+    return drop();
+  }
+
+  bool peek(void *const record) {
+    if (isEmpty())
+      return false;
+    memcpy(record, &queue[head() * rec_sz], rec_sz);
+    return true;
+  }
+
+  bool drop() {
+    if (isEmpty())
+      return false;
+    if (impl == FIFO)
+      out = (out + 1) % rec_nb;
+    else
+      in = (in + rec_nb - 1) % rec_nb;
+    cnt--;
+    return true;
+  }
+
+  bool peekIdx(void *const record, const uint16_t idx) {
+    if (idx + 1 > cnt)
+      return false;
+    uint16_t i = impl == FIFO ? (out + idx) % rec_nb : (in + rec_nb - 1 - idx) % rec_nb;
+    memcpy(record, &queue[i * rec_sz], rec_sz);
+    return true;
+  }
+
+  bool peekPrevious(void *const record) {
+    if (isEmpty())
+      return false;
+    memcpy(record, &queue[((in + rec_nb - 1) % rec_nb) * rec_sz], rec_sz);
+    return true;
+  }
+
+  void flush() { in = out = cnt = 0; }
+  void clean() { flush(); }
+
+  bool isInitialized() { return true; }
+  bool isEmpty() { return !cnt; }
+  bool isFull() { return cnt == rec_nb; }
+  uint32_t sizeOf() { return rec_sz * rec_nb; }
+  uint16_t getCount() { return cnt; }
+  uint16_t nbRecs() { return cnt; }
+  uint16_t getRemainingCount() { return rec_nb - cnt; }
+
+ private:
+  uint16_t head() const { return impl == FIFO ? out : (in + rec_nb - 1) % rec_nb; }
+
+  size_t rec_sz;
+  uint16_t rec_nb;
+  cppQueueType impl;
+  bool ovw;
+  uint16_t in;
+  uint16_t out;
+  uint16_t cnt;
+  uint8_t queue[CPPQUEUE_SIM_STORAGE];
+};
+
+#endif
@@ -0,0 +1,61 @@
+/**
+ * @file sim_host.h
+ * @brief Boundary between the Arduino/LoRa stand-in headers and the simulator. The stand-ins never keep
+ *        per-device state themselves, every call is forwarded to the virtual device whose firmware is running
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SIM_HOST_H
+#define SIM_HOST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace sim {
+
+class Radio;
+
+/**
+ * @brief Services a virtual device offers to the firmware running on it
+ *
+ */
+class Host {
+ public:
+  virtual ~Host() {}
+
+  virtual uint64_t micros() = 0;
+  virtual void delayMicros(uint64_t us) = 0;
+  virtual long random(long lo, long hi) = 0;
+  virtual void randomSeed(unsigned long seed) = 0;
+
+  virtual int digitalRead(uint8_t pin) = 0;
+  virtual void digitalWrite(uint8_t pin, uint8_t val) = 0;
+  virtual int analogRead(uint8_t pin) = 0;
+
+  virtual void serialBegin(unsigned long baud) = 0;
+  virtual void serialWrite(const uint8_t *buf, size_t n) = 0;
+  virtual int serialAvailable() = 0;
+  virtual int serialAvailableForWrite() = 0;
+  virtual int serialRead() = 0;
+  virtual int serialPeek() = 0;
+  virtual void serialSetTimeout(unsigned long ms) = 0;
+  virtual unsigned long serialTimeout() = 0;
+
+  virtual Radio &radio() = 0;
+};
+
+/**
+ * @brief Returns the device whose firmware is currently executing. Only valid while the simulator
+ *        is running a firmware call
+ *
+ * @return Host& the running device
+ */
+Host &host();
+
+}
+
+#endif
@@ -0,0 +1,78 @@
+/**
+ * @file arduino.cpp
+ * @brief Out-of-line parts of the Arduino core stand-in: Serial printing and the blocking String readers
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <Arduino.h>
+#include <SPI.h>
+
+HardwareSerial Serial;
+SPIClass SPI;
+
+size_t HardwareSerial::print(long v, int base) {
+  if (base == DEC)
+    return print(String(v));
+  return print((unsigned long)v, base);
+}
+
+size_t HardwareSerial::print(unsigned long v, int base) {
+  char buf[8 * sizeof(long) + 1];
+  char *p = &buf[sizeof(buf) - 1];
+  *p = '\0';
+  if (base < 2)
+    base = DEC;
+  do {
+    int d = v % base;
+    *--p = d < 10 ? '0' + d : 'A' + d - 10;
+    v /= base;
+  } while (v);
+  return write(p);
+}
+
+size_t HardwareSerial::print(double v, int digits) {
+  char buf[48];
+  snprintf(buf, sizeof(buf), "%.*f", digits, v);
+  return write(buf);
+}
+
+/**
+ * @brief Stream::readString reads until no byte arrives for the stream timeout, so the call always
+ *        returns one timeout after the last byte
+ *
+ * @return String every byte that was available
+ */
+String HardwareSerial::readString() {
+  std::string s;
+  int c;
+  while ((c = read()) >= 0)
+    s += (char)c;
+  sim::host().delayMicros((uint64_t)sim::host().serialTimeout() * 1000);
+  return String(s);
+}
+
+String HardwareSerial::readStringUntil(char terminator) {
+  std::string s;
+  int c;
+  while ((c = read()) >= 0) {
+    if (c == terminator)
+      return String(s);
+    s += (char)c;
+  }
+  sim::host().delayMicros((uint64_t)sim::host().serialTimeout() * 1000);
+  return String(s);
+}
+
+size_t HardwareSerial::readBytes(char *buf, size_t n) {
+  size_t i = 0;
+  int c;
+  while (i < n && (c = read()) >= 0)
+    buf[i++] = (char)c;
+  if (i < n)
+    sim::host().delayMicros((uint64_t)sim::host().serialTimeout() * 1000);
+  return i;
+}
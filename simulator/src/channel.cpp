@@ -0,0 +1,253 @@
+/**
+ * @file channel.cpp
+ * @brief Shared air channel
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "channel.h"
+
+#include <math.h>
+#include <wsn_codec.h>
+
+#include "device.h"
+#include "radio.h"
+#include "simulator.h"
+
+namespace sim {
+
+const char *outcomeName(Outcome o) {
+  switch (o) {
+    case Outcome::Delivered: return "delivered";
+    case Outcome::Collided: return "collision";
+    case Outcome::Weak: return "below sensitivity";
+    case Outcome::NotListening: return "receiver not listening";
+    case Outcome::Busy: return "receiver busy";
+    case Outcome::Mismatch: return "modem mismatch";
+    case Outcome::Aborted: return "reception aborted";
+    default: return "?";
+  }
+}
+
+Channel::Channel(Simulator &sim, const LinkModel &link)
+    : sim_(sim), link_(link), nextId_(0), longest_(0), airtime_(0), cadChecks_(0), cadBusy_(0) {}
+
+void Channel::attach(Radio &radio) {
+  radios_.push_back(&radio);
+}
+
+/**
+ * @brief Puts a frame on the air. Every radio that is listening with matching settings and hears the
+ *        frame above its demodulation floor locks onto it; intended receivers that do not are recorded
+ *        with the reason
+ *
+ * @param sender radio transmitting the frame
+ * @param frame frame bytes
+ * @param start time the preamble starts, in microseconds
+ */
+void Channel::transmit(Radio &sender, const std::vector<uint8_t> &frame, uint64_t start) {
+  auto tx = std::make_shared<Transmission>();
+  tx->id = nextId_++;
+  tx->sender = &sender;
+  tx->modem = sender.modem();
+  tx->frame = frame;
+  tx->start = start;
+  tx->end = start + timeOnAirMicros(tx->modem, frame.size());
+
+  uint64_t toa = tx->end - tx->start;
+  airtime_ += toa;
+  if (toa > longest_)
+    longest_ = toa;
+
+  FrameStats &stats = goesDown(*tx) ? downlink_ : uplink_;
+  stats.sent++;
+
+  for (Radio *r : radios_) {
+    if (r == &sender)
+      continue;
+    bool want = intended(*tx, *r);
+    if (want)
+      stats.expected++;
+
+    Outcome miss;
+    if (!r->receiving() || r->transmitting(start)) {
+      miss = Outcome::NotListening;
+    } else if (r->busy()) {
+      miss = Outcome::Busy;
+    } else if (!r->modem().canHear(tx->modem)) {
+      miss = Outcome::Mismatch;
+    } else {
+      double p = rssi(*tx, *r);
+      if (snr(*r, p) < demodulationFloorDb(tx->modem.spreadingFactor)) {
+        miss = Outcome::Weak;
+      } else {
+        tx->receptions.push_back({r, p, false});
+        r->lock(*tx, tx->receptions.size() - 1);
+        continue;
+      }
+    }
+    if (want)
+      tx->missed.push_back({r, miss});
+  }
+
+  recent_.push_back(tx);
+  sim_.schedule(tx->end, EventKind::FrameEnd, nullptr, tx);
+}
+
+/**
+ * @brief Resolves a frame at its end. A locked reception survives if its power exceeds the summed
+ *        power of all overlapping frames on the same SF and bandwidth by the capture threshold
+ *
+ * @param tx frame that just ended
+ */
+void Channel::finish(const std::shared_ptr<Transmission> &tx) {
+  for (Reception &rc : tx->receptions) {
+    Radio *r = rc.radio;
+    r->release(*tx);
+
+    Outcome o = Outcome::Delivered;
+    if (rc.aborted) {
+      o = Outcome::Aborted;
+    } else {
+      double interference = 0;
+      for (const auto &other : recent_) {
+        if (other == tx || other->sender == r)
+          continue;
+        if (other->start >= tx->end || other->end <= tx->start)
+          continue;
+        if (!tx->modem.collidesWith(other->modem))
+          continue;
+        interference += pow(10.0, rssi(*other, *r) / 10.0);
+      }
+      if (interference > 0 && rc.rssi - 10.0 * log10(interference) < link_.captureThreshold)
+        o = Outcome::Collided;
+      else
+        r->deliver(*tx, rc.rssi, snr(*r, rc.rssi));
+    }
+    if (intended(*tx, *r))
+      tally(*tx, o);
+  }
+  for (const auto &m : tx->missed)
+    tally(*tx, m.second);
+
+  while (!recent_.empty() && recent_.front()->end + longest_ < tx->end)
+    recent_.pop_front();
+}
+
+/**
+ * @brief Channel activity detection: whether a radio hears a frame on its own SF, bandwidth and IQ
+ *        polarity, above its demodulation floor, during the given interval
+ *
+ * @param radio radio doing the detection
+ * @param from start of the detection, in microseconds
+ * @param to end of the detection, in microseconds
+ * @return true if the channel is busy
+ */
+bool Channel::activity(const Radio &radio, uint64_t from, uint64_t to) {
+  cadChecks_++;
+  for (const auto &tx : recent_) {
+    if (tx->sender == &radio || tx->start >= to || tx->end <= from)
+      continue;
+    if (!radio.modem().collidesWith(tx->modem) || radio.modem().invertIQ != tx->modem.invertIQ)
+      continue;
+    if (snr(radio, rssi(*tx, radio)) >= demodulationFloorDb(tx->modem.spreadingFactor)) {
+      cadBusy_++;
+      return true;
+    }
+  }
+  return false;
+}
+
+double Channel::rssi(const Transmission &tx, const Radio &to) const {
+  const Device &a = tx.sender->owner();
+  const Device &b = to.owner();
+  double d = hypot(a.x() - b.x(), a.y() - b.y());
+  if (d < 1.0)
+    d = 1.0;
+  double loss = link_.referenceLoss + 10.0 * link_.exponent * log10(d) + shadowing(a.uid(), b.uid());
+  return tx.modem.txPower - loss;
+}
+
+double Channel::snr(const Radio &to, double rssi) const {
+  return rssi - noiseFloorDbm(to.modem().signalBandwidth, link_.noiseFigure);
+}
+
+/**
+ * @brief Whether a frame is meant for a radio: uplinks for the gateway of their network, downlinks for
+ *        the node they are addressed to and relay frames going down for the relay in their header
+ *
+ * @param tx frame on the air
+ * @param radio receiving radio
+ * @return true if the radio should receive the frame
+ */
+bool Channel::intended(const Transmission &tx, const Radio &radio) const {
+  const Device &from = tx.sender->owner();
+  const Device &to = radio.owner();
+  if (from.netID() != to.netID())
+    return false;
+  if (!goesDown(tx))
+    return to.role() == Role::Gateway;
+  uint8_t dest = tx.frame.size() > 1 ? tx.frame[1] : 0;
+  if (dest == WSN_RELAY_FRAME)
+    return to.role() == Role::Relay && tx.frame.size() > 3 && tx.frame[3] == to.address();
+  if (to.role() != Role::Node)
+    return false;
+  return dest == 0xFF || dest == to.address();
+}
+
+/**
+ * @brief Whether a frame goes away from the gateway: everything the gateway sends, and what relays send
+ *        to nodes, with inverted IQ, or to other relays, as relay frames marked wsn::RELAY_DOWN
+ *
+ * @param tx frame on the air
+ * @return true for downlinks, false for uplinks
+ */
+bool Channel::goesDown(const Transmission &tx) const {
+  switch (tx.sender->owner().role()) {
+    case Role::Gateway:
+      return true;
+    case Role::Relay:
+      return tx.modem.invertIQ || (tx.frame.size() > 2 && tx.frame[1] == WSN_RELAY_FRAME && (tx.frame[2] & wsn::RELAY_DOWN));
+    default:
+      return false;
+  }
+}
+
+void Channel::tally(const Transmission &tx, Outcome outcome) {
+  FrameStats &stats = goesDown(tx) ? downlink_ : uplink_;
+  stats.outcomes[(int)outcome]++;
+}
+
+/**
+ * @brief Static shadowing of the link between two devices, symmetric and reproducible for a given seed
+ *
+ * @param a unique id of one end of the link
+ * @param b unique id of the other end
+ * @return double shadowing in dB
+ */
+double Channel::shadowing(int a, int b) const {
+  if (link_.shadowingSigma <= 0)
+    return 0;
+  if (a > b) {
+    int t = a;
+    a = b;
+    b = t;
+  }
+  uint64_t z = link_.seed ^ ((uint64_t)a << 32) ^ (uint64_t)b;
+  auto next = [&z]() {
+    z += 0x9e3779b97f4a7c15ULL;
+    uint64_t x = z;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return (double)((x ^ (x >> 31)) >> 11) / 9007199254740992.0;
+  };
+  double u1 = next(), u2 = next();
+  if (u1 < 1e-12)
+    u1 = 1e-12;
+  return link_.shadowingSigma * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+}
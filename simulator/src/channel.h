@@ -0,0 +1,134 @@
+/**
+ * @file channel.h
+ * @brief Shared air channel. Propagates every transmitted frame to all radios, decides which ones lock
+ *        onto it, and at the end of the frame resolves collisions with the capture effect
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SIM_CHANNEL_H
+#define SIM_CHANNEL_H
+
+#include <stdint.h>
+#include <deque>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "modem.h"
+
+namespace sim {
+
+class Radio;
+class Simulator;
+
+/**
+ * @brief Fate of a frame at one of its intended receivers
+ *
+ */
+enum class Outcome {
+  Delivered,     ///< decoded without errors
+  Collided,      ///< corrupted by an overlapping frame on the same SF and bandwidth
+  Weak,          ///< below the demodulation floor
+  NotListening,  ///< receiver was transmitting, idle or asleep when the preamble arrived
+  Busy,          ///< receiver was already locked on another frame
+  Mismatch,      ///< receiver modem settings differ from the transmitter's
+  Aborted,       ///< receiver left receive mode before the frame ended
+  Count
+};
+
+const char *outcomeName(Outcome o);
+
+/**
+ * @brief A radio locked on a frame
+ *
+ */
+struct Reception {
+  Radio *radio;
+  double rssi;
+  bool aborted;
+};
+
+/**
+ * @brief A frame on the air
+ *
+ */
+struct Transmission {
+  uint64_t id;
+  Radio *sender;
+  ModemConfig modem;
+  std::vector<uint8_t> frame;
+  uint64_t start;
+  uint64_t end;
+  std::vector<Reception> receptions;
+  std::vector<std::pair<Radio *, Outcome>> missed;
+};
+
+/**
+ * @brief Log-distance path loss with static log-normal shadowing per link
+ *
+ */
+struct LinkModel {
+  double referenceLoss = 40.0;     ///< path loss at 1 m, in dB
+  double exponent = 2.7;           ///< path loss exponent
+  double shadowingSigma = 4.0;     ///< standard deviation of the shadowing, in dB
+  double captureThreshold = 6.0;   ///< power margin a frame needs over the interference to survive, in dB
+  double noiseFigure = 6.0;        ///< receiver noise figure, in dB
+  uint64_t seed = 1;
+};
+
+/**
+ * @brief Frame counters for one direction of traffic
+ *
+ */
+struct FrameStats {
+  uint64_t sent = 0;
+  uint64_t expected = 0;
+  uint64_t outcomes[(int)Outcome::Count] = {};
+
+  uint64_t delivered() const { return outcomes[(int)Outcome::Delivered]; }
+};
+
+class Channel {
+ public:
+  Channel(Simulator &sim, const LinkModel &link);
+
+  void attach(Radio &radio);
+  void transmit(Radio &sender, const std::vector<uint8_t> &frame, uint64_t start);
+  void finish(const std::shared_ptr<Transmission> &tx);
+  bool activity(const Radio &radio, uint64_t from, uint64_t to);
+
+  double rssi(const Transmission &tx, const Radio &to) const;
+  double snr(const Radio &to, double rssi) const;
+
+  const FrameStats &uplink() const { return uplink_; }
+  const FrameStats &downlink() const { return downlink_; }
+  uint64_t airtimeMicros() const { return airtime_; }
+  uint64_t cadChecks() const { return cadChecks_; }
+  uint64_t cadBusy() const { return cadBusy_; }
+
+ private:
+  bool intended(const Transmission &tx, const Radio &radio) const;
+  bool goesDown(const Transmission &tx) const;
+  void tally(const Transmission &tx, Outcome outcome);
+  double shadowing(int a, int b) const;
+
+  Simulator &sim_;
+  LinkModel link_;
+  std::vector<Radio *> radios_;
+  std::deque<std::shared_ptr<Transmission>> recent_;
+  uint64_t nextId_;
+  uint64_t longest_;
+  uint64_t airtime_;
+  uint64_t cadChecks_;
+  uint64_t cadBusy_;
+  FrameStats uplink_;
+  FrameStats downlink_;
+};
+
+}
+
+#endif
@@ -0,0 +1,255 @@
+/**
+ * @file device.cpp
+ * @brief Virtual node or gateway
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "device.h"
+
+#include <stdio.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server_link.h"
+#include "simulator.h"
+
+// Bytes the UART transmit buffer holds before Serial.write blocks
+#define SERIAL_TX_BUFFER 64
+
+namespace sim {
+
+static Device *current = nullptr;
+
+Host &host() {
+  if (!current) {
+    fprintf(stderr, "firmware call outside of a simulated device\n");
+    abort();
+  }
+  return *current;
+}
+
+/**
+ * @brief Saves the state section as the power-on image of every device, and checks that the linker
+ *        really placed the firmware globals inside it
+ *
+ */
+void FirmwareImage::capturePristine() {
+  for (const void *const *p = probes; *p; p++) {
+    const uint8_t *addr = (const uint8_t *)*p;
+    if (addr < stateBegin || addr >= stateEnd) {
+      fprintf(stderr, "%s image: firmware global at %p is outside the state section [%p, %p)\n", name,
+              (const void *)addr, (void *)stateBegin, (void *)stateEnd);
+      abort();
+    }
+  }
+  pristine.assign(stateBegin, stateEnd);
+}
+
+Device::Device(Simulator &sim, FirmwareImage &image, Role role, int uid, uint8_t netID, uint8_t address,
+               double x, double y, uint64_t seed)
+    : sim_(sim), image_(image), role_(role), uid_(uid), netID_(netID), address_(address), x_(x), y_(y),
+      state_(image.pristine), booted_(false), callStart_(0), advance_(0), busyUntil_(0), minAirtime_(LONG_MAX), rng_(seed),
+      serialByteMicros_(0), serialDrainUntil_(0), serialBytesOut_(0), serialTimeout_(1000), radio_(*this) {
+  memset(pins_, 0, sizeof(pins_));
+}
+
+/**
+ * @brief Runs one firmware step on this device: setup() the first time, then pending radio interrupts
+ *        followed by loop(). Time spent blocked inside the firmware (transmissions, serial output,
+ *        delays) moves the device clock forward and keeps the device busy until then
+ *
+ * @param now simulation time the step starts at, in microseconds
+ */
+void Device::run(uint64_t now) {
+  callStart_ = now;
+  advance_ = 0;
+  activate();
+
+  int before = image_.uplinkCount ? image_.uplinkCount() : 0;
+  if (!booted_) {
+    image_.configure(netID_, address_);
+    image_.setup();
+    booted_ = true;
+    sim_.onBoot(*this);
+  } else {
+    radio_.dispatchInterrupts(micros());
+    image_.loop();
+  }
+  if (image_.remainingAirtime) {
+    long left = image_.remainingAirtime();
+    if (left < minAirtime_)
+      minAirtime_ = left;
+  }
+  if (image_.uplinkCount) {
+    int after = image_.uplinkCount();
+    for (int c = before + 1; c <= after; c++)
+      sim_.onUplinkCreated(*this, (uint8_t)c, now);
+  }
+
+  busyUntil_ = callStart_ + advance_;
+  current = nullptr;
+}
+
+/**
+ * @brief Runs the radio interrupt handlers of the firmware at the given time, also while the device is
+ *        blocked in a step, as the DIO0 interrupt preempts whatever the firmware is doing
+ *
+ * @param t time of the interrupt, in microseconds
+ */
+void Device::isr(uint64_t t) {
+  uint64_t start = callStart_;
+  uint64_t advance = advance_;
+  callStart_ = t;
+  advance_ = 0;
+  activate();
+  radio_.dispatchInterrupts(t);
+  callStart_ = start;
+  advance_ = advance;
+  current = nullptr;
+}
+
+/**
+ * @brief Runs fn with this device's firmware state resident and the device clock at now, so that fn can call
+ *        single firmware functions as if from the device's loop. Used by the host tests
+ *
+ * @param now time of the call, in microseconds
+ * @param fn code to run
+ */
+void Device::call(uint64_t now, const std::function<void()> &fn) {
+  callStart_ = now;
+  advance_ = 0;
+  activate();
+  fn();
+  busyUntil_ = callStart_ + advance_;
+  current = nullptr;
+}
+
+void Device::setPin(uint8_t pin, int level) {
+  pins_[pin % 64] = level ? 1 : 0;
+}
+
+void Device::queueSerialInput(const std::string &data) {
+  serialIn_.insert(serialIn_.end(), data.begin(), data.end());
+}
+
+/**
+ * @brief Makes this device's firmware state resident, saving the state of the previous resident
+ *
+ */
+void Device::activate() {
+  if (image_.resident != this) {
+    if (image_.resident)
+      memcpy(image_.resident->state_.data(), image_.stateBegin, image_.stateSize());
+    memcpy(image_.stateBegin, state_.data(), image_.stateSize());
+    image_.resident = this;
+  }
+  current = this;
+}
+
+uint64_t Device::micros() {
+  return callStart_ + advance_;
+}
+
+void Device::delayMicros(uint64_t us) {
+  advance_ += us;
+}
+
+long Device::random(long lo, long hi) {
+  return std::uniform_int_distribution<long>(lo, hi - 1)(rng_);
+}
+
+void Device::randomSeed(unsigned long seed) {
+  rng_.seed(seed);
+}
+
+int Device::digitalRead(uint8_t pin) {
+  return pins_[pin % 64];
+}
+
+void Device::digitalWrite(uint8_t pin, uint8_t val) {
+  pins_[pin % 64] = val;
+}
+
+int Device::analogRead(uint8_t pin) {
+  (void)pin;
+  return 0;
+}
+
+void Device::serialBegin(unsigned long baud) {
+  serialByteMicros_ = baud ? 10e6 / baud : 0;
+}
+
+/**
+ * @brief Serial output at the configured baud rate. Bytes drain one frame time apart; the caller only
+ *        blocks once the transmit buffer is full. Completed lines, or binary frames converted to lines, are
+ *        handed to the simulator with the time their last byte leaves the UART
+ *
+ * @param buf bytes to send
+ * @param n number of bytes
+ */
+void Device::serialWrite(const uint8_t *buf, size_t n) {
+  uint64_t t = micros();
+  double start = serialDrainUntil_ > t ? serialDrainUntil_ : t;
+  serialBytesOut_ += n;
+
+  for (size_t i = 0; i < n; i++) {
+    if (image_.binarySerial && buf[i] == 0) {
+      sim_.onSerialLine(*this, decodeServerFrame(serialLine_), (uint64_t)(start + (i + 1) * serialByteMicros_));
+      serialLine_.clear();
+    } else if (!image_.binarySerial && buf[i] == '\n') {
+      sim_.onSerialLine(*this, serialLine_, (uint64_t)(start + (i + 1) * serialByteMicros_));
+      serialLine_.clear();
+    } else if (image_.binarySerial || buf[i] != '\r') {
+      serialLine_ += (char)buf[i];
+    }
+  }
+
+  serialDrainUntil_ = (uint64_t)(start + n * serialByteMicros_);
+  double unblock = serialDrainUntil_ - SERIAL_TX_BUFFER * serialByteMicros_;
+  if (unblock > t)
+    advance_ += (uint64_t)(unblock - t);
+}
+
+int Device::serialAvailable() {
+  return (int)serialIn_.size();
+}
+
+/**
+ * @brief Free space in the transmit buffer, what can be written without blocking
+ *
+ */
+int Device::serialAvailableForWrite() {
+  uint64_t t = micros();
+  if (serialDrainUntil_ <= t || serialByteMicros_ <= 0)
+    return SERIAL_TX_BUFFER;
+  int pending = (int)ceil((serialDrainUntil_ - t) / serialByteMicros_);
+  return pending >= SERIAL_TX_BUFFER ? 0 : SERIAL_TX_BUFFER - pending;
+}
+
+int Device::serialRead() {
+  if (serialIn_.empty())
+    return -1;
+  int c = serialIn_.front();
+  serialIn_.pop_front();
+  return c;
+}
+
+int Device::serialPeek() {
+  return serialIn_.empty() ? -1 : serialIn_.front();
+}
+
+void Device::serialSetTimeout(unsigned long ms) {
+  serialTimeout_ = ms;
+}
+
+unsigned long Device::serialTimeout() {
+  return serialTimeout_;
+}
+
+}
@@ -0,0 +1,113 @@
+/**
+ * @file device.h
+ * @brief Virtual node or gateway. Owns the device's copy of the firmware state, its radio, GPIO levels,
+ *        serial port and random generator, and keeps the device clock while its firmware runs
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SIM_DEVICE_H
+#define SIM_DEVICE_H
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sim_host.h>
+
+#include "firmware_image.h"
+#include "radio.h"
+
+namespace sim {
+
+class Simulator;
+
+enum class Role {
+  Node,
+  Relay,
+  Gateway
+};
+
+class Device : public Host {
+ public:
+  Device(Simulator &sim, FirmwareImage &image, Role role, int uid, uint8_t netID, uint8_t address,
+         double x, double y, uint64_t seed);
+
+  Simulator &simulator() const { return sim_; }
+  FirmwareImage &image() const { return image_; }
+  Role role() const { return role_; }
+  int uid() const { return uid_; }
+  uint8_t netID() const { return netID_; }
+  uint8_t address() const { return address_; }
+  double x() const { return x_; }
+  double y() const { return y_; }
+
+  void run(uint64_t now);
+  void isr(uint64_t t);
+  void call(uint64_t now, const std::function<void()> &fn);
+  bool booted() const { return booted_; }
+  uint64_t busyUntil() const { return busyUntil_; }
+  long minAirtime() const { return minAirtime_; }
+  uint64_t serialBytesOut() const { return serialBytesOut_; }
+  void setPin(uint8_t pin, int level);
+  void queueSerialInput(const std::string &data);
+
+  // Host
+  uint64_t micros() override;
+  void delayMicros(uint64_t us) override;
+  long random(long lo, long hi) override;
+  void randomSeed(unsigned long seed) override;
+  int digitalRead(uint8_t pin) override;
+  void digitalWrite(uint8_t pin, uint8_t val) override;
+  int analogRead(uint8_t pin) override;
+  void serialBegin(unsigned long baud) override;
+  void serialWrite(const uint8_t *buf, size_t n) override;
+  int serialAvailable() override;
+  int serialAvailableForWrite() override;
+  int serialRead() override;
+  int serialPeek() override;
+  void serialSetTimeout(unsigned long ms) override;
+  unsigned long serialTimeout() override;
+  Radio &radio() override { return radio_; }
+
+ private:
+  void activate();
+
+  Simulator &sim_;
+  FirmwareImage &image_;
+  Role role_;
+  int uid_;
+  uint8_t netID_;
+  uint8_t address_;
+  double x_;
+  double y_;
+
+  std::vector<uint8_t> state_;
+  bool booted_;
+  uint64_t callStart_;
+  uint64_t advance_;
+  uint64_t busyUntil_;
+  long minAirtime_;
+
+  std::mt19937_64 rng_;
+  uint8_t pins_[64];
+
+  double serialByteMicros_;
+  uint64_t serialDrainUntil_;
+  uint64_t serialBytesOut_;
+  unsigned long serialTimeout_;
+  std::string serialLine_;
+  std::deque<uint8_t> serialIn_;
+
+  Radio radio_;
+};
+
+}
+
+#endif
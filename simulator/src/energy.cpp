@@ -0,0 +1,57 @@
+/**
+ * @file energy.cpp
+ * @brief Current draw model of a battery node
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "energy.h"
+
+namespace sim {
+
+EnergyUsage &EnergyUsage::operator+=(const EnergyUsage &o) {
+  tx += o.tx;
+  rx += o.rx;
+  standby += o.standby;
+  sleep += o.sleep;
+  mcuSleeps = mcuSleeps || o.mcuSleeps;
+  return *this;
+}
+
+/**
+ * @brief Average supply current of a node: the radio current of every state weighted by the time spent
+ *        in it, plus the MCU, which is active unless the firmware sleeps it together with the radio
+ *
+ * @param model supply currents
+ * @param usage time spent in each state
+ * @return double average current, in mA
+ */
+double averageCurrent(const EnergyModel &model, const EnergyUsage &usage) {
+  double total = (double)usage.total();
+  if (total <= 0)
+    return 0;
+  double charge = usage.tx * model.radioTx + usage.rx * model.radioRx + usage.standby * model.radioStandby +
+                  usage.sleep * model.radioSleep;
+  if (usage.mcuSleeps)
+    charge += (total - usage.sleep) * model.mcuActive + usage.sleep * model.mcuSleep;
+  else
+    charge += total * model.mcuActive;
+  return charge / total;
+}
+
+/**
+ * @brief Days a full battery lasts at the average current of a node
+ *
+ * @param model supply currents and battery capacity
+ * @param usage time spent in each state
+ * @return double battery life, in days
+ */
+double batteryDays(const EnergyModel &model, const EnergyUsage &usage) {
+  double current = averageCurrent(model, usage);
+  return current > 0 ? model.batteryMah / current / 24.0 : 0;
+}
+
+}
@@ -0,0 +1,53 @@
+/**
+ * @file energy.h
+ * @brief Current draw model of a battery node: SX1276 radio states and ESP32 active and light sleep,
+ *        combined with the time a node spent in each state to give its average current and battery life
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SIM_ENERGY_H
+#define SIM_ENERGY_H
+
+#include <stdint.h>
+
+namespace sim {
+
+/**
+ * @brief Supply currents, in mA, from the SX1276 and ESP32 datasheets
+ *
+ */
+struct EnergyModel {
+  double radioTx = 44.0;         ///< transmitting at +14 dBm on PA_BOOST
+  double radioRx = 11.5;         ///< receiving or running channel activity detection
+  double radioStandby = 1.6;
+  double radioSleep = 0.0002;
+  double mcuActive = 40.0;       ///< ESP32 at 80 MHz with Wi-Fi and Bluetooth off
+  double mcuSleep = 0.8;         ///< ESP32 light sleep, RAM retained
+  double batteryMah = 2000.0;
+};
+
+/**
+ * @brief Time a node spent in each power state over a run, in microseconds
+ *
+ */
+struct EnergyUsage {
+  uint64_t tx = 0;
+  uint64_t rx = 0;
+  uint64_t standby = 0;
+  uint64_t sleep = 0;
+  bool mcuSleeps = false;        ///< the firmware puts the MCU in light sleep whenever the radio sleeps
+
+  uint64_t total() const { return tx + rx + standby + sleep; }
+  EnergyUsage &operator+=(const EnergyUsage &o);
+};
+
+double averageCurrent(const EnergyModel &model, const EnergyUsage &usage);
+double batteryDays(const EnergyModel &model, const EnergyUsage &usage);
+
+}
+
+#endif
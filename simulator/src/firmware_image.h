@@ -0,0 +1,67 @@
+/**
+ * @file firmware_image.h
+ * @brief A firmware build linked into the simulator. Each image is compiled in its own namespace and all of
+ *        its mutable globals are collected by the linker into one state section, so the simulator can run
+ *        many virtual devices on one copy of the code by swapping that section between them
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SIM_FIRMWARE_IMAGE_H
+#define SIM_FIRMWARE_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace sim {
+
+class Device;
+
+struct FirmwareImage {
+  const char *name;
+  uint8_t *stateBegin;
+  uint8_t *stateEnd;
+  const void *const *probes;                        ///< null terminated, must all lie in the state section
+  void (*configure)(uint8_t netID, uint8_t address);  ///< writes the device identity into the resident state
+  void (*setup)();
+  void (*loop)();
+  int (*uplinkCount)();                              ///< sensor messages created so far, null for gateways
+  int sensorPin;                                     ///< input pin driven by the sensor model, -1 if none
+  bool binarySerial;                                 ///< serial output is COBS framed records, not text lines
+  void (*setModem)(int sf, long bw, int crd);        ///< applies modem settings through the firmware
+  long (*remainingAirtime)();                        ///< duty cycle budget left, ms
+  bool lowPower;                                     ///< the MCU sleeps whenever the radio does
+
+  Device *resident = nullptr;
+  std::vector<uint8_t> pristine;
+
+  size_t stateSize() const { return stateEnd - stateBegin; }
+  void capturePristine();
+};
+
+extern FirmwareImage nodeImage;
+extern FirmwareImage relayImage;
+extern FirmwareImage gatewayImage;
+
+/**
+ * @brief Byte of the AES-256 key the simulator assigns to a node. Nodes 1 to 15 get the same keys as the
+ *        example node definitions, node 0 and BROADCAST_ID (0xFF) get the broadcast key
+ *
+ * @param nodeID ID of the node
+ * @param i byte index, 0 to 31
+ * @return uint8_t key byte
+ */
+constexpr uint8_t simulatedKeyByte(uint8_t nodeID, int i) {
+  return nodeID == 0xFF ? simulatedKeyByte(0, i)
+       : i < 30         ? (uint8_t)i
+       : i == 30        ? (uint8_t)(0x1e + (nodeID >> 4))
+                        : (uint8_t)((nodeID << 4) | 0x0f);
+}
+
+}
+
+#endif
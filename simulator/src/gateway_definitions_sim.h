@@ -0,0 +1,52 @@
+/**
+ * @file gateway_definitions_sim.h
+ * @brief Stands in for gateway_serial/gateway_serial_definitions.h in the gateway image, included inside its
+ *        namespace. The network ID is per-device state, declared here and defined by the image, and the node
+ *        registry covers every node ID the simulator hands out
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SIM_GATEWAY_DEFINITIONS_H
+#define SIM_GATEWAY_DEFINITIONS_H
+
+#define GATEWAY_SERIAL_DEFINITIONS_H
+#define BAUD_RATE 9600
+#define SS 10
+#define RST 9
+#define DIO0 2
+#define KEY_SIZE 32
+
+const int gatewayID = 0xFF;
+extern byte netID;
+
+typedef struct strNodeEntry {
+  byte nodeID;
+  uint8_t key[KEY_SIZE];
+} NodeEntry;
+
+struct KeyTable {
+  uint8_t broadcast[KEY_SIZE];
+  NodeEntry nodes[254];
+};
+
+constexpr KeyTable makeKeyTable() {
+  KeyTable t = {};
+  for (int i = 0; i < KEY_SIZE; i++)
+    t.broadcast[i] = sim::simulatedKeyByte(0, i);
+  for (int id = 1; id <= 254; id++) {
+    t.nodes[id - 1].nodeID = (uint8_t)id;
+    for (int i = 0; i < KEY_SIZE; i++)
+      t.nodes[id - 1].key[i] = sim::simulatedKeyByte((uint8_t)id, i);
+  }
+  return t;
+}
+
+constexpr KeyTable keyTable = makeKeyTable();
+static constexpr const uint8_t (&broadcastKey)[KEY_SIZE] = keyTable.broadcast;
+static constexpr const NodeEntry (&nodeRegistry)[254] = keyTable.nodes;
+
+#endif
@@ -0,0 +1,68 @@
+/**
+ * @file gateway_image.cpp
+ * @brief Gateway firmware image. Builds the unmodified gateway sources inside namespace gateway_fw,
+ *        replacing only gateway_serial_definitions.h (see gateway_definitions_sim.h) so that the network ID is
+ *        per-device state and the node registry covers every node ID the simulator hands out
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <LoRa.h>
+#include <cppQueue.h>
+#include <aes256.h>
+#include <wsn_codec.h>
+#include <wsn_trace.h>
+
+#include "firmware_image.h"
+
+namespace gateway_fw {
+
+#include "gateway_definitions_sim.h"
+
+byte netID = 0xF3;
+
+#include "../../gateway_serial/comms_protocol.cpp"
+#include "../../gateway_serial/gateway_serial.ino"
+
+}
+
+extern "C" uint8_t gateway_fw_state_begin[];
+extern "C" uint8_t gateway_fw_state_end[];
+
+static const void *const probes[] = {
+  &gateway_fw::netID, &gateway_fw::msg_q, &gateway_fw::relayBuf, &gateway_fw::keyCache, &gateway_fw::msgCount, &gateway_fw::inFlight,
+  &gateway_fw::netProfile, &gateway_fw::curSpreadingFactor, &gateway_fw::airtimeBudget,
+  &gateway_fw::rxWindows, &gateway_fw::nodeSlot, &gateway_fw::nodeState,
+  &gateway_fw::scanSlots, &gateway_fw::registeredNodes, &gateway_fw::scanActive, &gateway_fw::scanMsgID, &gateway_fw::scanReplies, &gateway_fw::scanStart,
+  &gateway_fw::scanWindow, &gateway_fw::tdmaStart, &gateway_fw::tdmaBeaconID,
+#if LINK_STATS_ENABLED
+  &gateway_fw::linkStats,
+#endif
+#if ADR_ENABLED
+  &gateway_fw::adrNodes,
+#endif
+#if TRACE_ENABLED
+  &gateway_fw::traceRing,
+#endif
+  nullptr
+};
+
+static void configure(uint8_t netID, uint8_t address) {
+  (void)address;
+  gateway_fw::netID = netID;
+}
+
+namespace sim {
+
+FirmwareImage gatewayImage = {
+  "gateway", gateway_fw_state_begin, gateway_fw_state_end, probes, configure, gateway_fw::setup,
+  gateway_fw::loop, nullptr, -1, SERIAL_PROTOCOL == SERIAL_BINARY, gateway_fw::setModem,
+  gateway_fw::remainingAirtime, false
+};
+
+}
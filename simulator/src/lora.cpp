@@ -0,0 +1,68 @@
+/**
+ * @file lora.cpp
+ * @brief arduino-LoRa stand-in, forwards every call to the radio of the running device
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <LoRa.h>
+
+#include "radio.h"
+
+LoRaClass LoRa;
+
+static sim::Radio &radio() {
+  return sim::host().radio();
+}
+
+int LoRaClass::begin(long frequency) { return radio().begin(frequency); }
+void LoRaClass::end() { radio().end(); }
+
+int LoRaClass::beginPacket(int implicitHeader) { return radio().beginPacket(implicitHeader); }
+int LoRaClass::endPacket(bool async) { return radio().endPacket(async); }
+
+int LoRaClass::parsePacket(int size) { return radio().parsePacket(size); }
+int LoRaClass::packetRssi() { return radio().packetRssi(); }
+float LoRaClass::packetSnr() { return radio().packetSnr(); }
+long LoRaClass::packetFrequencyError() { return 0; }
+int LoRaClass::rssi() { return radio().rssi(); }
+
+size_t LoRaClass::write(uint8_t byte) { return radio().write(&byte, 1); }
+size_t LoRaClass::write(const uint8_t *buffer, size_t size) { return radio().write(buffer, size); }
+
+int LoRaClass::available() { return radio().available(); }
+int LoRaClass::read() { return radio().read(); }
+int LoRaClass::peek() { return radio().peek(); }
+
+void LoRaClass::onReceive(void (*callback)(int)) { radio().onReceive(callback); }
+void LoRaClass::onTxDone(void (*callback)()) { radio().onTxDone(callback); }
+void LoRaClass::onCadDone(void (*callback)(boolean)) { radio().onCadDone(callback); }
+void LoRaClass::channelActivityDetection() { radio().channelActivityDetection(); }
+
+void LoRaClass::receive(int size) { radio().receive(size); }
+void LoRaClass::idle() { radio().idle(); }
+void LoRaClass::sleep() { radio().sleep(); }
+
+void LoRaClass::setTxPower(int level, int outputPin) {
+  (void)outputPin;
+  radio().modem().txPower = level;
+}
+void LoRaClass::setFrequency(long frequency) { radio().modem().frequency = frequency; }
+void LoRaClass::setSpreadingFactor(int sf) {
+  radio().modem().spreadingFactor = sf < 6 ? 6 : sf > 12 ? 12 : sf;
+}
+void LoRaClass::setSignalBandwidth(long sbw) { radio().modem().signalBandwidth = sbw; }
+void LoRaClass::setCodingRate4(int denominator) {
+  radio().modem().codingRateDenominator = denominator < 5 ? 5 : denominator > 8 ? 8 : denominator;
+}
+void LoRaClass::setPreambleLength(long length) { radio().modem().preambleLength = length; }
+void LoRaClass::setSyncWord(int sw) { radio().modem().syncWord = sw; }
+void LoRaClass::enableCrc() { radio().modem().crc = true; }
+void LoRaClass::disableCrc() { radio().modem().crc = false; }
+void LoRaClass::enableInvertIQ() { radio().modem().invertIQ = true; }
+void LoRaClass::disableInvertIQ() { radio().modem().invertIQ = false; }
+
+byte LoRaClass::random() { return (byte)sim::host().random(0, 256); }
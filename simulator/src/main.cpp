@@ -0,0 +1,122 @@
+/**
+ * @file main.cpp
+ * @brief lorasim command line: runs one simulated deployment and prints its throughput, packet error rate
+ *        and end-to-end delay
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "simulator.h"
+
+static void usage(const char *argv0) {
+  printf("usage: %s [options]\n"
+         "\n"
+         "Deployment\n"
+         "  --nodes N           virtual nodes, at most 254 per gateway (50)\n"
+         "  --gateways N        gateways, each serving its own cell and network ID (1)\n"
+         "  --radius M          radius of the disc the nodes of a cell are spread over, m (1000)\n"
+         "  --relays N          relay nodes per gateway on a ring around it, needs a MULTIHOP_ENABLED build (0)\n"
+         "  --relay-distance F  radius of the relay ring as a fraction of the cell radius (0.6)\n"
+         "Traffic\n"
+         "  --duration S        simulated time, s (3600)\n"
+         "  --rate R            motion events per node per hour (6)\n"
+         "  --pulse S           time the motion sensor output stays high, s (2)\n"
+         "  --settle S          no new events during the last S seconds of the run (30)\n"
+         "  --status-rate R     status requests per gateway per hour sent by the server (0)\n"
+         "  --trace-dump S      period the server asks the gateways for their latency trace, s, needs a\n"
+         "                      TRACE_ENABLED build (0, never)\n"
+         "  --scan S            period the server rescans every cell with a broadcast status request, s (0,\n"
+         "                      never)\n"
+         "Modem (applied after the firmware has booted, 0 keeps the firmware setting)\n"
+         "  --sf N  --bw HZ  --cr N\n"
+         "Channel\n"
+         "  --pl0 DB            path loss at 1 m (40)\n"
+         "  --pl-exponent G     path loss exponent (2.7)\n"
+         "  --shadowing DB      log-normal shadowing standard deviation (4)\n"
+         "  --capture DB        capture threshold (6)\n"
+         "Energy\n"
+         "  --battery MAH       node battery capacity used for the battery life estimate (2000)\n"
+         "Simulation\n"
+         "  --node-tick S       idle loop period of nodes (0.25)\n"
+         "  --gateway-tick S    idle loop period of gateways (0.01)\n"
+         "  --seed N            random seed (1)\n"
+         "  --csv FILE          append the results as a CSV row\n"
+         "  --verbose           print every line the gateways write to the server\n",
+         argv0);
+}
+
+int main(int argc, char **argv) {
+  sim::Scenario sc;
+  std::string csv;
+
+  for (int i = 1; i < argc; i++) {
+    std::string opt = argv[i];
+    if (opt == "--help" || opt == "-h") {
+      usage(argv[0]);
+      return 0;
+    }
+    if (opt == "--verbose") {
+      sc.verbose = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      fprintf(stderr, "missing value for %s\n", opt.c_str());
+      return 1;
+    }
+    const char *v = argv[++i];
+    if (opt == "--nodes") sc.nodes = atoi(v);
+    else if (opt == "--gateways") sc.gateways = atoi(v);
+    else if (opt == "--radius") sc.radius = atof(v);
+    else if (opt == "--relays") sc.relays = atoi(v);
+    else if (opt == "--relay-distance") sc.relayDistance = atof(v);
+    else if (opt == "--duration") sc.duration = atof(v);
+    else if (opt == "--rate") sc.sensorRate = atof(v);
+    else if (opt == "--pulse") sc.pulse = atof(v);
+    else if (opt == "--settle") sc.settle = atof(v);
+    else if (opt == "--status-rate") sc.statusRate = atof(v);
+    else if (opt == "--trace-dump") sc.traceDump = atof(v);
+    else if (opt == "--scan") sc.scan = atof(v);
+    else if (opt == "--sf") sc.spreadingFactor = atoi(v);
+    else if (opt == "--bw") sc.signalBandwidth = atol(v);
+    else if (opt == "--cr") sc.codingRateDenominator = atoi(v);
+    else if (opt == "--pl0") sc.link.referenceLoss = atof(v);
+    else if (opt == "--pl-exponent") sc.link.exponent = atof(v);
+    else if (opt == "--shadowing") sc.link.shadowingSigma = atof(v);
+    else if (opt == "--capture") sc.link.captureThreshold = atof(v);
+    else if (opt == "--battery") sc.energy.batteryMah = atof(v);
+    else if (opt == "--node-tick") sc.nodeTick = atof(v);
+    else if (opt == "--gateway-tick") sc.gatewayTick = atof(v);
+    else if (opt == "--seed") sc.seed = strtoull(v, nullptr, 10);
+    else if (opt == "--csv") csv = v;
+    else {
+      fprintf(stderr, "unknown option %s\n", opt.c_str());
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (sc.gateways < 1 || sc.nodes < 0 || sc.relays < 0 || (sc.nodes + sc.gateways - 1) / sc.gateways + sc.relays > 254) {
+    fprintf(stderr, "need at least one gateway and at most 254 nodes and relays per gateway\n");
+    return 1;
+  }
+  if (sc.nodeTick <= 0 || sc.gatewayTick <= 0) {
+    fprintf(stderr, "loop ticks must be positive\n");
+    return 1;
+  }
+  sc.link.seed = sc.seed;
+
+  sim::Simulator simulator(sc);
+  simulator.run();
+  simulator.report(stdout);
+  if (!csv.empty())
+    simulator.appendCsv(csv);
+  return 0;
+}
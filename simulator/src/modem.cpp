@@ -0,0 +1,48 @@
+/**
+ * @file modem.cpp
+ * @brief LoRa physical layer figures used by the air channel model
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "modem.h"
+
+#include <math.h>
+
+namespace sim {
+
+uint64_t timeOnAirMicros(const ModemConfig &modem, size_t payloadLength) {
+  const int sf = modem.spreadingFactor;
+  const double tSym = (double)(1L << sf) / (double)modem.signalBandwidth * 1e6;
+  // arduino-LoRa turns on low data rate optimization when a symbol lasts more than 16 ms
+  const int de = tSym > 16000.0 ? 1 : 0;
+  const int crc = modem.crc ? 1 : 0;
+  const int cr = modem.codingRateDenominator - 4;
+
+  double num = 8.0 * payloadLength - 4.0 * sf + 28 + 16 * crc;
+  double payloadSymbols = 8 + fmax(ceil(num / (4.0 * (sf - 2 * de))) * (cr + 4), 0.0);
+  double preamble = (modem.preambleLength + 4.25) * tSym;
+
+  return (uint64_t)(preamble + payloadSymbols * tSym + 0.5);
+}
+
+double demodulationFloorDb(int spreadingFactor) {
+  switch (spreadingFactor) {
+    case 6: return -5.0;
+    case 7: return -7.5;
+    case 8: return -10.0;
+    case 9: return -12.5;
+    case 10: return -15.0;
+    case 11: return -17.5;
+    default: return -20.0;
+  }
+}
+
+double noiseFloorDbm(long signalBandwidth, double noiseFigure) {
+  return -174.0 + 10.0 * log10((double)signalBandwidth) + noiseFigure;
+}
+
+}
@@ -0,0 +1,87 @@
+/**
+ * @file modem.h
+ * @brief LoRa modem settings and the physical layer figures derived from them: time on air, demodulation
+ *        SNR floor and receiver noise floor
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SIM_MODEM_H
+#define SIM_MODEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace sim {
+
+/**
+ * @brief Modem settings of an SX127x radio, with the arduino-LoRa power-on defaults
+ *
+ */
+struct ModemConfig {
+  long frequency = 868E6;
+  int spreadingFactor = 7;
+  long signalBandwidth = 125E3;
+  int codingRateDenominator = 5;
+  long preambleLength = 8;
+  int syncWord = 0x12;
+  bool crc = false;
+  bool invertIQ = false;
+  int txPower = 17;
+
+  /**
+   * @brief Whether a receiver with this configuration can demodulate a frame sent with other
+   *
+   * @param other modem settings of the transmitter
+   * @return true if frequency, SF, bandwidth, IQ polarity and sync word all match
+   */
+  bool canHear(const ModemConfig &other) const {
+    return frequency == other.frequency && spreadingFactor == other.spreadingFactor &&
+           signalBandwidth == other.signalBandwidth && invertIQ == other.invertIQ && syncWord == other.syncWord;
+  }
+
+  /**
+   * @brief Whether a frame sent with other interferes with the reception of a frame sent with this
+   *        configuration. Different spreading factors are treated as orthogonal
+   *
+   * @param other modem settings of the interfering transmitter
+   * @return true if frequency, SF and bandwidth match
+   */
+  bool collidesWith(const ModemConfig &other) const {
+    return frequency == other.frequency && spreadingFactor == other.spreadingFactor &&
+           signalBandwidth == other.signalBandwidth;
+  }
+};
+
+/**
+ * @brief Time on air of an explicit-header LoRa frame (Semtech AN1200.13)
+ *
+ * @param modem modem settings used for the transmission
+ * @param payloadLength number of payload bytes
+ * @return uint64_t frame duration in microseconds
+ */
+uint64_t timeOnAirMicros(const ModemConfig &modem, size_t payloadLength);
+
+/**
+ * @brief Minimum SNR the SX127x needs to demodulate a given spreading factor
+ *
+ * @param spreadingFactor spreading factor (6 to 12)
+ * @return double SNR floor in dB
+ */
+double demodulationFloorDb(int spreadingFactor);
+
+/**
+ * @brief Thermal noise power at the receiver input for a given bandwidth
+ *
+ * @param signalBandwidth bandwidth in Hz
+ * @param noiseFigure receiver noise figure in dB
+ * @return double noise power in dBm
+ */
+double noiseFloorDbm(long signalBandwidth, double noiseFigure);
+
+}
+
+#endif
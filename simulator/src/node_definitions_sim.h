@@ -0,0 +1,32 @@
+/**
+ * @file node_definitions_sim.h
+ * @brief Stands in for node/node_definitions.h in the node and relay images, included inside the namespace
+ *        of the image. The node ID, network ID and key are per-device state: they are declared here and
+ *        defined by the image, and written by its configure function
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SIM_NODE_DEFINITIONS_H
+#define SIM_NODE_DEFINITIONS_H
+
+#define NODE_DEFINITIONS_H
+#define BAUD_RATE 115200
+#define SS 18
+#define RST 14
+#define DIO0 26
+
+extern byte netID;
+extern byte nodeID;
+extern uint8_t key[32];
+
+const int vbatPin = 35;
+const int sensPin[] = {16};
+const int actPin[] = {LED_BUILTIN};
+const int sensN = sizeof(sensPin)/sizeof(int);
+const int actN = sizeof(actPin)/sizeof(int);
+
+#endif
@@ -0,0 +1,72 @@
+/**
+ * @file node_image.cpp
+ * @brief Node firmware image. Builds the unmodified node sources inside namespace node_fw, replacing only
+ *        node_definitions.h (see node_definitions_sim.h) so that the node ID, network ID and key become
+ *        per-device state
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <LoRa.h>
+#include <cppQueue.h>
+#include <aes256.h>
+#include <wsn_codec.h>
+#include <wsn_trace.h>
+#include <wsn_log.h>
+
+#include "firmware_image.h"
+
+namespace node_fw {
+
+#include "node_definitions_sim.h"
+
+byte netID = 0xF3;
+byte nodeID = 0x01;
+uint8_t key[32];
+
+#include "../../node/comms_protocol.cpp"
+#include "../../node/node.ino"
+
+}
+
+extern "C" uint8_t node_fw_state_begin[];
+extern "C" uint8_t node_fw_state_end[];
+
+static const void *const probes[] = {
+  &node_fw::nodeID, &node_fw::key, &node_fw::msg_q, &node_fw::ctxtNode, &node_fw::msgCount, &node_fw::motionState, &node_fw::window,
+  &node_fw::pendingProfile, &node_fw::curProfile, &node_fw::failedUplinks, &node_fw::curSpreadingFactor, &node_fw::airtimeBudget, &node_fw::rxWindowEnd,
+  &node_fw::scanReplyPending, &node_fw::scanReplyAt, &node_fw::scanReplyMsgID, &node_fw::tdmaOffset, &node_fw::tdmaSynced,
+#if TRACE_ENABLED
+  &node_fw::traceRing, &node_fw::traceDumpPending,
+#endif
+#if LOG_LEVEL > LOG_LEVEL_NONE
+  &node_fw::logBuffer,
+#endif
+  nullptr
+};
+
+static void configure(uint8_t netID, uint8_t address) {
+  node_fw::netID = netID;
+  node_fw::nodeID = address;
+  for (int i = 0; i < 32; i++)
+    node_fw::key[i] = sim::simulatedKeyByte(address, i);
+}
+
+static int uplinkCount() {
+  return node_fw::msgCount;
+}
+
+namespace sim {
+
+FirmwareImage nodeImage = {
+  "node", node_fw_state_begin, node_fw_state_end, probes, configure, node_fw::setup, node_fw::loop,
+  uplinkCount, node_fw::sensPin[0], false, node_fw::setModem, node_fw::remainingAirtime,
+  LOW_POWER
+};
+
+}
@@ -0,0 +1,249 @@
+/**
+ * @file radio.cpp
+ * @brief Simulated SX127x radio
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "radio.h"
+
+#include <math.h>
+
+#include "channel.h"
+#include "device.h"
+#include "simulator.h"
+
+namespace sim {
+
+Radio::Radio(Device &owner)
+    : owner_(owner), mode_(RadioMode::Sleep), modeSince_(0), txUntil_(0), rxIndex_(0), rxReadable_(false), rxDone_(false),
+      txDone_(false), rxRssi_(0), rxSnr_(0), lock_(nullptr), lockIdx_(0), onReceive_(nullptr), onTxDone_(nullptr),
+      onCadDone_(nullptr), dio0Attached_(false) {}
+
+int Radio::begin(long frequency) {
+  modem_ = ModemConfig();
+  modem_.frequency = frequency;
+  enterMode(RadioMode::Standby, owner_.micros());
+  return 1;
+}
+
+void Radio::end() {
+  sleep();
+}
+
+int Radio::beginPacket(int implicitHeader) {
+  (void)implicitHeader;
+  uint64_t t = owner_.micros();
+  if (transmitting(t))
+    return 0;
+  idle();
+  txBuf_.clear();
+  return 1;
+}
+
+int Radio::endPacket(bool async) {
+  uint64_t t = owner_.micros();
+  uint64_t toa = timeOnAirMicros(modem_, txBuf_.size());
+
+  owner_.simulator().channel().transmit(*this, txBuf_, t);
+  txUntil_ = t + toa;
+  enterMode(RadioMode::Standby, t);
+  usage_.tx += toa;
+  modeSince_ = txUntil_;
+
+  if (async)
+    owner_.simulator().interrupt(owner_, txUntil_);
+  else
+    owner_.delayMicros(toa);
+  txDone_ = async;
+  return 1;
+}
+
+size_t Radio::write(const uint8_t *buf, size_t n) {
+  size_t room = 255 - txBuf_.size();
+  if (n > room)
+    n = room;
+  txBuf_.insert(txBuf_.end(), buf, buf + n);
+  return n;
+}
+
+int Radio::parsePacket(int size) {
+  (void)size;
+  if (rxDone_) {
+    rxDone_ = false;
+    rxReadable_ = true;
+    rxIndex_ = 0;
+    idle();
+    return (int)rxBuf_.size();
+  }
+  if (mode_ != RadioMode::ReceiveSingle) {
+    if (mode_ != RadioMode::ReceiveContinuous)
+      rxReadable_ = false;
+    enterMode(RadioMode::ReceiveSingle, owner_.micros());
+  }
+  return 0;
+}
+
+int Radio::packetRssi() const {
+  return rxRssi_;
+}
+
+float Radio::packetSnr() const {
+  return rxSnr_;
+}
+
+int Radio::rssi() const {
+  return (int)lround(noiseFloorDbm(modem_.signalBandwidth, 6.0));
+}
+
+int Radio::available() const {
+  return rxReadable_ ? (int)(rxBuf_.size() - rxIndex_) : 0;
+}
+
+int Radio::read() {
+  if (!available())
+    return -1;
+  return rxBuf_[rxIndex_++];
+}
+
+int Radio::peek() const {
+  if (!available())
+    return -1;
+  return rxBuf_[rxIndex_];
+}
+
+void Radio::receive(int size) {
+  (void)size;
+  enterMode(RadioMode::ReceiveContinuous, owner_.micros());
+}
+
+void Radio::idle() {
+  leaveReceive(owner_.micros());
+  enterMode(RadioMode::Standby, owner_.micros());
+}
+
+void Radio::sleep() {
+  leaveReceive(owner_.micros());
+  enterMode(RadioMode::Sleep, owner_.micros());
+}
+
+/**
+ * @brief The receive, transmit done and CAD done interrupts all come in on DIO0, like in arduino-LoRa: each
+ *        callback setter attaches the DIO0 interrupt, or detaches it when given NULL, whatever the other
+ *        callbacks are. A detached DIO0 delivers none of them
+ *
+ */
+void Radio::onReceive(void (*callback)(int)) {
+  onReceive_ = callback;
+  dio0Attached_ = callback != nullptr;
+}
+
+void Radio::onTxDone(void (*callback)()) {
+  onTxDone_ = callback;
+  dio0Attached_ = callback != nullptr;
+}
+
+void Radio::onCadDone(void (*callback)(bool)) {
+  onCadDone_ = callback;
+  dio0Attached_ = callback != nullptr;
+}
+
+/**
+ * @brief Listens for LoRa chirps on the current SF and bandwidth for two symbols, blocking the device
+ *        like the SX127x CAD does, then raises the CAD done interrupt with the result. The interrupt is
+ *        delivered as soon as the detection ends, which is when the firmware waits for it
+ *
+ */
+void Radio::channelActivityDetection() {
+  uint64_t t = owner_.micros();
+  uint64_t duration = (uint64_t)(2e6 * (1 << modem_.spreadingFactor) / modem_.signalBandwidth);
+  idle();
+  owner_.delayMicros(duration);
+  bool detected = owner_.simulator().channel().activity(*this, t, t + duration);
+  if (dio0Attached_ && onCadDone_)
+    onCadDone_(detected);
+}
+
+bool Radio::receiving() const {
+  return mode_ == RadioMode::ReceiveContinuous || mode_ == RadioMode::ReceiveSingle;
+}
+
+void Radio::lock(Transmission &tx, size_t reception) {
+  lock_ = &tx;
+  lockIdx_ = reception;
+}
+
+void Radio::release(const Transmission &tx) {
+  if (lock_ == &tx)
+    lock_ = nullptr;
+}
+
+void Radio::deliver(const Transmission &tx, double rssi, double snr) {
+  rxBuf_ = tx.frame;
+  rxIndex_ = 0;
+  rxReadable_ = false;
+  rxDone_ = true;
+  rxRssi_ = (int)lround(rssi);
+  rxSnr_ = (float)(round(snr * 4.0) / 4.0);
+  if (mode_ == RadioMode::ReceiveSingle)
+    enterMode(RadioMode::Standby, tx.end);
+  // A receive callback runs from the interrupt right away, before the next frame can overwrite the FIFO
+  if (dio0Attached_ && onReceive_ && mode_ == RadioMode::ReceiveContinuous && owner_.booted())
+    owner_.isr(tx.end);
+  owner_.simulator().interrupt(owner_, tx.end);
+}
+
+void Radio::dispatchInterrupts(uint64_t t) {
+  if (rxDone_ && dio0Attached_ && onReceive_ && mode_ == RadioMode::ReceiveContinuous) {
+    rxDone_ = false;
+    rxReadable_ = true;
+    rxIndex_ = 0;
+    onReceive_((int)rxBuf_.size());
+  }
+  if (txDone_ && t >= txUntil_) {
+    txDone_ = false;
+    if (dio0Attached_ && onTxDone_)
+      onTxDone_();
+  }
+}
+
+static void addTime(EnergyUsage &usage, RadioMode mode, uint64_t d) {
+  switch (mode) {
+    case RadioMode::Sleep: usage.sleep += d; break;
+    case RadioMode::Standby: usage.standby += d; break;
+    default: usage.rx += d; break;
+  }
+}
+
+/**
+ * @brief Changes the operating mode, adding the time spent in the previous one to the energy usage
+ *
+ * @param mode new mode
+ * @param t time of the change, in microseconds
+ */
+void Radio::enterMode(RadioMode mode, uint64_t t) {
+  if (t > modeSince_) {
+    addTime(usage_, mode_, t - modeSince_);
+    modeSince_ = t;
+  }
+  mode_ = mode;
+}
+
+EnergyUsage Radio::usage(uint64_t t) const {
+  EnergyUsage u = usage_;
+  if (t > modeSince_)
+    addTime(u, mode_, t - modeSince_);
+  return u;
+}
+
+void Radio::leaveReceive(uint64_t t) {
+  if (lock_ && lock_->end > t) {
+    lock_->receptions[lockIdx_].aborted = true;
+    lock_ = nullptr;
+  }
+}
+
+}
@@ -0,0 +1,112 @@
+/**
+ * @file radio.h
+ * @brief Simulated SX127x radio. Implements the behaviour the firmware relies on through arduino-LoRa:
+ *        half-duplex operation, single and continuous receive modes, blocking transmissions, channel
+ *        activity detection and the receive/transmit/CAD done interrupts
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SIM_RADIO_H
+#define SIM_RADIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "energy.h"
+#include "modem.h"
+
+namespace sim {
+
+class Device;
+struct Transmission;
+
+enum class RadioMode {
+  Sleep,
+  Standby,
+  ReceiveContinuous,
+  ReceiveSingle
+};
+
+/**
+ * @brief One SX127x radio, owned by a virtual device
+ *
+ */
+class Radio {
+ public:
+  explicit Radio(Device &owner);
+
+  // arduino-LoRa surface
+  int begin(long frequency);
+  void end();
+  int beginPacket(int implicitHeader);
+  int endPacket(bool async);
+  size_t write(const uint8_t *buf, size_t n);
+  int parsePacket(int size);
+  int packetRssi() const;
+  float packetSnr() const;
+  int rssi() const;
+  int available() const;
+  int read();
+  int peek() const;
+  void receive(int size);
+  void idle();
+  void sleep();
+  void onReceive(void (*callback)(int));
+  void onTxDone(void (*callback)());
+  void onCadDone(void (*callback)(bool));
+  void channelActivityDetection();
+  ModemConfig &modem() { return modem_; }
+  const ModemConfig &modem() const { return modem_; }
+
+  // Channel side
+  Device &owner() const { return owner_; }
+  bool receiving() const;
+  bool transmitting(uint64_t t) const { return t < txUntil_; }
+  bool busy() const { return lock_ != nullptr; }
+  void lock(Transmission &tx, size_t reception);
+  void release(const Transmission &tx);
+  void deliver(const Transmission &tx, double rssi, double snr);
+
+  // Time spent in each power state up to t
+  EnergyUsage usage(uint64_t t) const;
+
+  // Interrupts, dispatched by the owning device before its loop runs
+  void dispatchInterrupts(uint64_t t);
+
+ private:
+  void leaveReceive(uint64_t t);
+  void enterMode(RadioMode mode, uint64_t t);
+
+  Device &owner_;
+  ModemConfig modem_;
+  RadioMode mode_;
+  uint64_t modeSince_;
+  EnergyUsage usage_;
+  uint64_t txUntil_;
+
+  std::vector<uint8_t> txBuf_;
+  std::vector<uint8_t> rxBuf_;
+  size_t rxIndex_;
+  bool rxReadable_;
+  bool rxDone_;
+  bool txDone_;
+  int rxRssi_;
+  float rxSnr_;
+
+  Transmission *lock_;
+  size_t lockIdx_;
+
+  void (*onReceive_)(int);
+  void (*onTxDone_)();
+  void (*onCadDone_)(bool);
+  bool dio0Attached_;
+};
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+/**
+ * @file relay_image.cpp
+ * @brief Relay firmware image. Builds the unmodified node sources with RELAY_ENABLED inside namespace
+ *        relay_fw, replacing only node_definitions.h like the node image does. Relays are mains powered, so
+ *        LOW_POWER is always off, and do not hear the TDMA beacons
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <LoRa.h>
+#include <cppQueue.h>
+#include <aes256.h>
+#include <wsn_codec.h>
+#include <wsn_trace.h>
+#include <wsn_log.h>
+
+#include "firmware_image.h"
+
+#undef RELAY_ENABLED
+#define RELAY_ENABLED 1
+#undef LOW_POWER
+#define LOW_POWER 0
+#undef TDMA_ENABLED
+#define TDMA_ENABLED 0
+
+namespace relay_fw {
+
+#include "node_definitions_sim.h"
+
+byte netID = 0xF3;
+byte nodeID = 0x01;
+uint8_t key[32];
+
+#include "../../node/comms_protocol.cpp"
+#include "../../node/node.ino"
+
+}
+
+extern "C" uint8_t relay_fw_state_begin[];
+extern "C" uint8_t relay_fw_state_end[];
+
+static const void *const probes[] = {
+  &relay_fw::nodeID, &relay_fw::key, &relay_fw::msg_q, &relay_fw::ctxtNode, &relay_fw::msgCount, &relay_fw::window,
+  &relay_fw::curSpreadingFactor, &relay_fw::airtimeBudget, &relay_fw::routes,
+#if TRACE_ENABLED
+  &relay_fw::traceRing,
+#endif
+#if LOG_LEVEL > LOG_LEVEL_NONE
+  &relay_fw::logBuffer,
+#endif
+  nullptr
+};
+
+static void configure(uint8_t netID, uint8_t address) {
+  relay_fw::netID = netID;
+  relay_fw::nodeID = address;
+  for (int i = 0; i < 32; i++)
+    relay_fw::key[i] = sim::simulatedKeyByte(address, i);
+}
+
+namespace sim {
+
+FirmwareImage relayImage = {
+  "relay", relay_fw_state_begin, relay_fw_state_end, probes, configure, relay_fw::setup, relay_fw::loop,
+  nullptr, -1, false, relay_fw::setModem, relay_fw::remainingAirtime, false
+};
+
+}
@@ -0,0 +1,153 @@
+/**
+ * @file server_link.cpp
+ * @brief Server side of the gateway serial link in binary mode
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "server_link.h"
+
+#include <stdio.h>
+#include <vector>
+
+namespace sim {
+
+static uint16_t crc16(const uint8_t *data, size_t len) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)(data[i] << 8);
+    for (int j = 0; j < 8; j++)
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+  }
+  return crc;
+}
+
+static bool cobsDecode(const std::string &in, std::vector<uint8_t> &out) {
+  size_t i = 0;
+  out.clear();
+  while (i < in.size()) {
+    unsigned code = (uint8_t)in[i++];
+    if (code == 0 || i + code - 1 > in.size())
+      return false;
+    for (unsigned j = 1; j < code; j++)
+      out.push_back((uint8_t)in[i++]);
+    if (code < 0xFF && i < in.size())
+      out.push_back(0);
+  }
+  return true;
+}
+
+/**
+ * @brief Converts a binary record from the gateway into the line the gateway would have written in JSON
+ *        mode, so the rest of the simulator handles both protocols the same way
+ *
+ * @param frame COBS encoded frame without its zero delimiter
+ * @return std::string equivalent text line, empty if the frame is corrupted
+ */
+std::string decodeServerFrame(const std::string &frame) {
+  std::vector<uint8_t> r;
+  if (!cobsDecode(frame, r) || r.size() < 3)
+    return "";
+  size_t n = r.size() - 2;
+  if (crc16(r.data(), n) != (r[n] | (r[n + 1] << 8)))
+    return "";
+  if (r[0] == 't')
+    return std::string(r.begin() + 1, r.begin() + n);
+
+  char buf[160];
+  if (r[0] == 'l' && n == 22) {
+    int v[6];
+    for (int i = 0; i < 6; i++)
+      v[i] = (int16_t)(r[9 + 2 * i] | (r[10 + 2 * i] << 8));
+    snprintf(buf, sizeof(buf), "rm{\"f\":\"l\",\"nID\":\"%d\",\"n\":\"%d\",\"dup\":\"%d\",\"lost\":\"%d\",\"PER\":\"%d\","
+             "\"RSSI\":\"%.1f,%d,%d\",\"SNR\":\"%.2f,%.2f,%.2f\",\"VBAT\":\"%.1f\"}", r[1], r[2] | (r[3] << 8),
+             r[4] | (r[5] << 8), r[6] | (r[7] << 8), r[8], v[0] / 10.0, v[1], v[2], v[3] / 100.0, v[4] / 100.0,
+             v[5] / 100.0, r[21] / 10.0);
+    return buf;
+  }
+  if (r[0] == 'n' && n == 8) {
+    unsigned long ms = r[4] | (r[5] << 8) | ((unsigned long)r[6] << 16) | ((unsigned long)r[7] << 24);
+    snprintf(buf, sizeof(buf), "rm{\"f\":\"n\",\"msgID\":\"%d\",\"n\":\"%d\",\"of\":\"%d\",\"ms\":\"%lu\"}", r[1], r[2],
+             r[3], ms);
+    return buf;
+  }
+  // Short records leave out RSSI, SNR and VBAT and have the retransmission count in their place
+  bool isShort = n == 10 && (r[0] == 'u' || r[0] == 's' || r[0] == 'a');
+  if (n != 15 && !isShort)
+    return "";
+
+  unsigned long t = r[1] | (r[2] << 8) | (r[3] << 16) | ((unsigned long)r[4] << 24);
+  int rssi = (int16_t)(r[9] | (r[10] << 8));
+  int snr = (int16_t)(r[11] | (r[12] << 8));
+  char flag = (char)r[0];
+  int len = snprintf(buf, sizeof(buf), "rm{\"t\":\"%lu\",\"msgID\":\"%d\",\"f\":\"%c\",\"nID\":\"%d\"", t, r[5],
+                     flag == 'f' ? 's' : flag, r[6]);
+  if (isShort)
+    snprintf(buf + len, sizeof(buf) - len, ",\"a\":\"%d\",\"b\":\"%d\",\"dup\":\"%d\"}", r[7], r[8], r[9]);
+  else if (flag == 'd')
+    snprintf(buf + len, sizeof(buf) - len, ",\"status\":\"%d\"}", r[7]);
+  else if (flag == 'u')
+    snprintf(buf + len, sizeof(buf) - len, ",\"a\":\"%d\",\"b\":\"%d\",\"RSSI\":\"%d\",\"SNR\":\"%.2f\",\"VBAT\":\"%.1f\",\"dup\":\"%d\"}",
+             r[7], r[8], rssi, snr / 100.0, r[13] / 10.0, r[14]);
+  else if (flag == 'f')
+    snprintf(buf + len, sizeof(buf) - len, ",\"state\":\"0\",\"RSSI\":\"0\",\"SNR\":\"0\",\"VBAT\":\"0\"}");
+  else
+    snprintf(buf + len, sizeof(buf) - len, ",\"a\":\"%d\",\"b\":\"%d\",\"RSSI\":\"%d\",\"SNR\":\"%.2f\",\"VBAT\":\"%.1f\"}",
+             r[7], r[8], rssi, snr / 100.0, r[13] / 10.0);
+  return buf;
+}
+
+/**
+ * @brief Appends the CRC to a downlink record and frames it
+ *
+ * @param record record bytes, with room for the two CRC bytes after them
+ * @param len length of the record without the CRC
+ * @return std::string COBS encoded frame including its zero delimiter
+ */
+static std::string encodeRecord(uint8_t *record, size_t len) {
+  uint16_t crc = crc16(record, len);
+  record[len] = (uint8_t)crc;
+  record[len + 1] = (uint8_t)(crc >> 8);
+
+  std::string out(1, '\0');
+  size_t code = 0;
+  for (size_t i = 0; i < len + 2; i++) {
+    uint8_t b = record[i];
+    if (b == 0) {
+      out[code] = (char)(out.size() - code);
+      code = out.size();
+      out += '\0';
+    } else {
+      out += (char)b;
+    }
+  }
+  out[code] = (char)(out.size() - code);
+  out += '\0';
+  return out;
+}
+
+/**
+ * @brief Builds the binary downlink frame of a status request
+ *
+ * @param nodeID node to query, 0xFF for all nodes
+ * @return std::string COBS encoded frame including its zero delimiter
+ */
+std::string encodeStatusRequest(uint8_t nodeID) {
+  uint8_t r[4] = {'s', nodeID};
+  return encodeRecord(r, 2);
+}
+
+/**
+ * @brief Builds the binary downlink frame asking the gateway for its latency trace
+ *
+ * @return std::string COBS encoded frame including its zero delimiter
+ */
+std::string encodeTraceDump() {
+  uint8_t r[3] = {'x'};
+  return encodeRecord(r, 1);
+}
+
+}
@@ -0,0 +1,26 @@
+/**
+ * @file server_link.h
+ * @brief Server side of the gateway serial link in binary mode (SERIAL_PROTOCOL set to SERIAL_BINARY):
+ *        decodes the COBS framed records the gateway sends and encodes downlink requests
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SIM_SERVER_LINK_H
+#define SIM_SERVER_LINK_H
+
+#include <stdint.h>
+#include <string>
+
+namespace sim {
+
+std::string decodeServerFrame(const std::string &frame);
+std::string encodeStatusRequest(uint8_t nodeID);
+std::string encodeTraceDump();
+
+}
+
+#endif
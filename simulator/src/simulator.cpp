@@ -0,0 +1,468 @@
+/**
+ * @file simulator.cpp
+ * @brief Discrete-event simulation of a LoRa sensor network running the real node and gateway firmware
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "simulator.h"
+#include "server_link.h"
+
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+namespace sim {
+
+// Frame the node firmware sends: netID, nodeID and one encrypted block plus its terminator
+#define NODE_FRAME_SIZE 19
+
+// The node firmware ignores its sensor for the first 30 s after boot
+#define SENSOR_WARMUP 30.0
+
+static bool jsonField(const std::string &line, const char *key, std::string &value) {
+  std::string pattern = std::string("\"") + key + "\":\"";
+  size_t p = line.find(pattern);
+  if (p == std::string::npos)
+    return false;
+  p += pattern.size();
+  size_t e = line.find('"', p);
+  if (e == std::string::npos)
+    return false;
+  value = line.substr(p, e - p);
+  return true;
+}
+
+static double percentile(std::vector<double> v, double q) {
+  if (v.empty())
+    return 0;
+  std::sort(v.begin(), v.end());
+  size_t i = (size_t)(q * (v.size() - 1) + 0.5);
+  return v[i];
+}
+
+static double mean(const std::vector<double> &v) {
+  if (v.empty())
+    return 0;
+  double s = 0;
+  for (double x : v)
+    s += x;
+  return s / v.size();
+}
+
+static double frameErrorRate(const FrameStats &s) {
+  return s.expected ? 1.0 - (double)s.delivered() / s.expected : 0;
+}
+
+Simulator::Simulator(const Scenario &scenario)
+    : sc_(scenario), channel_(*this, scenario.link), addressBook_(256, std::vector<int>(256, -1)),
+      rng_(scenario.seed), now_(0), seq_(0), end_(secondsToMicros(scenario.duration)), generated_(0),
+      delivered_(0), duplicates_(0), suppressed_(0), statusSent_(0), statusAnswered_(0), statusFailed_(0), summaries_(0),
+      scanRequests_(256), scansSent_(0), scanReplies_(0), scanAnswered_(0), scanCells_(0) {
+  nodeImage.capturePristine();
+  relayImage.capturePristine();
+  gatewayImage.capturePristine();
+
+  int cols = (int)ceil(sqrt((double)sc_.gateways));
+  for (int g = 0; g < sc_.gateways; g++) {
+    double x = (g % cols) * 2 * sc_.radius;
+    double y = (g / cols) * 2 * sc_.radius;
+    uint8_t netID = (uint8_t)(0xF3 + g);
+    gateways_.emplace_back(new Device(*this, gatewayImage, Role::Gateway, g, netID, 0xFF, x, y,
+                                      sc_.seed * 1000003 + g));
+    channel_.attach(gateways_.back()->radio());
+  }
+
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  for (int i = 0; i < sc_.nodes; i++) {
+    const Device &gw = *gateways_[i % sc_.gateways];
+    uint8_t address = (uint8_t)(i / sc_.gateways + 1);
+    double r = sc_.radius * sqrt(unit(rng_));
+    double a = 2 * M_PI * unit(rng_);
+    int uid = sc_.gateways + i;
+    nodes_.emplace_back(new Device(*this, nodeImage, Role::Node, uid, gw.netID(), address, gw.x() + r * cos(a),
+                                   gw.y() + r * sin(a), sc_.seed * 1000003 + uid));
+    channel_.attach(nodes_.back()->radio());
+    addressBook_[gw.netID()][address] = i;
+  }
+
+  // Relays take the addresses after the nodes of their cell
+  int cellNodes = (sc_.nodes + sc_.gateways - 1) / sc_.gateways;
+  for (int g = 0; g < sc_.gateways; g++) {
+    const Device &gw = *gateways_[g];
+    for (int k = 0; k < sc_.relays; k++) {
+      double r = sc_.radius * sc_.relayDistance;
+      double a = 2 * M_PI * k / sc_.relays;
+      int uid = sc_.gateways + sc_.nodes + g * sc_.relays + k;
+      relays_.emplace_back(new Device(*this, relayImage, Role::Relay, uid, gw.netID(), (uint8_t)(cellNodes + 1 + k),
+                                      gw.x() + r * cos(a), gw.y() + r * sin(a), sc_.seed * 1000003 + uid));
+      channel_.attach(relays_.back()->radio());
+    }
+  }
+  metrics_.resize(nodes_.size());
+  for (NodeMetrics &m : metrics_) {
+    memset(m.created, 0, sizeof(m.created));
+    memset(m.open, 0, sizeof(m.open));
+  }
+}
+
+void Simulator::schedule(uint64_t time, EventKind kind, Device *device, std::shared_ptr<Transmission> tx) {
+  queue_.push({time, seq_++, kind, device, std::move(tx)});
+}
+
+void Simulator::interrupt(Device &device, uint64_t time) {
+  schedule(time > now_ ? time : now_, EventKind::Interrupt, &device);
+}
+
+double Simulator::exponential(double perHour) {
+  return std::exponential_distribution<double>(perHour / 3600.0)(rng_);
+}
+
+int Simulator::nodeIndex(uint8_t netID, uint8_t address) const {
+  return addressBook_[netID][address];
+}
+
+/**
+ * @brief Runs the simulation until the configured duration. Devices boot at staggered times, then run
+ *        their loop on a fixed tick and whenever a radio interrupt, sensor edge or serial input wakes them
+ *
+ */
+void Simulator::run() {
+  std::uniform_real_distribution<double> boot(0.0, 1.0);
+
+  for (auto &gw : gateways_) {
+    schedule(0, EventKind::Tick, gw.get());
+    if (sc_.statusRate > 0)
+      schedule(secondsToMicros(SENSOR_WARMUP + exponential(sc_.statusRate)), EventKind::StatusRequest, gw.get());
+    if (sc_.traceDump > 0)
+      schedule(secondsToMicros(sc_.traceDump), EventKind::TraceDump, gw.get());
+    if (sc_.scan > 0)
+      schedule(secondsToMicros(SENSOR_WARMUP + sc_.scan), EventKind::Scan, gw.get());
+  }
+  for (auto &relay : relays_)
+    schedule(secondsToMicros(boot(rng_)), EventKind::Tick, relay.get());
+  for (auto &node : nodes_) {
+    double t = boot(rng_);
+    schedule(secondsToMicros(t), EventKind::Tick, node.get());
+    if (sc_.sensorRate > 0)
+      schedule(secondsToMicros(t + SENSOR_WARMUP + exponential(sc_.sensorRate)), EventKind::SensorHigh, node.get());
+  }
+
+  while (!queue_.empty() && queue_.top().time <= end_) {
+    Event ev = queue_.top();
+    queue_.pop();
+    now_ = ev.time;
+    dispatch(ev);
+  }
+}
+
+void Simulator::dispatch(const Event &ev) {
+  Device &d = *ev.device;
+  switch (ev.kind) {
+    case EventKind::FrameEnd:
+      channel_.finish(ev.tx);
+      break;
+
+    case EventKind::Tick:
+    case EventKind::Interrupt:
+    case EventKind::Poll:
+      step(d, ev.kind);
+      break;
+
+    case EventKind::SensorHigh: {
+      d.setPin((uint8_t)d.image().sensorPin, 1);
+      interrupt(d, now_);
+      schedule(now_ + secondsToMicros(sc_.pulse), EventKind::SensorLow, &d);
+      uint64_t next = now_ + secondsToMicros(sc_.pulse + exponential(sc_.sensorRate));
+      if (next + secondsToMicros(sc_.settle) < end_)
+        schedule(next, EventKind::SensorHigh, &d);
+      break;
+    }
+
+    case EventKind::SensorLow:
+      d.setPin((uint8_t)d.image().sensorPin, 0);
+      break;
+
+    case EventKind::StatusRequest: {
+      std::vector<int> cell;
+      for (size_t i = 0; i < nodes_.size(); i++)
+        if (nodes_[i]->netID() == d.netID())
+          cell.push_back((int)i);
+      if (!cell.empty()) {
+        int i = cell[std::uniform_int_distribution<size_t>(0, cell.size() - 1)(rng_)];
+        if (d.image().binarySerial)
+          d.queueSerialInput(encodeStatusRequest(nodes_[i]->address()));
+        else
+          d.queueSerialInput("s," + std::to_string(nodes_[i]->address()) + "\n");
+        metrics_[i].statusRequests.push_back(now_);
+        statusSent_++;
+        interrupt(d, now_);
+      }
+      uint64_t next = now_ + secondsToMicros(exponential(sc_.statusRate));
+      if (next + secondsToMicros(sc_.settle) < end_)
+        schedule(next, EventKind::StatusRequest, &d);
+      break;
+    }
+
+    case EventKind::TraceDump:
+      d.queueSerialInput(d.image().binarySerial ? encodeTraceDump() : std::string("x\n"));
+      interrupt(d, now_);
+      schedule(now_ + secondsToMicros(sc_.traceDump), EventKind::TraceDump, &d);
+      break;
+
+    case EventKind::Scan:
+      d.queueSerialInput(d.image().binarySerial ? encodeStatusRequest(0xFF) : std::string("s,-1\n"));
+      scanRequests_[d.netID()].push_back(now_);
+      scansSent_++;
+      interrupt(d, now_);
+      if (now_ + secondsToMicros(sc_.scan + sc_.settle) < end_)
+        schedule(now_ + secondsToMicros(sc_.scan), EventKind::Scan, &d);
+      break;
+  }
+}
+
+/**
+ * @brief Runs one firmware step on a device, unless it is still blocked in a previous one. A step woken
+ *        by an interrupt is followed by one more poll, as the real loop would spin again right away
+ *
+ * @param device device to run
+ * @param kind what woke the device
+ */
+void Simulator::step(Device &device, EventKind kind) {
+  if (now_ < device.busyUntil()) {
+    schedule(device.busyUntil(), kind, &device);
+    return;
+  }
+  device.run(now_);
+
+  if (kind == EventKind::Tick) {
+    double tick = device.role() == Role::Gateway ? sc_.gatewayTick : sc_.nodeTick;
+    uint64_t next = now_ + secondsToMicros(tick);
+    schedule(next > device.busyUntil() ? next : device.busyUntil(), EventKind::Tick, &device);
+  } else if (kind == EventKind::Interrupt) {
+    schedule(device.busyUntil(), EventKind::Poll, &device);
+  }
+}
+
+void Simulator::onBoot(Device &device) {
+  ModemConfig &m = device.radio().modem();
+  if (sc_.spreadingFactor)
+    m.spreadingFactor = sc_.spreadingFactor;
+  if (sc_.signalBandwidth)
+    m.signalBandwidth = sc_.signalBandwidth;
+  if (sc_.codingRateDenominator)
+    m.codingRateDenominator = sc_.codingRateDenominator;
+  // Through the firmware, so that its time on air accounting follows
+  if (device.image().setModem)
+    device.image().setModem(m.spreadingFactor, m.signalBandwidth, m.codingRateDenominator);
+}
+
+void Simulator::onUplinkCreated(Device &node, uint8_t msgID, uint64_t t) {
+  int i = nodeIndex(node.netID(), node.address());
+  metrics_[i].created[msgID] = t;
+  metrics_[i].open[msgID] = true;
+  generated_++;
+}
+
+/**
+ * @brief Handles a line the gateway wrote to the server. Sensor uplinks close the matching message
+ *        created on the node, status records answer the oldest outstanding request for that node or,
+ *        without one, a network scan. Scan reports close the oldest scan of the gateway
+ *
+ * @param device device that wrote the line
+ * @param line line without its terminator
+ * @param t time the last byte of the line left the gateway
+ */
+void Simulator::onSerialLine(Device &device, const std::string &line, uint64_t t) {
+  if (device.role() != Role::Gateway)
+    return;
+  // Trace dumps are printed for network_manager/src/trace_histogram.py
+  if (sc_.verbose || (sc_.traceDump > 0 && line.compare(0, 6, "trace ") == 0))
+    printf("%12.6f gateway %d: %s\n", t / 1e6, device.netID(), line.c_str());
+  if (line.compare(0, 2, "rm") != 0)
+    return;
+
+  std::string flag, nID, msgID, rssi;
+  if (jsonField(line, "f", flag) && flag == "l") {
+    summaries_++;
+    return;
+  }
+  if (flag == "n") {
+    std::string answered;
+    std::deque<uint64_t> &scans = scanRequests_[device.netID()];
+    if (jsonField(line, "n", answered) && !scans.empty()) {
+      int cell = 0;
+      for (const auto &n : nodes_)
+        cell += n->netID() == device.netID();
+      scanAnswered_ += atoi(answered.c_str());
+      scanCells_ += cell;
+      scanDurations_.push_back((t - scans.front()) / 1e6);
+      scans.pop_front();
+    }
+    return;
+  }
+  if (!jsonField(line, "f", flag) || !jsonField(line, "nID", nID) || !jsonField(line, "msgID", msgID))
+    return;
+  int i = nodeIndex(device.netID(), (uint8_t)atoi(nID.c_str()));
+  if (i < 0)
+    return;
+  NodeMetrics &m = metrics_[i];
+
+  if (flag == "u") {
+    std::string dup;
+    if (jsonField(line, "dup", dup))
+      suppressed_ += atoi(dup.c_str());
+    uint8_t id = (uint8_t)atoi(msgID.c_str());
+    if (m.open[id]) {
+      m.open[id] = false;
+      delivered_++;
+      uplinkDelays_.push_back((t - m.created[id]) / 1e3);
+    } else {
+      duplicates_++;
+    }
+  } else if (flag == "s" && !m.statusRequests.empty()) {
+    jsonField(line, "RSSI", rssi);
+    if (rssi == "0") {
+      statusFailed_++;
+    } else {
+      statusAnswered_++;
+      statusDelays_.push_back((t - m.statusRequests.front()) / 1e3);
+    }
+    m.statusRequests.pop_front();
+  } else if (flag == "s" && jsonField(line, "RSSI", rssi) && rssi != "0") {
+    scanReplies_++;
+  }
+}
+
+static void printFrames(FILE *out, const char *title, const FrameStats &s) {
+  fprintf(out, "  %-18s %llu sent, %llu expected receptions, PER %.1f %%\n", title, (unsigned long long)s.sent,
+          (unsigned long long)s.expected, 100.0 * frameErrorRate(s));
+  for (int o = (int)Outcome::Collided; o < (int)Outcome::Count; o++)
+    if (s.outcomes[o])
+      fprintf(out, "  %-18s   %-24s %llu\n", "", outcomeName((Outcome)o), (unsigned long long)s.outcomes[o]);
+}
+
+void Simulator::report(FILE *out) const {
+  const ModemConfig &m = nodes_.empty() ? gateways_[0]->radio().modem() : nodes_[0]->radio().modem();
+  double seconds = sc_.duration;
+
+  fprintf(out, "LoRa network simulation: %d nodes, %d gateway(s)", sc_.nodes, sc_.gateways);
+  if (!relays_.empty())
+    fprintf(out, ", %d relay(s)", (int)relays_.size());
+  fprintf(out, ", %.0f s, seed %llu\n", seconds, (unsigned long long)sc_.seed);
+  fprintf(out, "  %-18s SF%d, %.0f kHz, CR 4/%d, %d B frames take %.1f ms on air\n", "modem", m.spreadingFactor,
+          m.signalBandwidth / 1e3, m.codingRateDenominator, NODE_FRAME_SIZE,
+          timeOnAirMicros(m, NODE_FRAME_SIZE) / 1e3);
+  fprintf(out, "  %-18s %.3f Erlang\n", "offered load", channel_.airtimeMicros() / 1e6 / seconds);
+
+  fprintf(out, "Uplink\n");
+  fprintf(out, "  %-18s %llu created, %llu delivered (%.1f %%), %llu duplicates\n", "sensor messages",
+          (unsigned long long)generated_, (unsigned long long)delivered_,
+          generated_ ? 100.0 * delivered_ / generated_ : 0.0, (unsigned long long)duplicates_);
+  if (suppressed_)
+    fprintf(out, "  %-18s %llu acked again by the gateway but not relayed\n", "retransmissions",
+            (unsigned long long)suppressed_);
+  fprintf(out, "  %-18s %.3f msg/s\n", "throughput", delivered_ / seconds);
+  fprintf(out, "  %-18s mean %.0f, p50 %.0f, p95 %.0f, max %.0f\n", "delay (ms)", mean(uplinkDelays_),
+          percentile(uplinkDelays_, 0.5), percentile(uplinkDelays_, 0.95), percentile(uplinkDelays_, 1.0));
+  printFrames(out, "frames", channel_.uplink());
+
+  fprintf(out, "Downlink\n");
+  if (statusSent_) {
+    fprintf(out, "  %-18s %llu sent, %llu answered, %llu failed\n", "status requests",
+            (unsigned long long)statusSent_, (unsigned long long)statusAnswered_, (unsigned long long)statusFailed_);
+    fprintf(out, "  %-18s mean %.0f, p50 %.0f, p95 %.0f, max %.0f\n", "delay (ms)", mean(statusDelays_),
+            percentile(statusDelays_, 0.5), percentile(statusDelays_, 0.95), percentile(statusDelays_, 1.0));
+  }
+  printFrames(out, "frames", channel_.downlink());
+
+  if (scansSent_) {
+    fprintf(out, "Network scans\n");
+    fprintf(out, "  %-18s %llu sent, %llu reports, %llu status replies relayed\n", "scans",
+            (unsigned long long)scansSent_, (unsigned long long)scanDurations_.size(), (unsigned long long)scanReplies_);
+    if (!scanDurations_.empty()) {
+      fprintf(out, "  %-18s %llu of %llu nodes (%.1f %%)\n", "answered", (unsigned long long)scanAnswered_,
+              (unsigned long long)scanCells_, scanCells_ ? 100.0 * scanAnswered_ / scanCells_ : 0.0);
+      fprintf(out, "  %-18s mean %.1f, max %.1f\n", "report after (s)", mean(scanDurations_),
+              percentile(scanDurations_, 1.0));
+    }
+  }
+
+  uint64_t serialBytes = 0;
+  for (const auto &g : gateways_)
+    serialBytes += g->serialBytesOut();
+  fprintf(out, "Serial link\n  %-18s %llu bytes, %.1f B/s", "gateway output", (unsigned long long)serialBytes,
+          serialBytes / seconds);
+  if (summaries_)
+    fprintf(out, ", %llu link summaries", (unsigned long long)summaries_);
+  fprintf(out, "\n");
+
+  if (channel_.cadChecks())
+    fprintf(out, "Listen before talk\n  %-18s %llu checks, %llu found the channel busy\n", "channel activity",
+            (unsigned long long)channel_.cadChecks(), (unsigned long long)channel_.cadBusy());
+
+  if (!nodes_.empty()) {
+    EnergyUsage usage;
+    for (const auto &n : nodes_) {
+      usage += n->radio().usage(end_);
+      usage.mcuSleeps = n->image().lowPower;
+    }
+    double total = (double)usage.total();
+    fprintf(out, "Energy (nodes)\n");
+    fprintf(out, "  %-18s %.2f mA, about %.0f days on a %.0f mAh battery\n", "average current",
+            averageCurrent(sc_.energy, usage), batteryDays(sc_.energy, usage), sc_.energy.batteryMah);
+    fprintf(out, "  %-18s tx %.2f %%, rx %.1f %%, standby %.1f %%, sleep %.1f %%%s\n", "radio time", 100.0 * usage.tx / total,
+            100.0 * usage.rx / total, 100.0 * usage.standby / total, 100.0 * usage.sleep / total,
+            usage.mcuSleeps ? ", MCU sleeps with the radio" : "");
+  }
+
+  long nodeAirtime = LONG_MAX, relayAirtime = LONG_MAX, gatewayAirtime = LONG_MAX;
+  for (const auto &n : nodes_)
+    nodeAirtime = std::min(nodeAirtime, n->minAirtime());
+  for (const auto &r : relays_)
+    relayAirtime = std::min(relayAirtime, r->minAirtime());
+  for (const auto &g : gateways_)
+    gatewayAirtime = std::min(gatewayAirtime, g->minAirtime());
+  if (gatewayAirtime != LONG_MAX) {
+    fprintf(out, "Duty cycle\n  %-18s lowest left: nodes %ld ms, ", "airtime budget",
+            nodeAirtime == LONG_MAX ? 0 : nodeAirtime);
+    if (relayAirtime != LONG_MAX)
+      fprintf(out, "relays %ld ms, ", relayAirtime);
+    fprintf(out, "gateways %ld ms\n", gatewayAirtime);
+  }
+}
+
+/**
+ * @brief Appends the headline figures of this run as one CSV row, writing the header first if the
+ *        file is new, so parameter sweeps can be collected in a single file
+ *
+ * @param path CSV file
+ */
+void Simulator::appendCsv(const std::string &path) const {
+  FILE *f = fopen(path.c_str(), "a+");
+  if (!f) {
+    perror(path.c_str());
+    return;
+  }
+  fseek(f, 0, SEEK_END);
+  if (ftell(f) == 0)
+    fprintf(f, "nodes,gateways,duration,sf,bw,cr,seed,created,delivered,delivery_ratio,throughput,"
+               "delay_mean_ms,delay_p50_ms,delay_p95_ms,ul_frames,ul_per,dl_frames,dl_per,load\n");
+
+  const ModemConfig &m = nodes_.empty() ? gateways_[0]->radio().modem() : nodes_[0]->radio().modem();
+  fprintf(f, "%d,%d,%.0f,%d,%ld,%d,%llu,%llu,%llu,%.4f,%.4f,%.1f,%.1f,%.1f,%llu,%.4f,%llu,%.4f,%.4f\n", sc_.nodes,
+          sc_.gateways, sc_.duration, m.spreadingFactor, m.signalBandwidth, m.codingRateDenominator,
+          (unsigned long long)sc_.seed, (unsigned long long)generated_, (unsigned long long)delivered_,
+          generated_ ? (double)delivered_ / generated_ : 0.0, delivered_ / sc_.duration, mean(uplinkDelays_),
+          percentile(uplinkDelays_, 0.5), percentile(uplinkDelays_, 0.95),
+          (unsigned long long)channel_.uplink().sent, frameErrorRate(channel_.uplink()),
+          (unsigned long long)channel_.downlink().sent, frameErrorRate(channel_.downlink()),
+          channel_.airtimeMicros() / 1e6 / sc_.duration);
+  fclose(f);
+}
+
+}
@@ -0,0 +1,147 @@
+/**
+ * @file simulator.h
+ * @brief Discrete-event simulation of a LoRa sensor network running the real node and gateway firmware.
+ *        Builds the deployment, drives sensors and the server link, and collects end-to-end metrics
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SIM_SIMULATOR_H
+#define SIM_SIMULATOR_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <deque>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "channel.h"
+#include "device.h"
+#include "energy.h"
+
+namespace sim {
+
+/**
+ * @brief Deployment and traffic settings of one simulation run
+ *
+ */
+struct Scenario {
+  int nodes = 50;
+  int gateways = 1;
+  double duration = 3600;          ///< simulated time, in s
+  double sensorRate = 6;           ///< motion events per node per hour
+  double pulse = 2;                ///< time the sensor output stays high, in s
+  double settle = 30;              ///< no new sensor events during the last settle seconds
+  double radius = 1000;            ///< radius of the disc the nodes of a cell are spread over, in m
+  int relays = 0;                  ///< relay nodes per gateway, evenly spaced on a ring around it
+  double relayDistance = 0.6;      ///< radius of that ring, as a fraction of radius
+  double statusRate = 0;           ///< status requests sent by the server per gateway per hour
+  double traceDump = 0;            ///< period the server asks the gateways for their latency trace, in s
+  double scan = 0;                 ///< period the server rescans every cell with a broadcast status request, in s
+  int spreadingFactor = 0;         ///< overrides the firmware modem setting after boot when non-zero
+  long signalBandwidth = 0;
+  int codingRateDenominator = 0;
+  double nodeTick = 0.25;          ///< period nodes run loop() when nothing else wakes them, in s
+  double gatewayTick = 0.01;       ///< same for gateways, in s
+  uint64_t seed = 1;
+  LinkModel link;
+  EnergyModel energy;
+  bool verbose = false;
+};
+
+enum class EventKind {
+  Tick,
+  Interrupt,
+  Poll,
+  SensorHigh,
+  SensorLow,
+  StatusRequest,
+  TraceDump,
+  Scan,
+  FrameEnd
+};
+
+struct Event {
+  uint64_t time;
+  uint64_t seq;
+  EventKind kind;
+  Device *device;
+  std::shared_ptr<Transmission> tx;
+
+  bool operator>(const Event &o) const { return time != o.time ? time > o.time : seq > o.seq; }
+};
+
+class Simulator {
+ public:
+  explicit Simulator(const Scenario &scenario);
+
+  void run();
+  void report(FILE *out) const;
+  void appendCsv(const std::string &path) const;
+
+  uint64_t now() const { return now_; }
+  Channel &channel() { return channel_; }
+  void schedule(uint64_t time, EventKind kind, Device *device, std::shared_ptr<Transmission> tx = nullptr);
+  void interrupt(Device &device, uint64_t time);
+
+  void onBoot(Device &device);
+  void onUplinkCreated(Device &node, uint8_t msgID, uint64_t t);
+  void onSerialLine(Device &device, const std::string &line, uint64_t t);
+
+ private:
+  /**
+   * @brief Per-node bookkeeping of messages created by the firmware and seen by the server
+   *
+   */
+  struct NodeMetrics {
+    uint64_t created[256];
+    bool open[256];
+    std::deque<uint64_t> statusRequests;
+  };
+
+  void dispatch(const Event &ev);
+  void step(Device &device, EventKind kind);
+  uint64_t secondsToMicros(double s) const { return (uint64_t)(s * 1e6); }
+  double exponential(double perHour);
+  int nodeIndex(uint8_t netID, uint8_t address) const;
+
+  Scenario sc_;
+  Channel channel_;
+  std::vector<std::unique_ptr<Device>> gateways_;
+  std::vector<std::unique_ptr<Device>> nodes_;
+  std::vector<std::unique_ptr<Device>> relays_;
+  std::vector<NodeMetrics> metrics_;
+  std::vector<std::vector<int>> addressBook_;
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>> queue_;
+  std::mt19937_64 rng_;
+  uint64_t now_;
+  uint64_t seq_;
+  uint64_t end_;
+
+  uint64_t generated_;
+  uint64_t delivered_;
+  uint64_t duplicates_;
+  uint64_t suppressed_;
+  std::vector<double> uplinkDelays_;
+  uint64_t statusSent_;
+  uint64_t statusAnswered_;
+  uint64_t statusFailed_;
+  std::vector<double> statusDelays_;
+  uint64_t summaries_;
+  std::vector<std::deque<uint64_t>> scanRequests_;
+  uint64_t scansSent_;
+  uint64_t scanReplies_;
+  uint64_t scanAnswered_;
+  uint64_t scanCells_;
+  std::vector<double> scanDurations_;
+};
+
+}
+
+#endif
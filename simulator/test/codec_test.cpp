@@ -0,0 +1,136 @@
+/**
+ * @file codec_test.cpp
+ * @brief Checks that the node and gateway firmware agree on the message layout: a sensor reading packed by
+ *        the node is decoded by the gateway, the gateway's ack and actuator command are decoded by the node,
+ *        and every field sits at the offset of wsn::Single. Sensor and actuator IDs go through unchanged,
+ *        from the node to the server record and from the server command to the node's actuator pin
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <stdio.h>
+#include <string>
+
+#include <Arduino.h>
+#include <wsn_codec.h>
+
+#include "channel.h"
+#include "device.h"
+#include "simulator.h"
+#include "codec_test.h"
+
+using namespace codec_test;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+/**
+ * @brief Checks the fields of a single block message at their byte offsets: NodeID 0, MsgID 1, Len 2,
+ *        Type 3, A 4, B 5, Vbat 6, zero padding up to the block size
+ *
+ */
+static void checkSingle(const Frame &plain, uint8_t nodeID, uint8_t msgID, uint8_t type, uint8_t a, uint8_t b,
+                        uint8_t vbat) {
+  CHECK(plain.size() == 16);
+  if (plain.size() != 16)
+    return;
+  CHECK(plain[0] == nodeID);
+  CHECK(plain[1] == msgID);
+  CHECK((plain[2] & ~LEN_RX_WINDOW) == 16);
+  CHECK(plain[3] == type);
+  CHECK(plain[4] == a);
+  CHECK(plain[5] == b);
+  CHECK(plain[6] == vbat);
+  for (int i = 7; i < 16; i++)
+    CHECK(plain[i] == 0);
+}
+
+int main() {
+  sim::Scenario sc;
+  sc.nodes = 0;
+  sim::Simulator simulator(sc);
+  sim::Device gateway(simulator, sim::gatewayImage, sim::Role::Gateway, 100, 0xF3, 0xFF, 0, 0, 1);
+  sim::Device node(simulator, sim::nodeImage, sim::Role::Node, 101, 0xF3, 1, 100, 0, 2);
+  gateway.run(0);
+  node.run(0);
+  uint64_t t = 1000000;
+
+  // Sensor reading, node to gateway. Sensor 0 stays 0 on the air and in the server record
+  if (nodeSendsSingles()) {
+    Frame frame;
+    Frame nodeView;
+    node.call(t, [&] {
+      frame = nodeSensorFrame(0, 255);
+      nodeView = nodePlaintext(frame);
+    });
+    CHECK(frame.size() == 2 + 17);
+    CHECK(frame.size() >= 2 && frame[0] == 0xF3 && frame[1] == 1);
+
+    Frame plain;
+    std::string record;
+    gateway.call(t, [&] {
+      plain = gatewayPlaintext(frame);
+      record = gatewayReceive(frame, -60, 8.0f);
+    });
+    CHECK(plain == nodeView);
+    uint8_t msgID = plain.size() > 1 ? plain[1] : 0;
+    checkSingle(plain, 1, msgID, wsn::MSG_UPLINK, 0, 255, wsn::vbatTenths(1.0));
+    if (gatewayJsonRecords()) {
+      CHECK(record.find("\"f\":\"u\"") != std::string::npos);
+      CHECK(record.find("\"nID\":\"1\"") != std::string::npos);
+      CHECK(record.find("\"sID\":\"0\"") != std::string::npos);
+      CHECK(record.find("\"sVal\":\"255\"") != std::string::npos);
+    }
+
+    // The gateway's ack carries the msgID and, in field A, the bitmap of earlier msgIDs with the top bit set
+    Frame ack;
+    gateway.call(t, [&] { ack = gatewayQueuedFrame('a'); });
+    Frame ackPlain;
+    node.call(t, [&] { ackPlain = nodePlaintext(ack); });
+    CHECK(ack.size() == 2 + 17);
+    // Nothing was received before this message, so the bitmap is empty
+    checkSingle(ackPlain, 1, msgID, wsn::MSG_ACK, 0x80, 0, 0);
+  }
+
+  // Actuator command, server to node. Actuator 0 is the node's first actuator pin
+  Frame cmd;
+  gateway.call(t, [&] {
+    gatewayCommand("c,1,0,1");
+    cmd = gatewayQueuedFrame('c');
+  });
+  CHECK(cmd.size() == 2 + 17);
+  Frame cmdPlain;
+  node.call(t, [&] { cmdPlain = nodePlaintext(cmd); });
+  uint8_t cmdID = cmdPlain.size() > 1 ? cmdPlain[1] : 0;
+  checkSingle(cmdPlain, 1, cmdID, wsn::MSG_CONTROL, 0, 1, 0);
+
+  sim::Transmission tx;
+  tx.id = 1;
+  tx.sender = &gateway.radio();
+  tx.frame = cmd;
+  tx.start = t;
+  tx.end = t + 50000;
+  CHECK(node.digitalRead(LED_BUILTIN) == 0);
+  // The node polls the radio from its loop. A low-power node only listens in the window after its frames
+  node.call(t, nodeListen);
+  node.radio().deliver(tx, -60, 8);
+  node.run(tx.end);
+  CHECK(node.digitalRead(LED_BUILTIN) == 1);
+
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("codec test passed\n");
+  return 0;
+}
@@ -0,0 +1,39 @@
+/**
+ * @file codec_test.h
+ * @brief Host test of the message layout the node and gateway firmware agree on. The node and gateway
+ *        headers cannot share a translation unit, so each side is reached through the helpers below, built
+ *        against the firmware images of the simulator. Frames are on-air frames: netID, nodeID, ciphertext
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SIM_CODEC_TEST_H
+#define SIM_CODEC_TEST_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace codec_test {
+
+typedef std::vector<uint8_t> Frame;
+
+// Node side, run with the node device active
+bool nodeSendsSingles();
+Frame nodeSensorFrame(uint8_t sensorID, uint8_t sensorVal);
+Frame nodePlaintext(const Frame &frame);
+void nodeListen();
+
+// Gateway side, run with the gateway device active
+bool gatewayJsonRecords();
+Frame gatewayPlaintext(const Frame &frame);
+std::string gatewayReceive(const Frame &frame, int rssi, float snr);
+void gatewayCommand(const char *cmd);
+Frame gatewayQueuedFrame(char flag);
+
+}
+
+#endif
@@ -0,0 +1,116 @@
+/**
+ * @file gateway_codec.cpp
+ * @brief Gateway side of the codec test, see codec_test.h
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <string.h>
+#include <algorithm>
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <LoRa.h>
+#include <cppQueue.h>
+#include <aes256.h>
+#include <wsn_codec.h>
+#include <wsn_trace.h>
+
+#include "firmware_image.h"
+#include "codec_test.h"
+
+namespace gateway_fw {
+
+#include "gateway_definitions_sim.h"
+#include "../../gateway_serial/comms_protocol.h"
+
+}
+
+namespace codec_test {
+
+/**
+ * @brief Whether the gateway relays its records to the server as JSON lines
+ *
+ */
+bool gatewayJsonRecords() {
+  return SERIAL_PROTOCOL == SERIAL_JSON;
+}
+
+/**
+ * @brief Decrypts a frame heard by the gateway with the key of the node it comes from
+ *
+ * @param frame frame as received
+ * @return Frame first plaintext block, empty for unregistered nodes
+ */
+Frame gatewayPlaintext(const Frame &frame) {
+  aes256_context *ctxt = gateway_fw::getKeySchedule(frame[1]);
+  if (ctxt == NULL)
+    return Frame();
+  char buf[MAX_PAYLOAD_SIZE+1] = {0};
+  memcpy(buf, frame.data() + 2, std::min((int)frame.size() - 2, MAX_PAYLOAD_SIZE));
+  const uint8_t *plain = (const uint8_t *)gateway_fw::decryptMsg(ctxt, buf);
+  return Frame(plain, plain + BLOCK_SIZE);
+}
+
+/**
+ * @brief Hands a frame to the gateway's packet handler and returns the record it relays for it
+ *
+ * @param frame frame as received
+ * @param rssi RSSI of the frame, in dBm
+ * @param snr SNR of the frame, in dB
+ * @return std::string last record queued for the server, empty if none
+ */
+std::string gatewayReceive(const Frame &frame, int rssi, float snr) {
+  char rec[RELAY_BUFFER_SIZE];
+  while (gateway_fw::relayPop(rec) > 0)
+    ;
+
+  gateway_fw::RxPacket pkt;
+  pkt.len = (byte)std::min((int)frame.size(), MAX_RX_FRAME_SIZE);
+  memcpy(pkt.data, frame.data(), pkt.len);
+  pkt.rssi = rssi;
+  pkt.snr = snr;
+  gateway_fw::handlePacket(&pkt);
+
+  std::string last;
+  int n;
+  while ((n = gateway_fw::relayPop(rec)) > 0)
+    last.assign(rec, n);
+  return last;
+}
+
+/**
+ * @brief Passes a server command line to the gateway, as if read from the serial port
+ *
+ * @param cmd command, e.g. "c,1,0,1"
+ */
+void gatewayCommand(const char *cmd) {
+  char buf[MAX_LINE_SIZE];
+  strncpy(buf, cmd, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = '\0';
+  gateway_fw::relayDownlinkMsg(buf);
+}
+
+/**
+ * @brief Takes the first message with the given flag off the gateway's send queue, dropping the ones
+ *        before it, and returns the frame the gateway sends for it
+ *
+ * @param flag message type, e.g. 'a' or 'c'
+ * @return Frame the frame, empty if none is queued
+ */
+Frame gatewayQueuedFrame(char flag) {
+  gateway_fw::Msg msg;
+  while (gateway_fw::msg_q.pop(&msg)) {
+    if (msg.flag == flag) {
+      Frame f = {gateway_fw::netID, msg.nodeID};
+      f.insert(f.end(), msg.msg, msg.msg + MAX_ENC_PAYLOAD_SIZE);
+      return f;
+    }
+  }
+  return Frame();
+}
+
+}
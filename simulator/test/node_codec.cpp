@@ -0,0 +1,87 @@
+/**
+ * @file node_codec.cpp
+ * @brief Node side of the codec test, see codec_test.h
+ * @version 1.0
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <string.h>
+#include <algorithm>
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <LoRa.h>
+#include <cppQueue.h>
+#include <aes256.h>
+#include <wsn_codec.h>
+#include <wsn_trace.h>
+#include <wsn_log.h>
+
+#include "firmware_image.h"
+#include "codec_test.h"
+
+namespace node_fw {
+
+#include "node_definitions_sim.h"
+#include "../../node/comms_protocol.h"
+
+}
+
+namespace codec_test {
+
+/**
+ * @brief Whether a sensor reading goes out on its own, in a single block message, rather than in a batch
+ *
+ */
+bool nodeSendsSingles() {
+  return BATCH_MAX_READINGS <= 1;
+}
+
+/**
+ * @brief Queues a sensor reading on the node and returns the frame it would send for it
+ *
+ * @param sensorID ID of the sensor
+ * @param sensorVal value of the reading
+ * @return Frame the frame, empty if the firmware queued none
+ */
+Frame nodeSensorFrame(uint8_t sensorID, uint8_t sensorVal) {
+  node_fw::sendSensorData(sensorID, sensorVal);
+  node_fw::Msg msg;
+  while (node_fw::msg_q.pop(&msg)) {
+    if (msg.flag == 'u') {
+      Frame f = {node_fw::netID, node_fw::nodeID};
+      f.insert(f.end(), msg.msg, msg.msg + msg.len);
+      return f;
+    }
+  }
+  return Frame();
+}
+
+/**
+ * @brief Decrypts a frame heard by the node, with the broadcast key for broadcast frames
+ *
+ * @param frame frame as received
+ * @return Frame first plaintext block
+ */
+Frame nodePlaintext(const Frame &frame) {
+  char buf[MAX_PAYLOAD_SIZE+1] = {0};
+  memcpy(buf, frame.data() + 2, std::min((int)frame.size() - 2, MAX_PAYLOAD_SIZE));
+  aes256_context *ctxt = (frame[1] == BROADCAST_ID) ? &node_fw::ctxtBroadcast : &node_fw::ctxtNode;
+  const uint8_t *plain = (const uint8_t *)node_fw::decryptMsg(ctxt, buf);
+  return Frame(plain, plain + BLOCK_SIZE);
+}
+
+/**
+ * @brief Opens the receive window of the node and puts its radio in receive mode, as a low-power node does
+ *        after each of its frames
+ *
+ */
+void nodeListen() {
+  node_fw::rxWindowEnd = millis() + RX_WINDOW;
+  node_fw::LoRa_rxMode();
+}
+
+}